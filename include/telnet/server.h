@@ -3,24 +3,133 @@
 #include "sdkconfig.h"
 
 #include <libtelnet.h>
+#include <telnet/transport.h>
+
+#include <stdbool.h>
 
 static const telnet_telopt_t default_telopts[] = {
   {TELNET_TELOPT_COMPRESS2, TELNET_WILL, TELNET_DO}, {TELNET_TELOPT_ZMP, TELNET_WILL, TELNET_DO},
   {TELNET_TELOPT_MSSP, TELNET_WILL, TELNET_DONT},    {TELNET_TELOPT_NEW_ENVIRON, TELNET_WILL, TELNET_DONT},
   {TELNET_TELOPT_TTYPE, TELNET_WILL, TELNET_DONT},   {-1, 0, 0}};
 
-struct user_t {
-  char* name;
-  int sock;
-  telnet_t* telnet;
-  char linebuf[255];
-  int linepos;
-};
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief How dead peers are detected on quiet sessions.
+ */
+enum telnet_keepalive {
+  TELNET_KEEPALIVE_NONE = 0,    /*!< rely on recv() errors only */
+  TELNET_KEEPALIVE_TCP,         /*!< TCP keepalive (SO_KEEPALIVE) */
+  TELNET_KEEPALIVE_NOP,         /*!< send IAC NOP, a dead peer makes the TCP stack fail */
+  TELNET_KEEPALIVE_TIMING_MARK, /*!< send IAC DO TIMING-MARK and expect a reply */
+};
+
+typedef enum telnet_keepalive telnet_keepalive_t;
+
+/**
+ * @brief Identifies a session across tasks.
+ *
+ * Carries a generation counter, so the id of a closed session never addresses a later session
+ * that reuses its slot.
+ */
+typedef uint32_t telnet_session_id_t;
+
+#define TELNET_SESSION_INVALID 0
+
+/**
+ * @brief Session life cycle events reported to telnet_server_config_t::on_session.
+ */
+enum telnet_session_event {
+  TELNET_SESSION_LOGIN,  /*!< the user entered a valid name */
+  TELNET_SESSION_CLOSED, /*!< a logged in session was closed */
+};
+
+typedef enum telnet_session_event telnet_session_event_t;
+
+/**
+ * @brief What happens to a message published to a subscriber whose channel queue is full.
+ */
+enum telnet_drop_policy {
+  TELNET_DROP_NEWEST = 0, /*!< discard the new message */
+  TELNET_DROP_OLDEST,     /*!< discard the oldest queued message, for streams where only recent data matters */
+  TELNET_DROP_CLOSE,      /*!< close the session, for streams that must not have gaps */
+};
+
+typedef enum telnet_drop_policy telnet_drop_policy_t;
+
+typedef int telnet_channel_id_t;
+
+#define TELNET_CHANNEL_INVALID -1
+
+/**
+ * @brief Called from the server task, must not block.
+ */
+typedef void (*telnet_session_cb_t)(telnet_session_id_t session, telnet_session_event_t event, const char* name, void* arg);
+
+/**
+ * @brief Running command, passed to command handlers.
+ */
+typedef struct telnet_cmd telnet_cmd_t;
+
+/**
+ * @brief Command handler, `args` is the rest of the input line after the command name.
+ */
+typedef void (*telnet_command_fn_t)(telnet_cmd_t* cmd, const char* args, void* arg);
+
+/**
+ * @brief Produces the next chunk of a streaming command's output.
+ *
+ * @return Number of bytes written to `buffer` (at most `size`), 0 at the end of the output.
+ */
+typedef size_t (*telnet_stream_fn_t)(void* state, char* buffer, size_t size);
+
+/**
+ * @brief Entry of the command table, see telnet_server_config_t::commands.
+ */
+struct telnet_command {
+  const char* name;
+  telnet_command_fn_t fn;
+  void* arg;
+  bool async; /*!< run on a worker task, for handlers that take longer than a few milliseconds */
+};
+
+typedef struct telnet_command telnet_command_t;
+
+/**
+ * @brief Application that takes over the input of every session, see telnet_server_config_t::handler.
+ *
+ * All callbacks run on the server task and must not block. Sessions start without a prompt, the
+ * handler names them with telnet_server_login() and writes with telnet_server_write().
+ */
+struct telnet_handler {
+  void* (*open)(telnet_session_id_t session, void* arg); /*!< returns the context of a new session */
+  void (*line)(void* ctx, const char* line);             /*!< a complete input line */
+  void (*close)(void* ctx);                              /*!< the session closed, release the context */
+  void* arg;
+};
+
+typedef struct telnet_handler telnet_handler_t;
+
+/**
+ * @brief Constant text already NVT encoded, sent with one append and no formatting or escaping.
+ *
+ * Lines end in CR LF, a lone CR is followed by NUL and IAC bytes are doubled. Encoded literals are
+ * written with TELNET_TEXT(), other text is encoded once with telnet_text_encode().
+ */
+struct telnet_text {
+  const char* data;
+  size_t len;
+};
+
+typedef struct telnet_text telnet_text_t;
+
+/**
+ * @brief telnet_text_t of a string literal that is already NVT encoded.
+ */
+#define TELNET_TEXT(literal) {(literal), sizeof(literal) - 1}
+
 struct telnet_server_config {
   int port;
   int stack_size;
@@ -28,28 +137,265 @@ struct telnet_server_config {
   int task_core;
   int redirect_logs;
   int max_connections;
+  int backlog;
   const telnet_telopt_t *telnet_opts;
+  const telnet_transport_t *transport;
+  int login_timeout_ms;
+  int idle_timeout_ms;
+  telnet_keepalive_t keepalive;
+  int keepalive_interval_ms;
+  /* unanswered TIMING-MARK probes before the session is closed, 1 to 255 */
+  int keepalive_count;
+  /* interval of TIMING-MARK round trip measurements, 0 for on demand only */
+  int rtt_interval_ms;
+  /* echo keystrokes on the server instead of letting the client edit lines */
+  int character_mode;
+  /* in character mode, let clients that support LINEMODE edit lines locally */
+  int linemode;
+  int read_budget;
+  int output_queue_limit;
+  int output_low_water;
+  int send_queue_size;
+  int channel_queue_len;
+  telnet_session_cb_t on_session;
+  void* session_arg;
+  /* commands of logged in users, terminated by an entry with a NULL name */
+  const telnet_command_t* commands;
+  int workers;
+  int worker_stack_size;
+  /* replaces the built-in login and commands, see telnet/session.hpp for coroutines */
+  const telnet_handler_t* handler;
+  /* sent after a successful login, must outlive the server */
+  telnet_text_t motd;
 };
 
 /**
  * @brief Telnet Server Default Configuration
  *
  */
-#define TELNET_SERVER_DEFAULT_CONFIG                         \
-{                                                            \
-    .port = CONFIG_TELNET_SERVER_DEFAULT_PORT,               \
-    .stack_size = CONFIG_TELNET_SERVER_STACK_SIZE,           \
-    .task_priority = CONFIG_TELNET_SERVER_TASK_PRIORITY,     \
-    .task_core = CONFIG_TELNET_SERVER_TASK_CORE,             \
-    .redirect_logs = CONFIG_TELNET_SERVER_REDIRECT_LOGS,     \
-    .max_connections = CONFIG_TELNET_SERVER_MAX_CONNECTIONS, \
-    .telnet_opts = default_telopts,                          \
+#define TELNET_SERVER_DEFAULT_CONFIG                                         \
+{                                                                            \
+    .port = CONFIG_TELNET_SERVER_DEFAULT_PORT,                               \
+    .stack_size = CONFIG_TELNET_SERVER_STACK_SIZE,                           \
+    .task_priority = CONFIG_TELNET_SERVER_TASK_PRIORITY,                     \
+    .task_core = CONFIG_TELNET_SERVER_TASK_CORE,                             \
+    .redirect_logs = CONFIG_TELNET_SERVER_REDIRECT_LOGS,                     \
+    .max_connections = CONFIG_TELNET_SERVER_MAX_CONNECTIONS,                 \
+    .backlog = CONFIG_TELNET_SERVER_LISTEN_BACKLOG,                          \
+    .telnet_opts = default_telopts,                                          \
+    .transport = NULL,                                                       \
+    .login_timeout_ms = CONFIG_TELNET_SERVER_LOGIN_TIMEOUT * 1000,           \
+    .idle_timeout_ms = CONFIG_TELNET_SERVER_IDLE_TIMEOUT * 1000,             \
+    .keepalive = (telnet_keepalive_t)CONFIG_TELNET_SERVER_KEEPALIVE,         \
+    .keepalive_interval_ms = CONFIG_TELNET_SERVER_KEEPALIVE_INTERVAL * 1000, \
+    .keepalive_count = CONFIG_TELNET_SERVER_KEEPALIVE_COUNT,                 \
+    .rtt_interval_ms = CONFIG_TELNET_SERVER_RTT_INTERVAL * 1000,             \
+    .character_mode = CONFIG_TELNET_SERVER_CHARACTER_MODE,                   \
+    .linemode = CONFIG_TELNET_SERVER_LINEMODE,                               \
+    .read_budget = CONFIG_TELNET_SERVER_READ_BUDGET,                         \
+    .output_queue_limit = CONFIG_TELNET_SERVER_OUTPUT_QUEUE_LIMIT,           \
+    .output_low_water = CONFIG_TELNET_SERVER_OUTPUT_LOW_WATER,               \
+    .send_queue_size = CONFIG_TELNET_SERVER_SEND_QUEUE_SIZE,                 \
+    .channel_queue_len = CONFIG_TELNET_SERVER_CHANNEL_QUEUE_LEN,             \
+    .on_session = NULL,                                                      \
+    .session_arg = NULL,                                                     \
+    .commands = NULL,                                                        \
+    .workers = CONFIG_TELNET_SERVER_WORKERS,                                 \
+    .worker_stack_size = CONFIG_TELNET_SERVER_WORKER_STACK_SIZE,             \
+    .handler = NULL,                                                         \
+    .motd = {NULL, 0},                                                       \
 }
 
 typedef struct telnet_server_config telnet_server_config_t;
 
+/**
+ * @brief Statistics of a session, see telnet_server_session_stats().
+ *
+ * Round trip times are measured with IAC DO TIMING-MARK (RFC 860) and smoothed like TCP does
+ * (RFC 6298): `rtt_ms` moves by 1/8 and `rtt_var_ms` by 1/4 of each new sample.
+ */
+struct telnet_session_stats {
+  uint32_t rtt_ms;      /*!< smoothed round trip time, 0 before the first sample */
+  uint32_t rtt_var_ms;  /*!< smoothed deviation of the round trip time (jitter) */
+  uint32_t rtt_last_ms; /*!< latest sample */
+  uint32_t rtt_samples; /*!< number of samples */
+  size_t queued;        /*!< output bytes waiting for the socket */
+};
+
+typedef struct telnet_session_stats telnet_session_stats_t;
+
 esp_err_t telnet_server_create(telnet_server_config_t* config);
 
+/**
+ * @brief Starts the server in the calling task instead of creating one.
+ *
+ * Together with telnet_server_poll() this allows driving the server loop step by step,
+ * e.g. on top of the in-memory transport from telnet/transport_mem.h.
+ */
+esp_err_t telnet_server_start(const telnet_server_config_t* config);
+
+/**
+ * @brief Runs one iteration of the server loop, waiting up to `timeout_ms` for events.
+ */
+esp_err_t telnet_server_poll(int timeout_ms);
+
+/**
+ * @brief Closes all sessions and the listening socket of a started server.
+ */
+void telnet_server_stop(void);
+
+/**
+ * @brief Allocates a buffer for telnet_server_send() or telnet_server_broadcast().
+ *
+ * With `CONFIG_TELNET_SERVER_STATIC_ALLOCATION` buffers come from a fixed pool and hold at most 512 bytes.
+ *
+ * @return Buffer with room for `size` bytes, or NULL if memory is exhausted.
+ */
+char* telnet_server_alloc(size_t size);
+
+/**
+ * @brief Releases a buffer from telnet_server_alloc() that was not sent.
+ */
+void telnet_server_free(char* buffer);
+
+/**
+ * @brief Queues text for one session, may be called from any task.
+ *
+ * The buffer must come from telnet_server_alloc() and is moved to the server task, which
+ * releases it in every case, including errors. Sessions that closed meanwhile are skipped.
+ * Must not be called concurrently with telnet_server_stop().
+ *
+ * @param session Session id passed to telnet_server_config_t::on_session.
+ * @param buffer Buffer from telnet_server_alloc().
+ * @param size Number of bytes to send.
+ * @param timeout_ms Time to wait for room in a full queue: 0 drops immediately, -1 waits forever.
+ *        Must be 0 when called from the server task.
+ * @return `ESP_OK` if queued, `ESP_ERR_TIMEOUT` if dropped, `ESP_ERR_INVALID_STATE` if the server is not running.
+ */
+esp_err_t telnet_server_send(telnet_session_id_t session, char* buffer, size_t size, int timeout_ms);
+
+/**
+ * @brief Queues text for all logged in sessions, see telnet_server_send().
+ */
+esp_err_t telnet_server_broadcast(char* buffer, size_t size, int timeout_ms);
+
+/**
+ * @brief Creates a named channel, or returns the existing one with that name.
+ *
+ * Must be called before the server starts or from the server task (e.g. from `on_session`).
+ * Logged in users join and leave channels by typing `/join <name>` and `/leave <name>`.
+ *
+ * @param name Channel name, shorter than 16 characters.
+ * @param policy Applied when a subscriber's queue of `channel_queue_len` messages is full.
+ * @return The channel, or TELNET_CHANNEL_INVALID if the name is invalid or the channel table is full.
+ */
+telnet_channel_id_t telnet_server_channel(const char* name, telnet_drop_policy_t policy);
+
+/**
+ * @brief Adds a session to a channel, must be called from the server task.
+ */
+esp_err_t telnet_server_subscribe(telnet_session_id_t session, telnet_channel_id_t channel);
+
+/**
+ * @brief Removes a session from a channel, must be called from the server task.
+ */
+esp_err_t telnet_server_unsubscribe(telnet_session_id_t session, telnet_channel_id_t channel);
+
+/**
+ * @brief Queues text for all members of a channel, may be called from any task.
+ *
+ * The buffer is shared by all members instead of being copied, otherwise it behaves like
+ * telnet_server_send().
+ */
+esp_err_t telnet_server_publish(telnet_channel_id_t channel, char* buffer, size_t size, int timeout_ms);
+
+/**
+ * @brief Writes text to a session, must be called from the server task.
+ *
+ * @return `ESP_OK`, or `ESP_ERR_NOT_FOUND` if the session is closed.
+ */
+esp_err_t telnet_server_write(telnet_session_id_t session, const char* text, size_t size);
+
+/**
+ * @brief Writes pre-encoded text to a session with one append, must be called from the server task.
+ *
+ * @return `ESP_OK`, or `ESP_ERR_NOT_FOUND` if the session is closed.
+ */
+esp_err_t telnet_server_write_text(telnet_session_id_t session, telnet_text_t text);
+
+/**
+ * @brief Reads the statistics of a session, must be called from the server task.
+ *
+ * @return `ESP_OK`, or `ESP_ERR_NOT_FOUND` if the session is closed.
+ */
+esp_err_t telnet_server_session_stats(telnet_session_id_t session, telnet_session_stats_t* stats);
+
+/**
+ * @brief Starts a round trip measurement unless one is outstanding, must be called from the server task.
+ *
+ * The result shows up in telnet_server_session_stats() once the client answered.
+ *
+ * @return `ESP_OK`, or `ESP_ERR_NOT_FOUND` if the session is closed.
+ */
+esp_err_t telnet_server_measure_rtt(telnet_session_id_t session);
+
+/**
+ * @brief Names a session of a telnet_handler_t, must be called from the server task.
+ *
+ * Stops the login timeout, makes the session receive broadcasts and reports it to `on_session`.
+ *
+ * @return `ESP_OK`, `ESP_ERR_INVALID_ARG` for an empty or too long name or one with control characters,
+ *         `ESP_ERR_INVALID_STATE` if the name is in use or the session already has one, `ESP_ERR_NOT_FOUND` if the
+ *         session is closed.
+ */
+esp_err_t telnet_server_login(telnet_session_id_t session, const char* name);
+
+/**
+ * @brief Closes a session at the end of the current server loop iteration, must be called from the server task.
+ */
+esp_err_t telnet_server_close(telnet_session_id_t session);
+
+/**
+ * @brief NVT encodes `text` for a telnet_text_t, e.g. once at startup.
+ *
+ * @return Length of the encoded text. Nothing is written if it is larger than `size`.
+ */
+size_t telnet_text_encode(char* buffer, size_t size, const char* text);
+
+/**
+ * @brief Prints to the session that runs a command.
+ *
+ * Asynchronous commands stream their output to the server task and wait while its queue is
+ * full; output of a cancelled command is dropped.
+ *
+ * @return Number of characters printed, or -1 if the output was dropped.
+ */
+int telnet_cmd_printf(telnet_cmd_t* cmd, const char* fmt, ...) TELNET_GNU_PRINTF(2, 3);
+
+/**
+ * @brief Streams the output of a synchronous command from a generator.
+ *
+ * Instead of printing everything at once, the server calls `next` for another chunk whenever
+ * the session's output queue drops below `output_low_water`, so memory use does not depend on
+ * the size of the output. The command counts as running until `next` returns 0 or the user
+ * presses Ctrl-C; `release` (may be NULL) is then called with `state`.
+ *
+ * @return `ESP_OK`, or `ESP_ERR_INVALID_STATE` for asynchronous commands and if a stream is already running.
+ */
+esp_err_t telnet_cmd_stream(telnet_cmd_t* cmd, telnet_stream_fn_t next, void (*release)(void* state), void* state);
+
+/**
+ * @brief Returns `true` once the user pressed Ctrl-C (IAC IP or BREAK) or the session closed.
+ *
+ * Long running handlers should poll this and return early.
+ */
+bool telnet_cmd_cancelled(const telnet_cmd_t* cmd);
+
+/**
+ * @brief Returns the session that runs a command.
+ */
+telnet_session_id_t telnet_cmd_session(const telnet_cmd_t* cmd);
+
 #ifdef __cplusplus
 }
 #endif
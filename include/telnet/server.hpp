@@ -0,0 +1,224 @@
+#pragma once
+
+#include <telnet/server.h>
+
+#include <array>
+#include <cstddef>
+
+/**
+ * @brief Server configured at compile time for fixed deployments.
+ *
+ * Sizes, the telopt set and compression are template parameters instead of runtime settings,
+ * so invalid combinations fail to compile and the configuration and telopt table end up as
+ * constants in flash:
+ * @code
+ * struct Options : telnet::DefaultOptions {
+ *   static constexpr int max_sessions = 2;
+ *   static constexpr bool compression = false;
+ * };
+ *
+ * static telnet::TelnetServer<Options> server;
+ * server.config().on_session = on_session;
+ * server.create();
+ * @endcode
+ * There is one server per application, see telnet_server_create().
+ */
+namespace telnet {
+
+/**
+ * @brief Defaults from Kconfig, applications derive from this and shadow what they change.
+ */
+struct DefaultOptions {
+  static constexpr int port = CONFIG_TELNET_SERVER_DEFAULT_PORT;
+  static constexpr int max_sessions = CONFIG_TELNET_SERVER_MAX_CONNECTIONS;
+  static constexpr int backlog = CONFIG_TELNET_SERVER_LISTEN_BACKLOG;
+  static constexpr int read_budget = CONFIG_TELNET_SERVER_READ_BUDGET;
+  static constexpr int output_queue_limit = CONFIG_TELNET_SERVER_OUTPUT_QUEUE_LIMIT;
+  static constexpr int output_low_water = CONFIG_TELNET_SERVER_OUTPUT_LOW_WATER;
+  static constexpr int send_queue_size = CONFIG_TELNET_SERVER_SEND_QUEUE_SIZE;
+  static constexpr int channel_queue_len = CONFIG_TELNET_SERVER_CHANNEL_QUEUE_LEN;
+  static constexpr int workers = CONFIG_TELNET_SERVER_WORKERS;
+  /* offer COMPRESS2, removes it from `telopts` if false */
+  static constexpr bool compression = true;
+  /* options the server agrees to, the -1 terminator is optional */
+  static constexpr telnet_telopt_t telopts[] = {
+    {TELNET_TELOPT_COMPRESS2, TELNET_WILL, TELNET_DO},  {TELNET_TELOPT_ZMP, TELNET_WILL, TELNET_DO},
+    {TELNET_TELOPT_MSSP, TELNET_WILL, TELNET_DONT},     {TELNET_TELOPT_NEW_ENVIRON, TELNET_WILL, TELNET_DONT},
+    {TELNET_TELOPT_TTYPE, TELNET_WILL, TELNET_DONT},
+  };
+  /* sent after login, NVT encoded at compile time */
+  static constexpr char motd[] = "";
+};
+
+/**
+ * @brief Text NVT encoded at compile time, see nvt_encode().
+ */
+template <std::size_t N>
+struct NvtText {
+  std::array<char, N> data{};
+  std::size_t len = 0;
+
+  constexpr telnet_text_t text() const { return {len != 0 ? data.data() : nullptr, len}; }
+};
+
+/**
+ * @brief Encodes a string literal like telnet_text_encode(), but at compile time:
+ * @code
+ * static constexpr auto help = telnet::nvt_encode("Commands: led, reboot\n");
+ * telnet_server_write_text(session, help.text());
+ * @endcode
+ */
+template <std::size_t N>
+constexpr NvtText<2 * N> nvt_encode(const char (&text)[N])
+{
+  NvtText<2 * N> out{};
+  for (std::size_t i = 0; i + 1 < N && text[i] != 0; ++i) {
+    if (text[i] == '\n') {
+      out.data[out.len++] = '\r';
+    }
+    else if (text[i] == static_cast<char>(TELNET_IAC)) {
+      out.data[out.len++] = text[i];
+    }
+    out.data[out.len++] = text[i];
+    if (text[i] == '\r') {
+      out.data[out.len++] = 0;
+    }
+  }
+  return out;
+}
+
+namespace detail {
+
+template <class Options>
+constexpr bool keep_telopt(const telnet_telopt_t& opt)
+{
+  return Options::compression || opt.telopt != TELNET_TELOPT_COMPRESS2;
+}
+
+template <class Options>
+constexpr std::size_t telopt_count()
+{
+  std::size_t n = 0;
+  for (const telnet_telopt_t& opt : Options::telopts) {
+    if (opt.telopt == -1) {
+      break;
+    }
+    n += keep_telopt<Options>(opt);
+  }
+  return n;
+}
+
+template <class Options>
+constexpr bool telopts_valid()
+{
+  bool seen[256] = {};
+  for (const telnet_telopt_t& opt : Options::telopts) {
+    if (opt.telopt == -1) {
+      break;
+    }
+    if (opt.telopt < 0 || opt.telopt > 255 || seen[opt.telopt]) {
+      return false;
+    }
+    if ((opt.us != TELNET_WILL && opt.us != TELNET_WONT) || (opt.him != TELNET_DO && opt.him != TELNET_DONT)) {
+      return false;
+    }
+    seen[opt.telopt] = true;
+  }
+  return true;
+}
+
+template <class Options>
+constexpr std::array<telnet_telopt_t, telopt_count<Options>() + 1> make_telopts()
+{
+  std::array<telnet_telopt_t, telopt_count<Options>() + 1> table{};
+  std::size_t n = 0;
+  for (const telnet_telopt_t& opt : Options::telopts) {
+    if (opt.telopt == -1) {
+      break;
+    }
+    if (keep_telopt<Options>(opt)) {
+      table[n++] = opt;
+    }
+  }
+  table[n] = {-1, 0, 0};
+  return table;
+}
+
+} // namespace detail
+
+template <class Options = DefaultOptions>
+class TelnetServer {
+  static_assert(Options::max_sessions > 0 && Options::max_sessions <= 0xffff, "max_sessions out of range");
+  static_assert(Options::backlog > 0, "backlog must be positive");
+  static_assert(Options::read_budget > 0, "read_budget must be positive");
+  static_assert(Options::output_low_water > 0 && Options::output_low_water < Options::output_queue_limit,
+                "output_low_water must be below output_queue_limit");
+  static_assert(Options::send_queue_size > 0, "send_queue_size must be positive");
+  static_assert(Options::channel_queue_len > 0 && Options::channel_queue_len <= 0xffff, "channel_queue_len out of range");
+  static_assert(Options::workers >= 0, "workers must not be negative");
+  static_assert(detail::telopts_valid<Options>(), "telopts must be unique and use WILL/WONT and DO/DONT");
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  static_assert(Options::max_sessions <= CONFIG_TELNET_SERVER_MAX_CONNECTIONS &&
+                  Options::send_queue_size <= CONFIG_TELNET_SERVER_SEND_QUEUE_SIZE &&
+                  Options::channel_queue_len <= CONFIG_TELNET_SERVER_CHANNEL_QUEUE_LEN &&
+                  Options::workers <= CONFIG_TELNET_SERVER_WORKERS,
+                "static allocation is sized by Kconfig");
+#endif
+
+public:
+  /**
+   * @brief Telopt table with the -1 terminator, filtered by `compression`.
+   */
+  static constexpr std::array<telnet_telopt_t, detail::telopt_count<Options>() + 1> telopts =
+    detail::make_telopts<Options>();
+
+  /**
+   * @brief `Options::motd`, NVT encoded.
+   */
+  static constexpr auto motd = nvt_encode(Options::motd);
+
+  /**
+   * @brief Configuration derived from `Options`, a constant in flash.
+   */
+  static constexpr telnet_server_config_t defaults = [] {
+    telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+    config.port = Options::port;
+    config.max_connections = Options::max_sessions;
+    config.backlog = Options::backlog;
+    config.telnet_opts = telopts.data();
+    config.read_budget = Options::read_budget;
+    config.output_queue_limit = Options::output_queue_limit;
+    config.output_low_water = Options::output_low_water;
+    config.send_queue_size = Options::send_queue_size;
+    config.channel_queue_len = Options::channel_queue_len;
+    config.workers = Options::workers;
+    config.motd = motd.text();
+    return config;
+  }();
+
+  constexpr TelnetServer() : config_(defaults) {}
+
+  /**
+   * @brief Runtime parts of the configuration (callbacks, commands, transport), set before starting.
+   */
+  telnet_server_config_t& config() { return config_; }
+
+  /**
+   * @brief Starts the server task, see telnet_server_create().
+   */
+  esp_err_t create() { return telnet_server_create(&config_); }
+
+  /**
+   * @brief Starts the server in the calling task, see telnet_server_start().
+   */
+  esp_err_t start() { return telnet_server_start(&config_); }
+
+  esp_err_t poll(int timeout_ms) { return telnet_server_poll(timeout_ms); }
+
+  void stop() { telnet_server_stop(); }
+
+private:
+  telnet_server_config_t config_;
+};
+
+} // namespace telnet
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <telnet/server.h>
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/**
+ * @brief C++20 coroutines on top of telnet_handler_t.
+ *
+ * Interactive dialogs (wizards, menus, confirmations) are written as straight-line code:
+ * @code
+ * telnet::Task shell(telnet::Session& session)
+ * {
+ *   co_await session.write("Enter name: ");
+ *   std::string name = co_await session.read_line();
+ *   ...
+ * }
+ *
+ * config.handler = telnet::coroutine_handler<shell>();
+ * @endcode
+ * Coroutines are resumed by the server task when a line arrives, a suspended session costs its
+ * coroutine frame on the heap instead of a task with its own stack. The session is closed when
+ * the coroutine returns, and the coroutine is destroyed when the session closes.
+ */
+namespace telnet {
+
+/**
+ * @brief Return type of session coroutines.
+ */
+class Task {
+public:
+  struct promise_type {
+    Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  Task& operator=(Task&&) = delete;
+
+  ~Task()
+  {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+/**
+ * @brief Session as seen by a coroutine, all members must be used from the server task.
+ */
+class Session {
+public:
+  explicit Session(telnet_session_id_t id) : id_(id) {}
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+
+  telnet_session_id_t id() const { return id_; }
+
+  /**
+   * @brief Awaits the next input line, lines that arrive earlier are buffered.
+   */
+  auto read_line()
+  {
+    struct awaiter {
+      Session& session;
+
+      bool await_ready() const noexcept { return !session.lines_.empty(); }
+      void await_suspend(std::coroutine_handle<> handle) noexcept { session.waiting_ = handle; }
+
+      std::string await_resume()
+      {
+        std::string line = std::move(session.lines_.front());
+        session.lines_.pop_front();
+        return line;
+      }
+    };
+    return awaiter{*this};
+  }
+
+  /**
+   * @brief Writes text, output that does not fit the socket is queued so this never suspends.
+   */
+  std::suspend_never write(std::string_view text)
+  {
+    telnet_server_write(id_, text.data(), text.size());
+    return {};
+  }
+
+  /**
+   * @brief Names the session, see telnet_server_login().
+   */
+  esp_err_t login(const std::string& name) { return telnet_server_login(id_, name.c_str()); }
+
+  /**
+   * @brief Closes the session, see telnet_server_close().
+   */
+  void close() { telnet_server_close(id_); }
+
+  /**
+   * @brief Queues a line and resumes the coroutine if it waits for one.
+   */
+  void deliver(const char* line)
+  {
+    lines_.emplace_back(line);
+    if (std::coroutine_handle<> waiting = std::exchange(waiting_, {})) {
+      waiting.resume();
+    }
+  }
+
+private:
+  telnet_session_id_t id_;
+  std::deque<std::string> lines_;
+  std::coroutine_handle<> waiting_;
+};
+
+namespace detail {
+
+template <Task (*Fn)(Session&)>
+struct coroutine_frame {
+  Session session;
+  Task task;
+
+  explicit coroutine_frame(telnet_session_id_t id) : session(id), task(Fn(session)) {}
+
+  static void* open(telnet_session_id_t id, void* /* arg */)
+  {
+    auto* frame = new coroutine_frame(id);
+    if (frame->task.done()) {
+      frame->session.close();
+    }
+    return frame;
+  }
+
+  static void line(void* ctx, const char* line)
+  {
+    auto* frame = static_cast<coroutine_frame*>(ctx);
+    frame->session.deliver(line);
+    if (frame->task.done()) {
+      frame->session.close();
+    }
+  }
+
+  static void close(void* ctx) { delete static_cast<coroutine_frame*>(ctx); }
+};
+
+} // namespace detail
+
+/**
+ * @brief Returns a handler that runs `Fn` for every session, see telnet_server_config_t::handler.
+ */
+template <Task (*Fn)(Session&)>
+const telnet_handler_t* coroutine_handler()
+{
+  static const telnet_handler_t handler = {
+    detail::coroutine_frame<Fn>::open,
+    detail::coroutine_frame<Fn>::line,
+    detail::coroutine_frame<Fn>::close,
+    nullptr,
+  };
+  return &handler;
+}
+
+} // namespace telnet
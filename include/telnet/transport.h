@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <lwip/sockets.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Socket operations used by the Telnet server.
+ *
+ * Every socket call made by the server goes through this table, so the server loop can be
+ * driven by something other than lwIP (see telnet/transport_mem.h). All operations follow the
+ * BSD socket conventions: they return -1 and set `errno` on failure. `ctx` is passed back as
+ * the first argument of every call.
+ */
+struct telnet_transport {
+  int (*socket)(void* ctx, int domain, int type, int protocol);
+  int (*setsockopt)(void* ctx, int fd, int level, int optname, const void* optval, socklen_t optlen);
+  int (*bind)(void* ctx, int fd, const struct sockaddr* addr, socklen_t addrlen);
+  int (*listen)(void* ctx, int fd, int backlog);
+  int (*accept)(void* ctx, int fd, struct sockaddr* addr, socklen_t* addrlen);
+  ssize_t (*recv)(void* ctx, int fd, void* buffer, size_t size, int flags);
+  ssize_t (*send)(void* ctx, int fd, const void* buffer, size_t size, int flags);
+  /**
+   * @brief Gathers several buffers into one send, optional: without it the server sends them one by one.
+   */
+  ssize_t (*writev)(void* ctx, int fd, const struct iovec* iov, int iovcnt);
+  int (*poll)(void* ctx, struct pollfd* fds, nfds_t nfds, int timeout);
+  int (*close)(void* ctx, int fd);
+  int (*fcntl)(void* ctx, int fd, int cmd, int val);
+  /**
+   * @brief Creates a descriptor that polls readable after wakeup_notify(), released with close().
+   */
+  int (*wakeup_open)(void* ctx);
+  /**
+   * @brief Makes a wakeup descriptor readable, may be called from any task.
+   */
+  int (*wakeup_notify)(void* ctx, int fd);
+  /**
+   * @brief Consumes all pending notifications of a wakeup descriptor.
+   */
+  void (*wakeup_drain)(void* ctx, int fd);
+  /**
+   * @brief Returns the transport clock in milliseconds.
+   */
+  uint32_t (*now)(void* ctx);
+  void* ctx;
+};
+
+typedef struct telnet_transport telnet_transport_t;
+
+/**
+ * @brief Default transport backed by the lwIP socket API and the FreeRTOS tick count.
+ */
+extern const telnet_transport_t telnet_transport_lwip;
+
+#ifdef __cplusplus
+}
+#endif
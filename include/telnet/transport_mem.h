@@ -0,0 +1,140 @@
+#pragma once
+
+#include <telnet/transport.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Discard everything the server sends to clients instead of buffering it.
+ *
+ * Useful for benchmarks with thousands of sessions where nobody reads the output.
+ * Discarded bytes are still counted in telnet_mem_stats_t.
+ */
+#define TELNET_MEM_DISCARD_OUTPUT (1 << 0)
+
+/**
+ * @brief Scripted client operations.
+ */
+enum telnet_mem_op {
+  TELNET_MEM_CONNECT = 0, /*!< connect client to `port` (0 -- any listening socket) */
+  TELNET_MEM_SEND,        /*!< client sends `size` bytes of `data` */
+  TELNET_MEM_CLOSE,       /*!< client closes its end */
+};
+
+typedef enum telnet_mem_op telnet_mem_op_t;
+
+/**
+ * @brief A single scripted client operation.
+ *
+ * Steps are applied by the transport's poll() once the virtual clock reaches `at`.
+ * Scripts must be sorted by `at`. Clients are addressed by a script-local index.
+ */
+struct telnet_mem_step {
+  uint32_t at;
+  uint32_t client;
+  telnet_mem_op_t op;
+  uint16_t port;
+  const char* data;
+  size_t size;
+};
+
+typedef struct telnet_mem_step telnet_mem_step_t;
+
+/**
+ * @brief Counters kept by the in-memory transport.
+ */
+struct telnet_mem_stats {
+  uint64_t bytes_to_server;
+  uint64_t bytes_to_clients;
+  uint32_t connects;
+  uint32_t refused;
+  uint32_t polls;
+  uint32_t writes; /*!< send() and writev() calls by the server */
+};
+
+typedef struct telnet_mem_stats telnet_mem_stats_t;
+
+/**
+ * @brief Creates a deterministic in-memory transport with a virtual clock.
+ *
+ * Connections are pairs of ring buffers, poll() never sleeps: when nothing is ready it
+ * advances the virtual clock to the end of its timeout (or to the next scripted step)
+ * and returns immediately. Running the server on top of it is therefore deterministic
+ * and only limited by CPU speed.
+ *
+ * @param max_fds Maximum number of descriptors (listening, server and client ends).
+ * @param buffer_size Size of the receive ring of every connection end.
+ * @param flags 0 or TELNET_MEM_DISCARD_OUTPUT.
+ * @return Transport to put into telnet_server_config_t::transport, or NULL on allocation failure.
+ */
+telnet_transport_t* telnet_mem_transport_create(int max_fds, size_t buffer_size, int flags);
+
+/**
+ * @brief Releases an in-memory transport and all of its connections.
+ */
+void telnet_mem_transport_destroy(telnet_transport_t* tp);
+
+/**
+ * @brief Connects a new client to a listening socket.
+ *
+ * @return Client descriptor, or -1 with errno set to ECONNREFUSED.
+ */
+int telnet_mem_connect(telnet_transport_t* tp, uint16_t port);
+
+/**
+ * @brief Writes data from a client to the server.
+ *
+ * @return Number of bytes queued, or -1 with errno set (EAGAIN when the server ring is full).
+ */
+ssize_t telnet_mem_write(telnet_transport_t* tp, int client, const void* buffer, size_t size);
+
+/**
+ * @brief Reads data the server sent to a client.
+ *
+ * @return Number of bytes read, 0 if the server closed the connection, or -1 with errno set
+ * to EAGAIN when nothing is pending.
+ */
+ssize_t telnet_mem_read(telnet_transport_t* tp, int client, void* buffer, size_t size);
+
+/**
+ * @brief Closes the client end of a connection.
+ */
+void telnet_mem_close(telnet_transport_t* tp, int client);
+
+/**
+ * @brief Installs a script of client operations replayed against the virtual clock.
+ *
+ * The script is referenced, not copied, and must stay valid until fully replayed.
+ */
+void telnet_mem_play(telnet_transport_t* tp, const telnet_mem_step_t* script, size_t count);
+
+/**
+ * @brief Returns non-zero while scripted steps are still pending.
+ */
+int telnet_mem_pending(telnet_transport_t* tp);
+
+/**
+ * @brief Returns the client descriptor assigned to a script client index, or -1.
+ */
+int telnet_mem_client(telnet_transport_t* tp, uint32_t client);
+
+/**
+ * @brief Returns the virtual clock in milliseconds.
+ */
+uint32_t telnet_mem_now(telnet_transport_t* tp);
+
+/**
+ * @brief Advances the virtual clock.
+ */
+void telnet_mem_advance(telnet_transport_t* tp, uint32_t ms);
+
+/**
+ * @brief Retrieves the transport counters.
+ */
+void telnet_mem_stats(telnet_transport_t* tp, telnet_mem_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
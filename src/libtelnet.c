@@ -84,6 +84,8 @@ struct telnet_t {
 #if defined(HAVE_ZLIB)
 	/* zlib (mccp2) compression */
 	z_stream *z;
+	/* inflate output, kept when compression ends */
+	char *zbuf;
 #endif
 	/* RFC1143 option negotiation states */
 	struct telnet_rfc1143_t *q;
@@ -93,12 +95,16 @@ struct telnet_t {
 	size_t buffer_size;
 	/* current buffer write position (also length of buffer data) */
 	size_t buffer_pos;
+	/* transition table of the DFA decoder, 0 for the switch decoder */
+	const unsigned char *dfa;
 	/* current state */
 	enum telnet_state_t state;
 	/* option flags */
 	unsigned char flags;
 	/* current subnegotiation telopt */
 	unsigned char sb_telopt;
+	/* warnings skipped by error code */
+	unsigned char wmask;
 	/* length of RFC1143 queue */
 	unsigned int q_size;
 	/* number of entries in RFC1143 queue */
@@ -131,25 +137,164 @@ static const size_t _buffer_sizes_count = sizeof(_buffer_sizes) /
 /* RFC1143 option negotiation state table allocation quantum */
 #define Q_BUFFER_GROWTH_QUANTUM 4
 
-/* error generation function */
+/* static trackers must fit their storage */
+typedef char _telnet_static_fits[sizeof(struct telnet_t) <=
+		sizeof(((telnet_static_t *)0)->tracker) ? 1 : -1];
+
+/* DFA decoder byte classes */
+enum {
+	DFA_C_BYTE = 0,
+	DFA_C_IAC,
+	DFA_C_CR,
+	DFA_C_LF,
+	DFA_C_NUL,
+	DFA_C_SB,
+	DFA_C_SE,
+	DFA_C_WILL,
+	DFA_C_WONT,
+	DFA_C_DO,
+	DFA_C_DONT,
+	DFA_CLASSES
+};
+
+/* DFA decoder actions, run before (or instead of) entering the next state */
+enum {
+	DFA_A_NONE = 0,   /* just enter the next state */
+	DFA_A_FLUSH,      /* pass through pending data */
+	DFA_A_EOL_LF,     /* CR LF: the LF starts the pending data */
+	DFA_A_EOL_NUL,    /* CR NUL: pass a CR, drop the NUL */
+	DFA_A_EOL_CR,     /* CR anything: pass a CR and the byte */
+	DFA_A_IAC_ESC,    /* IAC IAC */
+	DFA_A_IAC_CMD,    /* IAC command */
+	DFA_A_NEG,        /* WILL/WONT/DO/DONT telopt */
+	DFA_A_SB_TELOPT,  /* IAC SB telopt */
+	DFA_A_SB_BYTE,    /* subnegotiation data */
+	DFA_A_SB_WILL,    /* subnegotiation data, or MCCPv1 start */
+	DFA_A_SB_IAC,     /* IAC IAC inside SB */
+	DFA_A_SB_END,     /* IAC SE */
+	DFA_A_SB_ERR      /* IAC command inside SB */
+};
+
+/* transition table entry: action in the high nibble, next state in the low */
+#define DFA(a, s) (unsigned char)((a) << 4 | (s))
+
+static const unsigned char _dfa_class[256] = {
+	[0] = DFA_C_NUL,
+	['\n'] = DFA_C_LF,
+	['\r'] = DFA_C_CR,
+	[TELNET_SE] = DFA_C_SE,
+	[TELNET_SB] = DFA_C_SB,
+	[TELNET_WILL] = DFA_C_WILL,
+	[TELNET_WONT] = DFA_C_WONT,
+	[TELNET_DO] = DFA_C_DO,
+	[TELNET_DONT] = DFA_C_DONT,
+	[TELNET_IAC] = DFA_C_IAC,
+};
+
+/* rows in byte class order: BYTE IAC CR LF NUL SB SE WILL WONT DO DONT */
+#define DFA_ROW(x) { x, x, x, x, x, x, x, x, x, x, x }
+#define DFA_ROW_DATA(cr) { \
+	DFA(DFA_A_NONE, TELNET_STATE_DATA), DFA(DFA_A_FLUSH, TELNET_STATE_IAC), \
+	cr, DFA(DFA_A_NONE, TELNET_STATE_DATA), DFA(DFA_A_NONE, TELNET_STATE_DATA), \
+	DFA(DFA_A_NONE, TELNET_STATE_DATA), DFA(DFA_A_NONE, TELNET_STATE_DATA), \
+	DFA(DFA_A_NONE, TELNET_STATE_DATA), DFA(DFA_A_NONE, TELNET_STATE_DATA), \
+	DFA(DFA_A_NONE, TELNET_STATE_DATA), DFA(DFA_A_NONE, TELNET_STATE_DATA) }
+#define DFA_ROWS(cr) { \
+	/* TELNET_STATE_DATA */ \
+	DFA_ROW_DATA(cr), \
+	/* TELNET_STATE_EOL */ \
+	{ DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), \
+	  DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), DFA(DFA_A_EOL_LF, TELNET_STATE_DATA), \
+	  DFA(DFA_A_EOL_NUL, TELNET_STATE_DATA), DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), \
+	  DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), \
+	  DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), DFA(DFA_A_EOL_CR, TELNET_STATE_DATA), \
+	  DFA(DFA_A_EOL_CR, TELNET_STATE_DATA) }, \
+	/* TELNET_STATE_IAC */ \
+	{ DFA(DFA_A_IAC_CMD, TELNET_STATE_DATA), DFA(DFA_A_IAC_ESC, TELNET_STATE_DATA), \
+	  DFA(DFA_A_IAC_CMD, TELNET_STATE_DATA), DFA(DFA_A_IAC_CMD, TELNET_STATE_DATA), \
+	  DFA(DFA_A_IAC_CMD, TELNET_STATE_DATA), DFA(DFA_A_NONE, TELNET_STATE_SB), \
+	  DFA(DFA_A_IAC_CMD, TELNET_STATE_DATA), DFA(DFA_A_NONE, TELNET_STATE_WILL), \
+	  DFA(DFA_A_NONE, TELNET_STATE_WONT), DFA(DFA_A_NONE, TELNET_STATE_DO), \
+	  DFA(DFA_A_NONE, TELNET_STATE_DONT) }, \
+	/* TELNET_STATE_WILL, WONT, DO, DONT */ \
+	DFA_ROW(DFA(DFA_A_NEG, TELNET_STATE_DATA)), \
+	DFA_ROW(DFA(DFA_A_NEG, TELNET_STATE_DATA)), \
+	DFA_ROW(DFA(DFA_A_NEG, TELNET_STATE_DATA)), \
+	DFA_ROW(DFA(DFA_A_NEG, TELNET_STATE_DATA)), \
+	/* TELNET_STATE_SB */ \
+	DFA_ROW(DFA(DFA_A_SB_TELOPT, TELNET_STATE_SB_DATA)), \
+	/* TELNET_STATE_SB_DATA */ \
+	{ DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), DFA(DFA_A_NONE, TELNET_STATE_SB_DATA_IAC), \
+	  DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), \
+	  DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), \
+	  DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), DFA(DFA_A_SB_WILL, TELNET_STATE_SB_DATA), \
+	  DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA), \
+	  DFA(DFA_A_SB_BYTE, TELNET_STATE_SB_DATA) }, \
+	/* TELNET_STATE_SB_DATA_IAC */ \
+	{ DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), DFA(DFA_A_SB_IAC, TELNET_STATE_SB_DATA), \
+	  DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), \
+	  DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), \
+	  DFA(DFA_A_SB_END, TELNET_STATE_DATA), DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), \
+	  DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), DFA(DFA_A_SB_ERR, TELNET_STATE_IAC), \
+	  DFA(DFA_A_SB_ERR, TELNET_STATE_IAC) } }
+
+/* one table per EOL mode: [0] CR is data, [1] CR starts NVT EOL translation */
+static const unsigned char _dfa_tables[2][TELNET_STATE_SB_DATA_IAC + 1][DFA_CLASSES] = {
+	DFA_ROWS(DFA(DFA_A_NONE, TELNET_STATE_DATA)),
+	DFA_ROWS(DFA(DFA_A_FLUSH, TELNET_STATE_EOL)),
+};
+
+/* pick the DFA table matching the current flags */
+static INLINE void _dfa_select(telnet_t *telnet) {
+	if (telnet->flags & TELNET_FLAG_DFA)
+		telnet->dfa = &_dfa_tables[(telnet->flags & TELNET_FLAG_NVT_EOL) &&
+				!(telnet->flags & TELNET_FLAG_RECEIVE_BINARY)][0][0];
+}
+
+/* message text without arguments, indexed by telnet_msg_t */
+static const char *const _msg_text[] = {
+	"",
+	"compression unavailable in static trackers",
+	"cannot initialize compression twice",
+	"allocation failed",
+	"zlib failed",
+	"RFC1143 queue full",
+	"DONT answered by WILL",
+	"WONT answered by DO",
+	"subneg has invalid command",
+	"subneg missing variable type",
+	"subneg ends with ESC",
+	"MSSP subnegotiation has invalid data",
+	"incomplete ZMP frame",
+	"incomplete TERMINAL-TYPE request",
+	"TERMINAL-TYPE request has invalid type",
+	"subnegotiation buffer size limit reached",
+	"unexpected byte after IAC inside SB",
+	"invalid LINEMODE request",
+};
+
+/* error generation function; the message is only formatted on demand,
+ * see telnet_format_error()
+ */
 static telnet_error_t _error(telnet_t *telnet, unsigned line,
-		const char* func, telnet_error_t err, int fatal, const char *fmt,
-		...) {
+		const char* func, telnet_error_t err, int fatal, telnet_msg_t code,
+		int arg, const char *str) {
 	telnet_event_t ev;
-	char buffer[512];
-	va_list va;
 
-	/* format informational text */
-	va_start(va, fmt);
-	vsnprintf(buffer, sizeof(buffer), fmt, va);
-	va_end(va);
+	/* masked warnings cost nothing */
+	if (!fatal && (telnet->wmask & TELNET_WARN(err)))
+		return err;
 
 	/* send error event to the user */
 	ev.type = fatal ? TELNET_EV_ERROR : TELNET_EV_WARNING;
 	ev.error.file = __FILE__;
 	ev.error.func = func;
 	ev.error.line = line;
-	ev.error.msg = buffer;
+	ev.error.msg = _msg_text[code];
+	ev.error.str = str;
+	ev.error.arg = arg;
+	ev.error.errcode = err;
+	ev.error.code = code;
 	telnet->eh(telnet, &ev, telnet->ud);
 
 	return err;
@@ -165,29 +310,40 @@ telnet_error_t _init_zlib(telnet_t *telnet, int deflate, int err_fatal) {
 	z_stream *z;
 	int rs;
 
+	/* static trackers never allocate a zlib box */
+	if (telnet->flags & TELNET_PFLAG_STATIC)
+		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL,
+				err_fatal, TELNET_MSG_STATIC_COMPRESS, 0, 0);
+
 	/* if compression is already enabled, fail loudly */
 	if (telnet->z != 0)
 		return _error(telnet, __LINE__, __func__, TELNET_EBADVAL,
-				err_fatal, "cannot initialize compression twice");
+				err_fatal, TELNET_MSG_COMPRESS_TWICE, 0, 0);
 
 	/* allocate zstream box */
 	if ((z= (z_stream *)calloc(1, sizeof(z_stream))) == 0)
 		return _error(telnet, __LINE__, __func__, TELNET_ENOMEM, err_fatal,
-				"malloc() failed: %s", strerror(errno));
+				TELNET_MSG_ALLOC, errno, "malloc()");
 
 	/* initialize */
 	if (deflate) {
 		if ((rs = deflateInit(z, Z_DEFAULT_COMPRESSION)) != Z_OK) {
 			free(z);
 			return _error(telnet, __LINE__, __func__, TELNET_ECOMPRESS,
-					err_fatal, "deflateInit() failed: %s", zError(rs));
+					err_fatal, TELNET_MSG_ZLIB, rs, "deflateInit()");
 		}
 		telnet->flags |= TELNET_PFLAG_DEFLATE;
 	} else {
+		if (telnet->zbuf == 0 &&
+				(telnet->zbuf = (char *)malloc(TELNET_INFLATE_BUFFER)) == 0) {
+			free(z);
+			return _error(telnet, __LINE__, __func__, TELNET_ENOMEM, err_fatal,
+					TELNET_MSG_ALLOC, errno, "malloc()");
+		}
 		if ((rs = inflateInit(z)) != Z_OK) {
 			free(z);
 			return _error(telnet, __LINE__, __func__, TELNET_ECOMPRESS,
-					err_fatal, "inflateInit() failed: %s", zError(rs));
+					err_fatal, TELNET_MSG_ZLIB, rs, "inflateInit()");
 		}
 		telnet->flags &= ~TELNET_PFLAG_DEFLATE;
 	}
@@ -220,7 +376,7 @@ static void _send(telnet_t *telnet, const char *buffer,
 			/* compress */
 			if ((rs = deflate(telnet->z, Z_SYNC_FLUSH)) != Z_OK) {
 				_error(telnet, __LINE__, __func__, TELNET_ECOMPRESS, 1,
-						"deflate() failed: %s", zError(rs));
+						TELNET_MSG_ZLIB, rs, "deflate()");
 				deflateEnd(telnet->z);
 				free(telnet->z);
 				telnet->z = 0;
@@ -249,6 +405,30 @@ static void _send(telnet_t *telnet, const char *buffer,
 	telnet->eh(telnet, &ev, telnet->ud);
 }
 
+/* push a vector out, as one SENDV event if the handler takes them */
+static void _sendv(telnet_t *telnet, const struct iovec *iov,
+		int iovcnt) {
+	telnet_event_t ev;
+	int i;
+
+	/* compressed output has to go through the deflate box in _send */
+	if (!(telnet->flags & TELNET_FLAG_SENDV)
+#if defined(HAVE_ZLIB)
+			|| (telnet->z != 0 && telnet->flags & TELNET_PFLAG_DEFLATE)
+#endif
+			) {
+		for (i = 0; i != iovcnt; ++i) {
+			_send(telnet, (const char *)iov[i].iov_base, iov[i].iov_len);
+		}
+		return;
+	}
+
+	ev.type = TELNET_EV_SENDV;
+	ev.sendv.iov = iov;
+	ev.sendv.iovcnt = iovcnt;
+	telnet->eh(telnet, &ev, telnet->ud);
+}
+
 /* to send bags of unsigned chars */
 #define _sendu(t, d, s) _send((t), (const char*)(d), (s))
 
@@ -317,6 +497,7 @@ static INLINE void _set_rfc1143(telnet_t *telnet, unsigned char telopt,
 				telnet->flags |= TELNET_FLAG_TRANSMIT_BINARY;
 			if (him == Q_YES)
 				telnet->flags |= TELNET_FLAG_RECEIVE_BINARY;
+			_dfa_select(telnet);
 			return;
 		}
 	}
@@ -330,12 +511,19 @@ static INLINE void _set_rfc1143(telnet_t *telnet, unsigned char telopt,
 
     /* Did we reach the end of the table? */
 	if (telnet->q_cnt >= telnet->q_size) {
+		/* static trackers cannot grow */
+		if (telnet->flags & TELNET_PFLAG_STATIC) {
+			_error(telnet, __LINE__, __func__, TELNET_EOVERFLOW, 0,
+					TELNET_MSG_QUEUE_FULL, 0, 0);
+			return;
+		}
+
 		/* Expand the size */
 		if ((qtmp = (telnet_rfc1143_t *)realloc(telnet->q,
 			sizeof(telnet_rfc1143_t) *
             	(telnet->q_size + Q_BUFFER_GROWTH_QUANTUM))) == 0) {
 			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"realloc() failed: %s", strerror(errno));
+					TELNET_MSG_ALLOC, errno, "realloc()");
 			return;
 		}
 		memset(&qtmp[telnet->q_size], 0, sizeof(telnet_rfc1143_t) *
@@ -386,6 +574,18 @@ static void _negotiate(telnet_t *telnet, unsigned char telopt) {
 	/* lookup the current state of the option */
 	q = _get_rfc1143(telnet, telopt);
 
+	/* TIMING-MARK replies are one-shot: report both WILL and WONT and forget
+	 * the option state, so that the next telnet_timing_mark() sends a fresh DO
+	 */
+	if (telopt == TELNET_TELOPT_TM && Q_HIM(q) == Q_WANTYES &&
+			(telnet->state == TELNET_STATE_WILL ||
+			telnet->state == TELNET_STATE_WONT)) {
+		_set_rfc1143(telnet, telopt, Q_US(q), Q_NO);
+		NEGOTIATE_EVENT(telnet, telnet->state == TELNET_STATE_WILL ?
+				TELNET_EV_WILL : TELNET_EV_WONT, telopt);
+		return;
+	}
+
 	/* start processing... */
 	switch ((int)telnet->state) {
 	/* request to enable option on remote end or confirm DO */
@@ -403,12 +603,12 @@ static void _negotiate(telnet_t *telnet, unsigned char telopt) {
 			_set_rfc1143(telnet, telopt, Q_US(q), Q_NO);
 			NEGOTIATE_EVENT(telnet, TELNET_EV_WONT, telopt);
 			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-					"DONT answered by WILL");
+					TELNET_MSG_DONT_WILL, 0, 0);
 			break;
 		case Q_WANTNO_OP:
 			_set_rfc1143(telnet, telopt, Q_US(q), Q_YES);
 			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-					"DONT answered by WILL");
+					TELNET_MSG_DONT_WILL, 0, 0);
 			break;
 		case Q_WANTYES:
 			_set_rfc1143(telnet, telopt, Q_US(q), Q_YES);
@@ -461,12 +661,12 @@ static void _negotiate(telnet_t *telnet, unsigned char telopt) {
 			_set_rfc1143(telnet, telopt, Q_NO, Q_HIM(q));
 			NEGOTIATE_EVENT(telnet, TELNET_EV_DONT, telopt);
 			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-					"WONT answered by DO");
+					TELNET_MSG_WONT_DO, 0, 0);
 			break;
 		case Q_WANTNO_OP:
 			_set_rfc1143(telnet, telopt, Q_YES, Q_HIM(q));
 			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-					"WONT answered by DO");
+					TELNET_MSG_WONT_DO, 0, 0);
 			break;
 		case Q_WANTYES:
 			_set_rfc1143(telnet, telopt, Q_YES, Q_HIM(q));
@@ -535,7 +735,7 @@ static int _environ_telnet(telnet_t *telnet, unsigned char type,
 			(unsigned)buffer[0] != TELNET_ENVIRON_IS &&
 			(unsigned)buffer[0] != TELNET_ENVIRON_INFO) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"telopt %d subneg has invalid command", type);
+				TELNET_MSG_SB_COMMAND, type, 0);
 		return 0;
 	}
 
@@ -559,14 +759,14 @@ static int _environ_telnet(telnet_t *telnet, unsigned char type,
 	if ((unsigned)buffer[1] != TELNET_ENVIRON_VAR &&
 			(unsigned)buffer[1] != TELNET_ENVIRON_USERVAR) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"telopt %d subneg missing variable type", type);
+				TELNET_MSG_SB_VARTYPE, type, 0);
 		return 0;
 	}
 
 	/* ensure last byte is not an escape byte (makes parsing later easier) */
 	if ((unsigned)buffer[size - 1] == TELNET_ENVIRON_ESC) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"telopt %d subneg ends with ESC", type);
+				TELNET_MSG_SB_ESC, type, 0);
 		return 0;
 	}
 
@@ -585,7 +785,7 @@ static int _environ_telnet(telnet_t *telnet, unsigned char type,
 	if ((values = (struct telnet_environ_t *)calloc(count,
 			sizeof(struct telnet_environ_t))) == 0) {
 		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-				"calloc() failed: %s", strerror(errno));
+				TELNET_MSG_ALLOC, errno, "calloc()");
 		return 0;
 	}
 
@@ -676,7 +876,7 @@ static int _mssp_telnet(telnet_t *telnet, char* buffer, size_t size) {
 	/* first byte must be a VAR */
 	if ((unsigned)buffer[0] != TELNET_MSSP_VAR) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"MSSP subnegotiation has invalid data");
+				TELNET_MSG_MSSP_DATA, 0, 0);
 		return 0;
 	}
 
@@ -691,7 +891,7 @@ static int _mssp_telnet(telnet_t *telnet, char* buffer, size_t size) {
 	if ((values = (struct telnet_environ_t *)calloc(count,
 			sizeof(struct telnet_environ_t))) == 0) {
 		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-				"calloc() failed: %s", strerror(errno));
+				TELNET_MSG_ALLOC, errno, "calloc()");
 		return 0;
 	}
 
@@ -718,7 +918,7 @@ static int _mssp_telnet(telnet_t *telnet, char* buffer, size_t size) {
 			++i;
 		} else {
 			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-					"invalid MSSP subnegotiation data");
+					TELNET_MSG_MSSP_DATA, 0, 0);
 			free(values);
 			return 0;
 		}
@@ -748,7 +948,7 @@ static int _zmp_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 	/* make sure this is a valid ZMP buffer */
 	if (size == 0 || buffer[size - 1] != 0) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"incomplete ZMP frame");
+				TELNET_MSG_ZMP_FRAME, 0, 0);
 		return 0;
 	}
 
@@ -759,7 +959,7 @@ static int _zmp_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 	/* allocate argument array, bail on error */
 	if ((argv = (char **)calloc(argc, sizeof(char *))) == 0) {
 		_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-				"calloc() failed: %s", strerror(errno));
+				TELNET_MSG_ALLOC, errno, "calloc()");
 		return 0;
 	}
 
@@ -787,7 +987,7 @@ static int _ttype_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 	/* make sure request is not empty */
 	if (size == 0) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"incomplete TERMINAL-TYPE request");
+				TELNET_MSG_TTYPE_EMPTY, 0, 0);
 		return 0;
 	}
 
@@ -795,7 +995,7 @@ static int _ttype_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 	if (buffer[0] != TELNET_TTYPE_IS &&
 			buffer[0] != TELNET_TTYPE_SEND) {
 		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-				"TERMINAL-TYPE request has invalid type");
+				TELNET_MSG_TTYPE_TYPE, 0, 0);
 		return 0;
 	}
 
@@ -806,7 +1006,7 @@ static int _ttype_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 		/* allocate space for name */
 		if ((name = (char *)malloc(size)) == 0) {
 			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"malloc() failed: %s", strerror(errno));
+					TELNET_MSG_ALLOC, errno, "malloc()");
 			return 0;
 		}
 		memcpy(name, buffer + 1, size - 1);
@@ -829,6 +1029,54 @@ static int _ttype_telnet(telnet_t *telnet, const char* buffer, size_t size) {
 	return 0;
 }
 
+/* parse LINEMODE command subnegotiation buffers */
+static int _linemode_telnet(telnet_t *telnet, const char* buffer, size_t size) {
+	telnet_event_t ev;
+
+	/* MODE carries one mask byte, FORWARDMASK follows a negotiation */
+	if (size < 2 || (buffer[0] == TELNET_LINEMODE_MODE && size != 2)) {
+		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
+				TELNET_MSG_LINEMODE, 0, 0);
+		return 0;
+	}
+
+	ev.type = TELNET_EV_LINEMODE;
+	ev.linemode.mode = 0;
+	switch ((unsigned char)buffer[0]) {
+	case TELNET_LINEMODE_MODE:
+		ev.linemode.cmd = TELNET_LINEMODE_MODE;
+		ev.linemode.mode = (unsigned char)buffer[1];
+		ev.linemode.data = 0;
+		ev.linemode.size = 0;
+		break;
+	case TELNET_LINEMODE_SLC:
+		ev.linemode.cmd = TELNET_LINEMODE_SLC;
+		ev.linemode.data = buffer + 1;
+		ev.linemode.size = (size - 1) - (size - 1) % 3;
+		break;
+	case TELNET_DO:
+	case TELNET_DONT:
+	case TELNET_WILL:
+	case TELNET_WONT:
+		if (buffer[1] != TELNET_LINEMODE_FORWARDMASK) {
+			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
+					TELNET_MSG_LINEMODE, 0, 0);
+			return 0;
+		}
+		ev.linemode.cmd = (unsigned char)buffer[0];
+		ev.linemode.data = buffer + 2;
+		ev.linemode.size = size - 2;
+		break;
+	default:
+		_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
+				TELNET_MSG_LINEMODE, 0, 0);
+		return 0;
+	}
+	telnet->eh(telnet, &ev, telnet->ud);
+
+	return 0;
+}
+
 /* process a subnegotiation buffer; return non-zero if the current buffer
  * must be aborted and reprocessed due to COMPRESS2 being activated
  */
@@ -842,6 +1090,14 @@ static int _subnegotiate(telnet_t *telnet) {
 	ev.sub.size = telnet->buffer_pos;
 	telnet->eh(telnet, &ev, telnet->ud);
 
+	/* LINEMODE is parsed in place, static trackers get it too */
+	if (telnet->sb_telopt == TELNET_TELOPT_LINEMODE)
+		return _linemode_telnet(telnet, telnet->buffer, telnet->buffer_pos);
+
+	/* static trackers skip the allocating parsers */
+	if (telnet->flags & TELNET_PFLAG_STATIC)
+		return 0;
+
 	switch (telnet->sb_telopt) {
 #if defined(HAVE_ZLIB)
 	/* received COMPRESS2 begin marker, setup our zlib box and
@@ -887,12 +1143,37 @@ telnet_t *telnet_init(const telnet_telopt_t *telopts,
 	telnet->telopts = telopts;
 	telnet->eh = eh;
 	telnet->flags = flags;
+	_dfa_select(telnet);
+
+	return telnet;
+}
+
+/* initialize a state tracker in caller-provided storage */
+telnet_t *telnet_init_static(telnet_static_t *storage,
+		const telnet_telopt_t *telopts, telnet_event_handler_t eh,
+		unsigned char flags, void *user_data) {
+	struct telnet_t *telnet = (telnet_t*)storage->tracker;
+
+	memset(storage, 0, sizeof(*storage));
+	telnet->ud = user_data;
+	telnet->telopts = telopts;
+	telnet->eh = eh;
+	telnet->flags = flags | TELNET_PFLAG_STATIC;
+	telnet->q = (telnet_rfc1143_t*)storage->q;
+	telnet->q_size = TELNET_STATIC_QUEUE;
+	telnet->buffer = storage->buffer;
+	telnet->buffer_size = TELNET_STATIC_BUFFER;
+	_dfa_select(telnet);
 
 	return telnet;
 }
 
 /* free up any memory allocated by a state tracker */
 void telnet_free(telnet_t *telnet) {
+	/* static trackers own no memory */
+	if (telnet->flags & TELNET_PFLAG_STATIC)
+		return;
+
 	/* free sub-request buffer */
 	if (telnet->buffer != 0) {
 		free(telnet->buffer);
@@ -911,6 +1192,8 @@ void telnet_free(telnet_t *telnet) {
 		free(telnet->z);
 		telnet->z = 0;
 	}
+	free(telnet->zbuf);
+	telnet->zbuf = 0;
 #endif /* defined(HAVE_ZLIB) */
 
 	/* free RFC1143 queue */
@@ -925,6 +1208,39 @@ void telnet_free(telnet_t *telnet) {
 	free(telnet);
 }
 
+/* skip warnings by error code */
+void telnet_mask_warnings(telnet_t *telnet, unsigned char mask) {
+	telnet->wmask = mask;
+}
+
+/* format the message of a WARNING or ERROR event */
+int telnet_format_error(const telnet_event_t *ev, char *buffer,
+		size_t size) {
+	const char *msg = ev->error.msg;
+
+	switch (ev->error.code) {
+	case TELNET_MSG_ALLOC:
+		return snprintf(buffer, size, "%s failed: %s", ev->error.str,
+				strerror(ev->error.arg));
+	case TELNET_MSG_ZLIB:
+#if defined(HAVE_ZLIB)
+		return snprintf(buffer, size, "%s failed: %s", ev->error.str,
+				zError(ev->error.arg));
+#else
+		return snprintf(buffer, size, "%s failed: %d", ev->error.str,
+				ev->error.arg);
+#endif
+	case TELNET_MSG_SB_COMMAND:
+	case TELNET_MSG_SB_VARTYPE:
+	case TELNET_MSG_SB_ESC:
+		return snprintf(buffer, size, "telopt %d %s", ev->error.arg, msg);
+	case TELNET_MSG_SB_IAC:
+		return snprintf(buffer, size, "%s: %d", msg, ev->error.arg);
+	default:
+		return snprintf(buffer, size, "%s", msg);
+	}
+}
+
 /* push a byte into the telnet buffer */
 static telnet_error_t _buffer_byte(telnet_t *telnet,
 		unsigned char byte) {
@@ -933,6 +1249,13 @@ static telnet_error_t _buffer_byte(telnet_t *telnet,
 
 	/* check if we're out of room */
 	if (telnet->buffer_pos == telnet->buffer_size) {
+		/* static trackers cannot grow */
+		if (telnet->flags & TELNET_PFLAG_STATIC) {
+			_error(telnet, __LINE__, __func__, TELNET_EOVERFLOW, 0,
+					TELNET_MSG_SB_LIMIT, 0, 0);
+			return TELNET_EOVERFLOW;
+		}
+
 		/* find the next buffer size */
 		for (i = 0; i != _buffer_sizes_count; ++i) {
 			if (_buffer_sizes[i] == telnet->buffer_size) {
@@ -943,7 +1266,7 @@ static telnet_error_t _buffer_byte(telnet_t *telnet,
 		/* overflow -- can't grow any more */
 		if (i >= _buffer_sizes_count - 1) {
 			_error(telnet, __LINE__, __func__, TELNET_EOVERFLOW, 0,
-					"subnegotiation buffer size limit reached");
+					TELNET_MSG_SB_LIMIT, 0, 0);
 			return TELNET_EOVERFLOW;
 		}
 
@@ -951,7 +1274,7 @@ static telnet_error_t _buffer_byte(telnet_t *telnet,
 		new_buffer = (char *)realloc(telnet->buffer, _buffer_sizes[i + 1]);
 		if (new_buffer == 0) {
 			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"realloc() failed");
+					TELNET_MSG_ALLOC, errno, "realloc()");
 			return TELNET_ENOMEM;
 		}
 
@@ -964,47 +1287,87 @@ static telnet_error_t _buffer_byte(telnet_t *telnet,
 	return TELNET_EOK;
 }
 
-static void _process(telnet_t *telnet, const char *buffer, size_t size) {
+static size_t _process_dfa(telnet_t *telnet, const char *buffer,
+		size_t size);
+
+/* pass decoded bytes to the application */
+static INLINE void _data(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	telnet_event_t ev;
+
+	if (size != 0) {
+		ev.type = TELNET_EV_DATA;
+		ev.data.buffer = buffer;
+		ev.data.size = size;
+		telnet->eh(telnet, &ev, telnet->ud);
+	}
+}
+
+/* decode plain input; returns the number of bytes consumed, which is less
+ * than size only if COMPRESS2 was started and the rest must be inflated.
+ *
+ * if out is the (writable) buffer itself, NVT EOL and IAC IAC translations
+ * are done in place: decoded bytes are moved down to out[run, end) and
+ * passed on in one DATA event when a command or the end of the buffer is
+ * reached, instead of one event per translation.
+ */
+static size_t _process(telnet_t *telnet, const char *buffer, size_t size,
+		char *out) {
 	telnet_event_t ev;
 	unsigned char byte;
-	size_t i, start;
+	size_t i, start, run = 0, end = 0;
+
+	/* table-driven decoder, produces the same events */
+	if (telnet->dfa != 0)
+		return _process_dfa(telnet, buffer, size);
+
 	for (i = start = 0; i != size; ++i) {
 		byte = buffer[i];
+retry:
 		switch (telnet->state) {
 		/* regular data */
 		case TELNET_STATE_DATA:
 			/* on an IAC byte, pass through all pending bytes and
 			 * switch states */
 			if (byte == TELNET_IAC) {
-				if (i != start) {
-					ev.type = TELNET_EV_DATA;
-					ev.data.buffer = buffer + start;
-					ev.data.size = i - start;
-					telnet->eh(telnet, &ev, telnet->ud);
-				}
+				if (out != 0)
+					goto compact;
+				_data(telnet, buffer + start, i - start);
 				telnet->state = TELNET_STATE_IAC;
 			} else if (byte == '\r' &&
 					   (telnet->flags & TELNET_FLAG_NVT_EOL) &&
 					   !(telnet->flags & TELNET_FLAG_RECEIVE_BINARY)) {
-				if (i != start) {
-					ev.type = TELNET_EV_DATA;
-					ev.data.buffer = buffer + start;
-					ev.data.size = i - start;
-					telnet->eh(telnet, &ev, telnet->ud);
-				}
+				if (out != 0)
+					goto compact;
+				_data(telnet, buffer + start, i - start);
 				telnet->state = TELNET_STATE_EOL;
 			}
 			break;
 
+			/* in place: append the pending bytes to the run instead */
+compact:
+			if (run == end)
+				run = end = start;
+			else if (end != start)
+				memmove(out + end, out + start, i - start);
+			end += i - start;
+			start = i + 1;
+			telnet->state = byte == TELNET_IAC ? TELNET_STATE_IAC :
+					TELNET_STATE_EOL;
+			break;
+
 		/* NVT EOL to be translated */
 		case TELNET_STATE_EOL:
 			if (byte != '\n') {
-				byte = '\r';
-				ev.type = TELNET_EV_DATA;
-				ev.data.buffer = (char*)&byte;
-				ev.data.size = 1;
-				telnet->eh(telnet, &ev, telnet->ud);
-				byte = buffer[i];
+				/* the CR was consumed, so the run has room for it unless
+				 * it came at the end of the previous buffer */
+				if (out != 0 && end < i) {
+					if (run == end)
+						run = end = i - 1;
+					out[end++] = '\r';
+				} else {
+					_data(telnet, CRLF, 1);
+				}
 			}
 			/* any byte following '\r' other than '\n' or '\0' is invalid,
 			 * so pass both \r and the byte */
@@ -1017,6 +1380,29 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 
 		/* IAC command */
 		case TELNET_STATE_IAC:
+			/* IAC escaping, in place writes the IAC over itself or
+			 * earlier consumed bytes */
+			if (byte == TELNET_IAC) {
+				if (out != 0) {
+					if (run == end)
+						run = end = i;
+					out[end++] = (char)TELNET_IAC;
+				} else {
+					_data(telnet, (char*)&byte, 1);
+				}
+
+				/* state update */
+				start = i + 1;
+				telnet->state = TELNET_STATE_DATA;
+				break;
+			}
+
+			/* everything else ends the run */
+			if (run != end) {
+				_data(telnet, out + run, end - run);
+				run = end;
+			}
+
 			switch (byte) {
 			/* subnegotiation */
 			case TELNET_SB:
@@ -1035,18 +1421,6 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 			case TELNET_DONT:
 				telnet->state = TELNET_STATE_DONT;
 				break;
-			/* IAC escaping */
-			case TELNET_IAC:
-				/* event */
-				ev.type = TELNET_EV_DATA;
-				ev.data.buffer = (char*)&byte;
-				ev.data.size = 1;
-				telnet->eh(telnet, &ev, telnet->ud);
-
-				/* state update */
-				start = i + 1;
-				telnet->state = TELNET_STATE_DATA;
-				break;
 			/* some other command */
 			default:
 				/* event */
@@ -1109,14 +1483,10 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 
 				/* process subnegotiation */
 				if (_subnegotiate(telnet) != 0) {
-					/* any remaining bytes in the buffer are compressed.
-					 * we have to re-invoke telnet_recv to get those
-					 * bytes inflated and abort trying to process the
-					 * remaining compressed bytes in the current _process
-					 * buffer argument
+					/* any remaining bytes in the buffer are compressed,
+					 * telnet_recv() inflates them
 					 */
-					telnet_recv(telnet, &buffer[start], size - start);
-					return;
+					return start;
 				}
 				break;
 			/* escaped IAC byte */
@@ -1136,31 +1506,161 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 			 */
 			default:
 				_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
-						"unexpected byte after IAC inside SB: %d",
-						byte);
+						TELNET_MSG_SB_IAC, byte, 0);
 
 				/* enter IAC state */
 				start = i + 1;
 				telnet->state = TELNET_STATE_IAC;
 
 				/* process subnegotiation; see comment in
-				 * TELNET_STATE_SB_DATA_IAC about invoking telnet_recv()
+				 * TELNET_STATE_SB_DATA_IAC about compressed bytes
 				 */
-				if (_subnegotiate(telnet) != 0) {
-					telnet_recv(telnet, &buffer[start], size - start);
-					return;
-				} else {
-					/* recursive call to get the current input byte processed
-					 * as a regular IAC command.  we could use a goto, but
-					 * that would be gross.
-					 */
-					_process(telnet, (char *)&byte, 1);
-				}
+				if (_subnegotiate(telnet) != 0)
+					return start;
+
+				/* process the current input byte as a regular IAC
+				 * command, without recursing
+				 */
+				goto retry;
+			}
+			break;
+		}
+	}
+
+	/* pass through any remaining bytes */
+	if (telnet->state == TELNET_STATE_DATA && i != start) {
+		if (run == end) {
+			_data(telnet, buffer + start, i - start);
+			return size;
+		}
+		if (end != start)
+			memmove(out + end, out + start, i - start);
+		end += i - start;
+	}
+	if (run != end)
+		_data(telnet, out + run, end - run);
+	return size;
+}
+
+/* same as the switch in _process(), one table lookup per byte */
+static size_t _process_dfa(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	const unsigned char *dfa = telnet->dfa;
+	telnet_event_t ev;
+	unsigned char byte, t, state = telnet->state;
+	size_t i, start;
+
+	for (i = start = 0; i != size; ++i) {
+		byte = buffer[i];
+again:
+		/* common path: state and table stay in registers, staying in the
+		 * same state is a predicted branch rather than a dependency on t */
+		t = dfa[state * DFA_CLASSES + _dfa_class[byte]];
+		if (t == state)
+			continue;
+		if ((t >> 4) == DFA_A_NONE) {
+			state = t & 0x0f;
+			continue;
+		}
+
+		/* actions work on the tracker, which handlers may change */
+		telnet->state = (telnet_state_t)state;
+		switch (t >> 4) {
+		/* IAC, or CR with NVT EOL translation */
+		case DFA_A_FLUSH:
+			if (i != start) {
+				ev.type = TELNET_EV_DATA;
+				ev.data.buffer = buffer + start;
+				ev.data.size = i - start;
+				telnet->eh(telnet, &ev, telnet->ud);
+			}
+			telnet->state = (telnet_state_t)(t & 0x0f);
+			break;
+
+		/* byte after CR; CR LF passes the LF only */
+		case DFA_A_EOL_NUL:
+		case DFA_A_EOL_CR:
+			ev.type = TELNET_EV_DATA;
+			ev.data.buffer = CRLF;
+			ev.data.size = 1;
+			telnet->eh(telnet, &ev, telnet->ud);
+			/* fall through */
+		case DFA_A_EOL_LF:
+			start = (t >> 4) == DFA_A_EOL_NUL ? i + 1 : i;
+			telnet->state = TELNET_STATE_DATA;
+			break;
+
+		case DFA_A_IAC_ESC:
+			ev.type = TELNET_EV_DATA;
+			ev.data.buffer = (char*)&byte;
+			ev.data.size = 1;
+			telnet->eh(telnet, &ev, telnet->ud);
+			start = i + 1;
+			telnet->state = TELNET_STATE_DATA;
+			break;
+
+		case DFA_A_IAC_CMD:
+			ev.type = TELNET_EV_IAC;
+			ev.iac.cmd = byte;
+			telnet->eh(telnet, &ev, telnet->ud);
+			start = i + 1;
+			telnet->state = TELNET_STATE_DATA;
+			break;
+
+		/* _negotiate() reads the command from the current state */
+		case DFA_A_NEG:
+			_negotiate(telnet, byte);
+			start = i + 1;
+			telnet->state = TELNET_STATE_DATA;
+			break;
+
+		case DFA_A_SB_TELOPT:
+			telnet->sb_telopt = byte;
+			telnet->buffer_pos = 0;
+			telnet->state = TELNET_STATE_SB_DATA;
+			break;
+
+		/* MCCPv1 start (IAC SB 85 WILL SE) is discarded, see _process() */
+		case DFA_A_SB_WILL:
+			if (telnet->sb_telopt == TELNET_TELOPT_COMPRESS) {
+				start = i + 2;
+				telnet->state = TELNET_STATE_DATA;
 				break;
 			}
+			/* fall through */
+		case DFA_A_SB_BYTE:
+		case DFA_A_SB_IAC:
+			if (_buffer_byte(telnet, byte) != TELNET_EOK) {
+				start = i + 1;
+				telnet->state = TELNET_STATE_DATA;
+			} else {
+				telnet->state = TELNET_STATE_SB_DATA;
+			}
+			break;
+
+		case DFA_A_SB_END:
+			start = i + 1;
+			telnet->state = TELNET_STATE_DATA;
+			if (_subnegotiate(telnet) != 0)
+				return start;
 			break;
+
+		/* flush the subnegotiation, then decode the byte as an IAC command */
+		case DFA_A_SB_ERR:
+			_error(telnet, __LINE__, __func__, TELNET_EPROTOCOL, 0,
+					TELNET_MSG_SB_IAC, byte, 0);
+			start = i + 1;
+			telnet->state = TELNET_STATE_IAC;
+			if (_subnegotiate(telnet) != 0)
+				return start;
+			state = telnet->state;
+			dfa = telnet->dfa;
+			goto again;
 		}
+		state = telnet->state;
+		dfa = telnet->dfa;
 	}
+	telnet->state = (telnet_state_t)state;
 
 	/* pass through any remaining bytes */
 	if (telnet->state == TELNET_STATE_DATA && i != start) {
@@ -1169,64 +1669,91 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 		ev.data.size = i - start;
 		telnet->eh(telnet, &ev, telnet->ud);
 	}
+	return size;
 }
 
-/* push a bytes into the state tracker */
-void telnet_recv(telnet_t *telnet, const char *buffer,
-		size_t size) {
 #if defined(HAVE_ZLIB)
-	/* if we have an inflate (decompression) zlib stream, use it */
-	if (telnet->z != 0 && !(telnet->flags & TELNET_PFLAG_DEFLATE)) {
-		char inflate_buffer[1024];
-		int rs;
+/* inflate compressed input into the tracker's buffer and decode it;
+ * returns the number of bytes consumed, which is less than size only if
+ * the compressed stream ended and plain input follows
+ */
+static size_t _inflate(telnet_t *telnet, const char *buffer, size_t size) {
+	telnet_event_t ev;
+	int rs;
 
-		/* initialize zlib state */
-		telnet->z->next_in = (unsigned char*)buffer;
-		telnet->z->avail_in = (unsigned int)size;
-		telnet->z->next_out = (unsigned char *)inflate_buffer;
-		telnet->z->avail_out = sizeof(inflate_buffer);
+	telnet->z->next_in = (unsigned char *)buffer;
+	telnet->z->avail_in = (unsigned int)size;
 
-		/* inflate until buffer exhausted and all output is produced */
-		while (telnet->z->avail_in > 0 || telnet->z->avail_out == 0) {
-			/* reset output buffer */
+	/* inflate until buffer exhausted and all output is produced */
+	do {
+		telnet->z->next_out = (unsigned char *)telnet->zbuf;
+		telnet->z->avail_out = TELNET_INFLATE_BUFFER;
 
-			/* decompress */
-			rs = inflate(telnet->z, Z_SYNC_FLUSH);
+		rs = inflate(telnet->z, Z_SYNC_FLUSH);
+		if (rs != Z_OK && rs != Z_STREAM_END) {
+			_error(telnet, __LINE__, __func__, TELNET_ECOMPRESS, 1,
+					TELNET_MSG_ZLIB, rs, "inflate()");
+			break;
+		}
 
-			/* process the decompressed bytes on success */
-			if (rs == Z_OK || rs == Z_STREAM_END)
-				_process(telnet, inflate_buffer, sizeof(inflate_buffer) -
-						telnet->z->avail_out);
-			else
-				_error(telnet, __LINE__, __func__, TELNET_ECOMPRESS, 1,
-						"inflate() failed: %s", zError(rs));
+		/* COMPRESS2 cannot start again while inflating, so all of
+		 * the output is consumed
+		 */
+		_process(telnet, telnet->zbuf,
+				TELNET_INFLATE_BUFFER - telnet->z->avail_out, telnet->zbuf);
+	} while (rs == Z_OK &&
+			(telnet->z->avail_in > 0 || telnet->z->avail_out == 0));
 
-			/* prepare output buffer for next run */
-			telnet->z->next_out = (unsigned char *)inflate_buffer;
-			telnet->z->avail_out = sizeof(inflate_buffer);
+	if (rs == Z_OK)
+		return size;
 
-			/* on error (or on end of stream) disable further inflation */
-			if (rs != Z_OK) {
-				telnet_event_t ev;
+	/* on error (or on end of stream) disable further inflation */
+	size -= rs == Z_STREAM_END ? telnet->z->avail_in : 0;
+	inflateEnd(telnet->z);
+	free(telnet->z);
+	telnet->z = 0;
 
-				/* disable compression */
-				inflateEnd(telnet->z);
-				free(telnet->z);
-				telnet->z = 0;
+	/* send event */
+	ev.type = TELNET_EV_COMPRESS;
+	ev.compress.state = 0;
+	telnet->eh(telnet, &ev, telnet->ud);
 
-				/* send event */
-				ev.type = TELNET_EV_COMPRESS;
-				ev.compress.state = 0;
-				telnet->eh(telnet, &ev, telnet->ud);
+	return size;
+}
+#endif /* defined(HAVE_ZLIB) */
 
-				break;
-			}
-		}
+/* push bytes into the state tracker; input switches between plain and
+ * compressed in this loop, never by recursion.  out is the buffer itself
+ * if it may be overwritten
+ */
+static void _recv(telnet_t *telnet, const char *buffer, size_t size,
+		char *out) {
+	size_t n;
 
-	/* COMPRESS2 is not negotiated, just process */
-	} else
+	while (size != 0) {
+#if defined(HAVE_ZLIB)
+		/* if we have an inflate (decompression) zlib stream, use it */
+		if (telnet->z != 0 && !(telnet->flags & TELNET_PFLAG_DEFLATE))
+			n = _inflate(telnet, buffer, size);
+		else
 #endif /* defined(HAVE_ZLIB) */
-		_process(telnet, buffer, size);
+			n = _process(telnet, buffer, size, out);
+		buffer += n;
+		size -= n;
+		if (out != 0)
+			out += n;
+	}
+}
+
+/* push a bytes into the state tracker */
+void telnet_recv(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	_recv(telnet, buffer, size, 0);
+}
+
+/* push bytes into the state tracker, decoding them in place */
+void telnet_recv_inplace(telnet_t *telnet, char *buffer, size_t size) {
+	_recv(telnet, buffer, size, buffer);
 }
 
 /* send an iac command */
@@ -1322,6 +1849,14 @@ void telnet_negotiate(telnet_t *telnet, unsigned char cmd,
 	}
 }
 
+/* send a TIMING-MARK request */
+void telnet_timing_mark(telnet_t *telnet) {
+	telnet_rfc1143_t q = _get_rfc1143(telnet, TELNET_TELOPT_TM);
+
+	_set_rfc1143(telnet, TELNET_TELOPT_TM, Q_US(q), Q_WANTYES);
+	_send_negotiate(telnet, TELNET_DO, TELNET_TELOPT_TM);
+}
+
 /* send non-command data (escapes IAC bytes) */
 void telnet_send(telnet_t *telnet, const char *buffer,
 		size_t size) {
@@ -1347,6 +1882,52 @@ void telnet_send(telnet_t *telnet, const char *buffer,
 	}
 }
 
+/* send data that is already NVT encoded */
+void telnet_send_encoded(telnet_t *telnet, const char *buffer,
+		size_t size) {
+	_send(telnet, buffer, size);
+}
+
+/* send non-command data from several buffers (escapes IAC bytes) */
+void telnet_sendv(telnet_t *telnet, const struct iovec *iov,
+		int iovcnt) {
+	struct iovec out[TELNET_SENDV_MAX];
+	const char *buffer;
+	size_t i, l;
+	int k, n = 0;
+
+	for (k = 0; k != iovcnt; ++k) {
+		buffer = (const char *)iov[k].iov_base;
+		for (l = i = 0; i != iov[k].iov_len; ++i) {
+			/* end the entry after the IAC and start the next one on it,
+			 * so it goes out twice without copying */
+			if (buffer[i] == (char)TELNET_IAC) {
+				if (n == TELNET_SENDV_MAX) {
+					_sendv(telnet, out, n);
+					n = 0;
+				}
+				out[n].iov_base = (void *)(buffer + l);
+				out[n++].iov_len = i + 1 - l;
+				l = i;
+			}
+		}
+
+		/* queue whatever portion of the buffer is left */
+		if (i != l) {
+			if (n == TELNET_SENDV_MAX) {
+				_sendv(telnet, out, n);
+				n = 0;
+			}
+			out[n].iov_base = (void *)(buffer + l);
+			out[n++].iov_len = i - l;
+		}
+	}
+
+	if (n != 0) {
+		_sendv(telnet, out, n);
+	}
+}
+
 /* send non-command text (escapes IAC bytes and does NVT translation) */
 void telnet_send_text(telnet_t *telnet, const char *buffer,
 		size_t size) {
@@ -1474,11 +2055,14 @@ int telnet_vprintf(telnet_t *telnet, const char *fmt, va_list va) {
 	rs = vsnprintf(buffer, sizeof(buffer), fmt, va_temp);
 	va_end(va_temp);
 
-	if (rs >= sizeof(buffer)) {
+	/* static trackers never allocate, truncate */
+	if (rs >= sizeof(buffer) && telnet->flags & TELNET_PFLAG_STATIC) {
+		rs = sizeof(buffer) - 1;
+	} else if (rs >= sizeof(buffer)) {
 		output = (char*)malloc(rs + 1);
 		if (output == 0) {
 			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"malloc() failed: %s", strerror(errno));
+					TELNET_MSG_ALLOC, errno, "malloc()");
 			return -1;
 		}
 
@@ -1546,11 +2130,14 @@ int telnet_raw_vprintf(telnet_t *telnet, const char *fmt, va_list va) {
 	rs = vsnprintf(buffer, sizeof(buffer), fmt, va_temp);
 	va_end(va_temp);
 
-	if (rs >= sizeof(buffer)) {
+	/* static trackers never allocate, truncate */
+	if (rs >= sizeof(buffer) && telnet->flags & TELNET_PFLAG_STATIC) {
+		rs = sizeof(buffer) - 1;
+	} else if (rs >= sizeof(buffer)) {
 		output = (char*)malloc(rs + 1);
 		if (output == 0) {
 			_error(telnet, __LINE__, __func__, TELNET_ENOMEM, 0,
-					"malloc() failed: %s", strerror(errno));
+					TELNET_MSG_ALLOC, errno, "malloc()");
 			return -1;
 		}
 
@@ -1617,6 +2204,14 @@ void telnet_ttype_is(telnet_t *telnet, const char* ttype) {
 	telnet_finish_sb(telnet);
 }
 
+/* send LINEMODE MODE command */
+void telnet_linemode_mode(telnet_t *telnet, unsigned char mode) {
+	unsigned char MODE[] = { TELNET_IAC, TELNET_SB, TELNET_TELOPT_LINEMODE,
+			TELNET_LINEMODE_MODE, 0, TELNET_IAC, TELNET_SE };
+	MODE[4] = mode;
+	_sendu(telnet, MODE, sizeof(MODE));
+}
+
 /* send ZMP data */
 void telnet_send_zmp(telnet_t *telnet, size_t argc, const char **argv) {
 	size_t i;
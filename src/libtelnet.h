@@ -45,6 +45,9 @@
 /* standard C headers necessary for the libtelnet API */
 #include <stdarg.h>
 #include <stddef.h>
+#if !defined(_WIN32)
+# include <sys/uio.h>
+#endif
 
 /* C++ support */
 #if defined(__cplusplus)
@@ -175,13 +178,29 @@ typedef struct telnet_telopt_t telnet_telopt_t;
 #define TELNET_MSSP_VAL 2
 /*@}*/
 
+/*! \name Protocol codes for LINEMODE commands. */
+/*@{*/
+/*! LINEMODE codes. */
+#define TELNET_LINEMODE_MODE 1
+#define TELNET_LINEMODE_FORWARDMASK 2
+#define TELNET_LINEMODE_SLC 3
+#define TELNET_LINEMODE_EDIT 1
+#define TELNET_LINEMODE_TRAPSIG 2
+#define TELNET_LINEMODE_MODE_ACK 4
+#define TELNET_LINEMODE_SOFT_TAB 8
+#define TELNET_LINEMODE_LIT_ECHO 16
+/*@}*/
+
 /*! \name Telnet state tracker flags. */
 /*@{*/
 /*! Control behavior of telnet state tracker. */
 #define TELNET_FLAG_PROXY (1<<0)
 #define TELNET_FLAG_NVT_EOL (1<<1)
+#define TELNET_FLAG_SENDV (1<<2)
+#define TELNET_FLAG_DFA (1<<3)
 
 /* Internal-only bits in option flags */
+#define TELNET_PFLAG_STATIC (1<<4)
 #define TELNET_FLAG_TRANSMIT_BINARY (1<<5)
 #define TELNET_FLAG_RECEIVE_BINARY (1<<6)
 #define TELNET_PFLAG_DEFLATE (1<<7)
@@ -200,6 +219,36 @@ enum telnet_error_t {
 };
 typedef enum telnet_error_t telnet_error_t; /*!< Error code type. */
 
+/*! Warning mask bit of an error code, see telnet_mask_warnings(). */
+#define TELNET_WARN(code) (1 << (code))
+/*! Warning mask skipping every warning. */
+#define TELNET_WARN_ALL 0xff
+
+/*! 
+ * error messages, formatted on demand by telnet_format_error()
+ */
+enum telnet_msg_t {
+	TELNET_MSG_NONE = 0,        /*!< no message */
+	TELNET_MSG_STATIC_COMPRESS, /*!< compression in a static tracker */
+	TELNET_MSG_COMPRESS_TWICE,  /*!< compression already initialized */
+	TELNET_MSG_ALLOC,           /*!< str: allocator, arg: errno */
+	TELNET_MSG_ZLIB,            /*!< str: zlib call, arg: zlib status */
+	TELNET_MSG_QUEUE_FULL,      /*!< RFC1143 queue cannot grow */
+	TELNET_MSG_DONT_WILL,       /*!< DONT answered by WILL */
+	TELNET_MSG_WONT_DO,         /*!< WONT answered by DO */
+	TELNET_MSG_SB_COMMAND,      /*!< arg: telopt */
+	TELNET_MSG_SB_VARTYPE,      /*!< arg: telopt */
+	TELNET_MSG_SB_ESC,          /*!< arg: telopt */
+	TELNET_MSG_MSSP_DATA,       /*!< malformed MSSP subnegotiation */
+	TELNET_MSG_ZMP_FRAME,       /*!< incomplete ZMP frame */
+	TELNET_MSG_TTYPE_EMPTY,     /*!< empty TERMINAL-TYPE request */
+	TELNET_MSG_TTYPE_TYPE,      /*!< invalid TERMINAL-TYPE request */
+	TELNET_MSG_SB_LIMIT,        /*!< subnegotiation buffer full */
+	TELNET_MSG_SB_IAC,          /*!< arg: byte after IAC inside SB */
+	TELNET_MSG_LINEMODE         /*!< malformed LINEMODE request */
+};
+typedef enum telnet_msg_t telnet_msg_t; /*!< Error message type. */
+
 /*! 
  * event codes 
  */
@@ -218,7 +267,9 @@ enum telnet_event_type_t {
 	TELNET_EV_ENVIRON,         /*!< ENVIRON command has been received */
 	TELNET_EV_MSSP,            /*!< MSSP command has been received */
 	TELNET_EV_WARNING,         /*!< recoverable error has occured */
-	TELNET_EV_ERROR            /*!< non-recoverable error has occured */
+	TELNET_EV_ERROR,           /*!< non-recoverable error has occured */
+	TELNET_EV_SENDV,           /*!< vector of data needs to be sent to the peer */
+	TELNET_EV_LINEMODE         /*!< LINEMODE command has been received */
 };
 typedef enum telnet_event_type_t telnet_event_type_t; /*!< Telnet event type. */
 
@@ -254,6 +305,15 @@ union telnet_event_t {
 		size_t size;                    /*!< number of bytes in buffer */
 	} data; /*!< DATA and SEND */
 
+	/*!
+	 * vectored send event: for SENDV, only with TELNET_FLAG_SENDV
+	 */
+	struct sendv_t {
+		enum telnet_event_type_t _type; /*!< alias for type */
+		const struct iovec *iov;        /*!< entries, in order */
+		int iovcnt;                     /*!< number of entries, at most TELNET_SENDV_MAX */
+	} sendv; /*!< SENDV */
+
 	/*! 
 	 * WARNING and ERROR events 
 	 */
@@ -261,9 +321,12 @@ union telnet_event_t {
 		enum telnet_event_type_t _type; /*!< alias for type */
 		const char *file;               /*!< file the error occured in */
 		const char *func;               /*!< function the error occured in */
-		const char *msg;                /*!< error message string */
+		const char *msg;                /*!< message without arguments */
+		const char *str;                /*!< string argument of code */
 		int line;                       /*!< line of file error occured on */
+		int arg;                        /*!< integer argument of code */
 		telnet_error_t errcode;         /*!< error code */
+		telnet_msg_t code;              /*!< message, see telnet_format_error() */
 	} error; /*!< WARNING and ERROR */
 
 	/*! 
@@ -337,6 +400,18 @@ union telnet_event_t {
 		const struct telnet_environ_t *values; /*!< array of variable values */
 		size_t size;                           /*!< number of elements in values */
 	} mssp; /*!< MSSP */
+
+	/*!
+	 * LINEMODE event
+	 */
+	struct linemode_t {
+		enum telnet_event_type_t _type; /*!< alias for type */
+		unsigned char cmd;              /*!< MODE, SLC, or DO, DONT, WILL,
+		                                     WONT for FORWARDMASK */
+		unsigned char mode;             /*!< mode mask (MODE only) */
+		const char *data;               /*!< SLC triplets or forward mask */
+		size_t size;                    /*!< number of bytes in data */
+	} linemode; /*!< LINEMODE */
 };
 
 /*! 
@@ -368,6 +443,36 @@ struct telnet_telopt_t {
  */
 struct telnet_t;
 
+/*! Maximum number of entries in a TELNET_EV_SENDV event. */
+#if !defined(TELNET_SENDV_MAX)
+#define TELNET_SENDV_MAX 16
+#endif
+
+/*! Size of the inflate output buffer allocated when COMPRESS2 starts. */
+#if !defined(TELNET_INFLATE_BUFFER)
+#define TELNET_INFLATE_BUFFER 4096
+#endif
+
+/*! Number of telopts a static tracker keeps RFC1143 state for. */
+#if !defined(TELNET_STATIC_QUEUE)
+#define TELNET_STATIC_QUEUE 16
+#endif
+
+/*! Subnegotiation buffer size of a static tracker. */
+#if !defined(TELNET_STATIC_BUFFER)
+#define TELNET_STATIC_BUFFER 512
+#endif
+
+/*! 
+ * caller-provided storage of a tracker that never allocates memory,
+ * see telnet_init_static()
+ */
+typedef struct telnet_static_t {
+	void *tracker[16];
+	unsigned char q[TELNET_STATIC_QUEUE][2];
+	char buffer[TELNET_STATIC_BUFFER];
+} telnet_static_t;
+
 /*!
  * \brief Initialize a telnet state tracker.
  *
@@ -377,13 +482,68 @@ struct telnet_t;
  *
  * \param telopts   Table of TELNET options the application supports.
  * \param eh        Event handler function called for every event.
- * \param flags     0 or TELNET_FLAG_PROXY.
+ * \param flags     0 or a combination of TELNET_FLAG_PROXY,
+ *                  TELNET_FLAG_NVT_EOL, TELNET_FLAG_SENDV and
+ *                  TELNET_FLAG_DFA (decode input with a transition
+ *                  table chosen for the flags instead of nested
+ *                  switches; same events, see tools/telnet_dfa_bench.c).
  * \param user_data Optional data pointer that will be passsed to eh.
  * \return Telnet state tracker object.
  */
 extern telnet_t* telnet_init(const telnet_telopt_t *telopts,
 		telnet_event_handler_t eh, unsigned char flags, void *user_data);
 
+/*!
+ * \brief Initialize a state tracker in caller-provided storage.
+ *
+ * Works like telnet_init(), but the tracker never allocates memory:
+ * subnegotiations longer than TELNET_STATIC_BUFFER bytes and telopts
+ * beyond TELNET_STATIC_QUEUE fail with TELNET_EOVERFLOW, compression is
+ * not available, subnegotiations are only delivered as
+ * TELNET_EV_SUBNEGOTIATION and TELNET_EV_LINEMODE (no ZMP, TTYPE, ENVIRON
+ * or MSSP events) and formatted output is truncated to 1023 characters.
+ *
+ * \param storage   Storage for the tracker, must outlive it.
+ * \param telopts   Table of TELNET options the application supports.
+ * \param eh        Event handler function called for every event.
+ * \param flags     0 or a combination of TELNET_FLAG_PROXY,
+ *                  TELNET_FLAG_NVT_EOL, TELNET_FLAG_SENDV and
+ *                  TELNET_FLAG_DFA (decode input with a transition
+ *                  table chosen for the flags instead of nested
+ *                  switches; same events, see tools/telnet_dfa_bench.c).
+ * \param user_data Optional data pointer that will be passsed to eh.
+ * \return Telnet state tracker object.
+ */
+extern telnet_t* telnet_init_static(telnet_static_t *storage,
+		const telnet_telopt_t *telopts, telnet_event_handler_t eh,
+		unsigned char flags, void *user_data);
+
+/*!
+ * \brief Skip warnings by error code.
+ *
+ * Warnings whose TELNET_WARN() bit is set in mask are dropped before
+ * any event is built; errors are always delivered.  Trackers start
+ * with an empty mask.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param mask   0, TELNET_WARN_ALL or a combination of TELNET_WARN().
+ */
+extern void telnet_mask_warnings(telnet_t *telnet, unsigned char mask);
+
+/*!
+ * \brief Format the message of a WARNING or ERROR event.
+ *
+ * Events carry a message code and its arguments; the text is only
+ * built here, on demand.
+ *
+ * \param ev     WARNING or ERROR event.
+ * \param buffer Buffer receiving the text, always terminated.
+ * \param size   Size of buffer.
+ * \return Length of the full text, as snprintf().
+ */
+extern int telnet_format_error(const telnet_event_t *ev, char *buffer,
+		size_t size);
+
 /*!
  * \brief Free up any memory allocated by a state tracker.
  *
@@ -410,6 +570,23 @@ extern void telnet_free(telnet_t *telnet);
 extern void telnet_recv(telnet_t *telnet, const char *buffer,
 		size_t size);
 
+/*!
+ * \brief Push a writable byte buffer into the state tracker.
+ *
+ * Like telnet_recv(), but the buffer may be overwritten: with
+ * TELNET_FLAG_NVT_EOL, CR LF and CR NUL are translated to LF and CR,
+ * and IAC IAC is translated to IAC, in place.  The decoded bytes between
+ * two commands are passed on in a single TELNET_EV_DATA event instead of
+ * being split at every translation.  The DATA events point into the
+ * buffer.  Trackers using TELNET_FLAG_DFA decode as with telnet_recv().
+ *
+ * \param telnet Telnet state tracker object.
+ * \param buffer Pointer to byte buffer, modified by the call.
+ * \param size   Number of bytes pointed to by buffer.
+ */
+extern void telnet_recv_inplace(telnet_t *telnet, char *buffer,
+		size_t size);
+
 /*!
  * \brief Send a telnet command.
  *
@@ -432,6 +609,18 @@ extern void telnet_iac(telnet_t *telnet, unsigned char cmd);
 extern void telnet_negotiate(telnet_t *telnet, unsigned char cmd,
 		unsigned char opt);
 
+/*!
+ * \brief Send a TIMING-MARK request.
+ *
+ * Sends IAC DO TIMING-MARK (RFC860) regardless of the current option
+ * state.  The reply is reported as a TELNET_EV_WILL or TELNET_EV_WONT
+ * event for TELNET_TELOPT_TM, after which the option is reset so that
+ * the request can be repeated.
+ *
+ * \param telnet Telnet state tracker object.
+ */
+extern void telnet_timing_mark(telnet_t *telnet);
+
 /*!
  * Send non-command data (escapes IAC bytes).
  *
@@ -442,6 +631,38 @@ extern void telnet_negotiate(telnet_t *telnet, unsigned char cmd,
 extern void telnet_send(telnet_t *telnet,
 		const char *buffer, size_t size);
 
+/*!
+ * \brief Send non-command data gathered from several buffers.
+ *
+ * Escapes IAC bytes like telnet_send() without copying: an entry is
+ * split after each IAC and the next one starts at the same byte.  If
+ * the tracker was created with TELNET_FLAG_SENDV and output is not
+ * compressed, the entries are passed on in TELNET_EV_SENDV events of
+ * up to TELNET_SENDV_MAX entries, suitable for writev(); otherwise
+ * one TELNET_EV_SEND event is generated per entry.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param iov    Buffers to send, in order.
+ * \param iovcnt Number of buffers.
+ */
+extern void telnet_sendv(telnet_t *telnet,
+		const struct iovec *iov, int iovcnt);
+
+/*!
+ * \brief Send data that is already NVT encoded.
+ *
+ * The buffer goes out in a single TELNET_EV_SEND event without
+ * escaping, compressed if compression is enabled.  Meant for constant
+ * text encoded once ahead of time: IAC bytes must be doubled and line
+ * ends sent as CR LF.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param buffer Encoded bytes.
+ * \param size   Number of bytes.
+ */
+extern void telnet_send_encoded(telnet_t *telnet,
+		const char *buffer, size_t size);
+
 /*!
  * Send non-command text (escapes IAC bytes and translates
  * \\r -> CR-NUL and \\n -> CR-LF unless in BINARY mode.
@@ -631,6 +852,18 @@ extern void telnet_ttype_send(telnet_t *telnet);
  */
 extern void telnet_ttype_is(telnet_t *telnet, const char* ttype);
 
+/*!
+ * \brief Send the LINEMODE MODE command.
+ *
+ * Sends the sequence IAC SB LINEMODE MODE mask IAC SE.  A server sets
+ * the mode it wants the client to use, the client answers with the mode
+ * it switched to and TELNET_LINEMODE_MODE_ACK set.
+ *
+ * \param telnet Telnet state tracker object.
+ * \param mode   Mode mask, e.g. TELNET_LINEMODE_EDIT.
+ */
+extern void telnet_linemode_mode(telnet_t *telnet, unsigned char mode);
+
 /*!
  * \brief Send a ZMP command.
  *
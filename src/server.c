@@ -1,4 +1,7 @@
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "sdkconfig.h"
 
 /**
@@ -14,23 +17,458 @@
  */
 #define AWAIT_TIMEOUT 10
 
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
 #include <esp_log.h>
 #include <libtelnet.h>
 #include <lwip/def.h>
 #include <lwip/sockets.h>
 #include <telnet/server.h>
+#include <telnet/transport.h>
+#include <telnet_channel.h>
+#include <telnet_mpsc.h>
+#include <telnet_outq.h>
+#include <telnet_session.h>
+#include <telnet_wheel.h>
 
 static const char* TAG = "telnet";
 
 /**
- * @brief Array of user structures representing the connected users.
+ * @brief Number of sessions allocated at once when the session table grows.
+ */
+#define SESSION_CHUNK 8
+
+/**
+ * @brief Bits of a session id holding the slot index, the rest is the generation.
+ */
+#define SESSION_INDEX_BITS 16
+#define SESSION_INDEX_MASK ((1u << SESSION_INDEX_BITS) - 1)
+
+/**
+ * @brief Maximum length of a channel name including the terminator.
+ */
+#define CHANNEL_NAME_LEN 16
+
+/**
+ * @brief Size of the chunks pulled from a streaming command.
+ */
+#define STREAM_CHUNK 512
+
+/**
+ * @brief Number of asynchronous commands that can wait for a worker.
+ */
+#define WORKER_QUEUE_LEN 8
+
+/**
+ * @brief Bytes of output collected while a session is set up, sent as one segment.
+ */
+#define CONNECT_BURST_SIZE 256
+
+/**
+ * @brief Bytes of echo collected in character mode before they are sent.
+ */
+#define ECHO_CHUNK 64
+
+/**
+ * @brief Poll set entries in front of the sessions: the listening socket and the wakeup descriptor.
+ */
+#define PFD_SESSIONS 2
+
+/**
+ * @brief Flags of the per-session telnet trackers.
+ */
+#if CONFIG_TELNET_SERVER_DFA_DECODER
+#define TRACKER_FLAGS (TELNET_FLAG_SENDV | TELNET_FLAG_DFA)
+#else
+#define TRACKER_FLAGS TELNET_FLAG_SENDV
+#endif
+
+/**
+ * @brief Fixed replies of the server, see replies.
+ */
+enum reply {
+  REPLY_ENTER_NAME,
+  REPLY_NAME_IN_USE,
+  REPLY_INVALID_NAME,
+  REPLY_TOO_MANY_USERS,
+  REPLY_LOGIN_TIMEOUT,
+  REPLY_IDLE_TIMEOUT,
+  REPLY_NO_CHANNEL,
+  REPLY_NO_MEMORY,
+  REPLY_STILL_RUNNING,
+  REPLY_UNKNOWN_COMMAND,
+  REPLY_BUSY,
+};
+
+/**
+ * @brief Fixed replies, NVT encoded at compile time so they are sent without formatting or escaping.
+ */
+static const telnet_text_t replies[] = {
+  [REPLY_ENTER_NAME] = TELNET_TEXT("Enter name: "),
+  [REPLY_NAME_IN_USE] = TELNET_TEXT("Name already in use. Enter name: "),
+  [REPLY_INVALID_NAME] = TELNET_TEXT("Invalid name. Enter name: "),
+  [REPLY_TOO_MANY_USERS] = TELNET_TEXT("Too many users.\r\n"),
+  [REPLY_LOGIN_TIMEOUT] = TELNET_TEXT("\r\nLogin timeout.\r\n"),
+  [REPLY_IDLE_TIMEOUT] = TELNET_TEXT("\r\nIdle timeout.\r\n"),
+  [REPLY_NO_CHANNEL] = TELNET_TEXT("No such channel.\r\n"),
+  [REPLY_NO_MEMORY] = TELNET_TEXT("Out of memory.\r\n"),
+  [REPLY_STILL_RUNNING] = TELNET_TEXT("Command still running, press Ctrl-C to cancel.\r\n"),
+  [REPLY_UNKNOWN_COMMAND] = TELNET_TEXT("Unknown command.\r\n"),
+  [REPLY_BUSY] = TELNET_TEXT("Too busy, try again later.\r\n"),
+};
+
+/**
+ * @brief Session table, allocated in chunks of SESSION_CHUNK up to telnet_server_config_t::max_connections.
+ *
+ * Chunks are never moved, so pointers to sessions stay valid while the table grows. Unused
+ * sessions are kept in the `free_users` list.
+ */
+static struct user_t** chunks;
+static int nchunks;
+static int capacity;
+static struct user_t* free_users;
+
+/**
+ * @brief Publish/subscribe channel, see telnet_server_channel().
+ */
+struct channel {
+  char name[CHANNEL_NAME_LEN];
+  telnet_drop_policy_t policy;
+  /* bitset over session slot indexes, `member_words` words long */
+  uint32_t* members;
+  int count;
+};
+
+/**
+ * @brief Channel table, kept across telnet_server_stop() so channels can be set up before the server starts.
+ */
+static struct channel channels[CONFIG_TELNET_SERVER_MAX_CHANNELS];
+static int nchannels;
+static int member_words;
+
+/**
+ * @brief A command started by a session, see telnet_cmd_t.
+ *
+ * Asynchronous commands are shared by the session and a worker, each holding a reference.
+ */
+struct telnet_cmd {
+  const telnet_command_t* command;
+  telnet_session_id_t session;
+  /* synchronous commands only, runs on the server task */
+  struct user_t* user;
+  atomic_bool cancelled;
+  atomic_bool done;
+  atomic_int refs;
+  char args[];
+};
+
+/**
+ * @brief Output generator of a command, see telnet_cmd_stream().
+ */
+struct telnet_stream {
+  telnet_stream_fn_t next;
+  void (*release)(void* state);
+  void* state;
+};
+
+/**
+ * @brief Asynchronous commands waiting for a worker, NULL if commands run on the server task.
+ */
+static QueueHandle_t jobs;
+
+/**
+ * @brief Given by every worker when it exits, see telnet_server_stop().
+ */
+static SemaphoreHandle_t workers_done;
+static int nworkers;
+
+/**
+ * @brief Socket operations of the running server, see telnet_server_config_t::transport.
+ */
+static const telnet_transport_t* tp = &telnet_transport_lwip;
+
+/**
+ * @brief Listening socket of the running server.
+ */
+static int listen_sock = -1;
+
+/**
+ * @brief Configuration of the running server.
+ */
+static telnet_server_config_t config;
+
+/**
+ * @brief Whether the telopt table agrees to COMPRESS2, which is then offered to every client.
+ */
+static bool compress2;
+
+/**
+ * @brief Output of the session being set up, see _cork().
+ */
+static struct {
+  struct user_t* user;
+  size_t len;
+  char data[CONNECT_BURST_SIZE];
+} burst;
+
+/**
+ * @brief Timer wheel driving login, idle and keepalive timeouts of all sessions.
+ */
+static struct telnet_wheel wheel;
+
+/**
+ * @brief Buffers queued by other tasks, see telnet_server_send().
+ */
+static struct telnet_mpsc sendq;
+
+/**
+ * @brief Descriptor that wakes up poll() when another task queued a buffer, -1 if unsupported.
+ */
+static int wakeup_fd = -1;
+
+/**
+ * @brief Set by the first producer after the loop drained the wakeup descriptor, avoids a
+ * notification per buffer.
+ */
+static atomic_bool wakeup_pending;
+
+/**
+ * @brief Densely packed poll set: the listening socket and the wakeup descriptor, followed by live sessions only.
+ *
+ * Entries are added on connect and swap-removed on disconnect, `pfd_user` maps every entry back
+ * to its session and `user_t::pfd_index` points the other way. Both arrays grow with the session
+ * table and also serve to iterate over live sessions.
+ */
+static struct pollfd* pfd;
+static struct user_t** pfd_user;
+static nfds_t npfd;
+
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+/**
+ * @brief Storage of the static allocation mode, sized by Kconfig so the worst case is known at link time.
+ *
+ * Every session slot owns its line buffer, telnet tracker, channel queue, command and stream;
+ * output goes through a fixed pool of buffers.
+ */
+#define STATIC_SESSIONS CONFIG_TELNET_SERVER_MAX_CONNECTIONS
+#define STATIC_WORKERS (CONFIG_TELNET_SERVER_WORKERS > 0 ? CONFIG_TELNET_SERVER_WORKERS : 1)
+#define STATIC_JOB_SIZE ((sizeof(struct telnet_cmd) + LINEBUFFER_SIZE + 7) & ~(size_t)7)
+
+static struct user_t static_users[STATIC_SESSIONS];
+static struct user_t* static_chunks[(STATIC_SESSIONS + SESSION_CHUNK - 1) / SESSION_CHUNK];
+static struct pollfd static_pfd[STATIC_SESSIONS + PFD_SESSIONS];
+static struct user_t* static_pfd_user[STATIC_SESSIONS + PFD_SESSIONS];
+static uint32_t static_members[CONFIG_TELNET_SERVER_MAX_CHANNELS][(STATIC_SESSIONS + 31) / 32];
+static struct user_cold static_cold[STATIC_SESSIONS];
+static telnet_static_t static_telnet[STATIC_SESSIONS];
+static struct telnet_buf* static_rings[STATIC_SESSIONS][CONFIG_TELNET_SERVER_CHANNEL_QUEUE_LEN];
+static _Alignas(struct telnet_cmd) char static_jobs[STATIC_SESSIONS][STATIC_JOB_SIZE];
+static struct telnet_stream static_streams[STATIC_SESSIONS];
+static struct telnet_mpsc_cell static_cells[CONFIG_TELNET_SERVER_SEND_QUEUE_SIZE];
+static _Alignas(struct telnet_buf) char static_buffers[CONFIG_TELNET_SERVER_BUFFER_POOL][TELNET_BUF_POOL_SLOT];
+static _Atomic uint32_t static_buffer_links[CONFIG_TELNET_SERVER_BUFFER_POOL];
+static struct telnet_buf_pool static_pool;
+static uint8_t static_jobs_storage[WORKER_QUEUE_LEN * sizeof(struct telnet_cmd*)];
+static StaticQueue_t static_jobs_queue;
+static StaticSemaphore_t static_workers_done;
+static StackType_t static_worker_stacks[STATIC_WORKERS][CONFIG_TELNET_SERVER_WORKER_STACK_SIZE];
+static StaticTask_t static_worker_tasks[STATIC_WORKERS];
+static StackType_t static_server_stack[CONFIG_TELNET_SERVER_STACK_SIZE];
+static StaticTask_t static_server_task;
+#endif
+
+/**
+ * @brief Appends a session socket to the poll set.
+ *
+ * @param user The user to add.
+ */
+static void _pfd_add(struct user_t* user)
+{
+  pfd[npfd].fd = user->sock;
+  pfd[npfd].events = POLLIN;
+  pfd[npfd].revents = 0;
+  pfd_user[npfd] = user;
+  user->pfd_index = npfd++;
+}
+
+/**
+ * @brief Removes a session socket from the poll set by moving the last entry into its place.
+ *
+ * @param user The user to remove.
+ */
+static void _pfd_remove(struct user_t* user)
+{
+  nfds_t k = user->pfd_index;
+
+  if (k != --npfd) {
+    pfd[k] = pfd[npfd];
+    pfd_user[k] = pfd_user[npfd];
+    pfd_user[k]->pfd_index = k;
+  }
+  user->pfd_index = 0;
+}
+
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+/**
+ * @brief Sets up the whole session table in static storage at once.
+ *
+ * @return `false` if the table is already set up.
+ */
+static bool _grow(void)
+{
+  int i;
+
+  if (capacity != 0) {
+    return false;
+  }
+
+  memset(static_users, 0, sizeof(static_users));
+  for (i = 0; i * SESSION_CHUNK < config.max_connections; ++i) {
+    static_chunks[i] = &static_users[i * SESSION_CHUNK];
+  }
+  chunks = static_chunks;
+  nchunks = i;
+  pfd = static_pfd;
+  pfd_user = static_pfd_user;
+
+  member_words = (config.max_connections + 31) / 32;
+  for (i = 0; i != nchannels; ++i) {
+    memset(channels[i].members, 0, sizeof(static_members[i]));
+  }
+
+  for (i = config.max_connections - 1; i >= 0; --i) {
+    static_users[i].id = i;
+    static_users[i].sock = -1;
+    static_users[i].next = free_users;
+    free_users = &static_users[i];
+  }
+  capacity = config.max_connections;
+  return true;
+}
+#else
+/**
+ * @brief Adds a chunk of free sessions to the session table.
  *
- * This array stores information about the connected users in the Telnet server.
- * Each element of the array represents a user and contains relevant user data.
- * The size of the array is determined by the CONFIG_TELNET_SERVER_MAX_CONNECTIONS constant.
- * The "+ 1" is added to accommodate an extra slot for a new connection.
+ * @return `false` if the table is at `max_connections` or memory is exhausted.
+ */
+static bool _grow(void)
+{
+  int n = config.max_connections - capacity < SESSION_CHUNK ? config.max_connections - capacity : SESSION_CHUNK;
+  struct pollfd* fds;
+  struct user_t** map;
+  struct user_t** list;
+  struct user_t* chunk;
+  uint32_t* members;
+  int words = (capacity + n + 31) / 32;
+  int i;
+
+  if (n <= 0) {
+    return false;
+  }
+
+  /* channel membership covers every slot */
+  if (words > member_words) {
+    for (i = 0; i != nchannels; ++i) {
+      if ((members = (uint32_t*)realloc(channels[i].members, words * sizeof(*members))) == NULL) {
+        return false;
+      }
+      memset(members + member_words, 0, (words - member_words) * sizeof(*members));
+      channels[i].members = members;
+    }
+    member_words = words;
+  }
+
+  /* the poll set holds the listening socket and wakeup descriptor plus every session */
+  if ((fds = (struct pollfd*)realloc(pfd, (capacity + n + PFD_SESSIONS) * sizeof(*pfd))) == NULL) {
+    return false;
+  }
+  pfd = fds;
+  if ((map = (struct user_t**)realloc(pfd_user, (capacity + n + PFD_SESSIONS) * sizeof(*pfd_user))) == NULL) {
+    return false;
+  }
+  pfd_user = map;
+  if ((list = (struct user_t**)realloc(chunks, (nchunks + 1) * sizeof(*chunks))) == NULL) {
+    return false;
+  }
+  chunks = list;
+  if ((chunk = (struct user_t*)calloc(n, sizeof(*chunk))) == NULL) {
+    return false;
+  }
+  chunks[nchunks++] = chunk;
+
+  for (i = n - 1; i >= 0; --i) {
+    chunk[i].id = capacity + i;
+    chunk[i].sock = -1;
+    chunk[i].next = free_users;
+    free_users = &chunk[i];
+  }
+  capacity += n;
+  return true;
+}
+#endif
+
+/**
+ * @brief Releases the session table, the poll set and the send queue.
+ */
+static void _release(void)
+{
+  int i;
+
+  telnet_mpsc_destroy(&sendq);
+  if (wakeup_fd != -1) {
+    tp->close(tp->ctx, wakeup_fd);
+    wakeup_fd = -1;
+  }
+
+#if !CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  for (i = 0; i != nchunks; ++i) {
+    free(chunks[i]);
+  }
+  free(chunks);
+  free(pfd);
+  free(pfd_user);
+  for (i = 0; i != nchannels; ++i) {
+    free(channels[i].members);
+    channels[i].members = NULL;
+  }
+#endif
+  for (i = 0; i != nchannels; ++i) {
+    channels[i].count = 0;
+  }
+  member_words = 0;
+  chunks = NULL;
+  nchunks = 0;
+  capacity = 0;
+  free_users = NULL;
+  pfd = NULL;
+  pfd_user = NULL;
+  npfd = 0;
+}
+
+/**
+ * @brief Returns the session in slot `index` of the session table.
  */
-static struct user_t users[CONFIG_TELNET_SERVER_MAX_CONNECTIONS + 1];
+static inline struct user_t* _slot(uint32_t index)
+{
+  return &chunks[index / SESSION_CHUNK][index % SESSION_CHUNK];
+}
+
+/**
+ * @brief Returns the live session with the given id, or NULL if it was closed meanwhile.
+ */
+static struct user_t* _session(telnet_session_id_t id)
+{
+  uint32_t index = id & SESSION_INDEX_MASK;
+  struct user_t* user;
+
+  if (index >= (uint32_t)capacity) {
+    return NULL;
+  }
+  user = _slot(index);
+  return user->id == id && user->sock != -1 ? user : NULL;
+}
 
 /**
  * @brief Pushes a character into the line buffer.
@@ -85,10 +523,18 @@ static void linebuffer_push(char* buffer, size_t size, int* linepos, char ch,
  */
 static void _message(const char* from, const char* msg)
 {
-  int i;
-  for (i = 0; i != CONFIG_TELNET_SERVER_MAX_CONNECTIONS; ++i) {
-    if (users[i].sock != -1 && users[i].name != 0 && strcmp(users[i].name, from) != 0) {
-      telnet_printf(users[i].telnet, "%s: \"%s\"\n", from, msg);
+  /* names have no control characters (see _login()) and `msg` is fixed text, no NVT translation needed */
+  struct iovec iov[4] = {
+    {(void*)from, strlen(from)},
+    {(void*)": \"", 3},
+    {(void*)msg, strlen(msg)},
+    {(void*)"\"\r\n", 3},
+  };
+  nfds_t k;
+
+  for (k = PFD_SESSIONS; k < npfd; ++k) {
+    if (pfd_user[k]->cold->name != 0 && strcmp(pfd_user[k]->cold->name, from) != 0) {
+      telnet_sendv(pfd_user[k]->telnet, iov, 4);
     }
   }
 }
@@ -103,42 +549,95 @@ static void _message(const char* from, const char* msg)
  */
 static void _broadcast(const char* from, const char* msg)
 {
-  int i;
-  for (i = 0; i != CONFIG_TELNET_SERVER_MAX_CONNECTIONS; ++i) {
-    if (users[i].sock != -1) {
-      telnet_printf(users[i].telnet, "%s: \"%s\"\n", from, msg);
-    }
+  struct iovec iov[4] = {
+    {(void*)from, strlen(from)},
+    {(void*)": \"", 3},
+    {(void*)msg, strlen(msg)},
+    {(void*)"\"\r\n", 3},
+  };
+  nfds_t k;
+
+  for (k = PFD_SESSIONS; k < npfd; ++k) {
+    telnet_sendv(pfd_user[k]->telnet, iov, 4);
   }
 }
 
 /**
- * Sends data over a socket.
+ * @brief Marks a session for closing from within one of its telnet callbacks.
+ *
+ * The tracker cannot be freed from its own callback, the loop or the next timer tick reaps the session.
+ *
+ * @param user The user to close.
+ */
+static void _close_later(struct user_t* user)
+{
+  user->closing = true;
+  telnet_timer_schedule(&wheel, &user->timer, tp->now(tp->ctx));
+}
+
+/**
+ * @brief Writes to the socket of a session, see telnet_outq_flush().
+ */
+static ssize_t _write(void* ctx, const char* buffer, size_t size)
+{
+  struct user_t* user = (struct user_t*)ctx;
+
+  return tp->send(tp->ctx, user->sock, buffer, size, 0);
+}
+
+/**
+ * @brief Collects everything sent to a session until _uncork(), so it leaves in one segment.
+ *
+ * @param user The session being set up.
+ */
+static void _cork(struct user_t* user)
+{
+  burst.user = user;
+  burst.len = 0;
+}
+
+/**
+ * Sends data to a session.
+ *
+ * Client sockets are non-blocking: whatever the socket does not take right away is queued and
+ * flushed once poll() reports POLLOUT. A session whose queue exceeds the configured limit is closed.
  *
- * @param sock The socket descriptor.
+ * @param user The user to send to.
  * @param buffer The buffer containing the data to send.
  * @param size The size of the data to send.
  */
-static void _send(int sock, const char* buffer, size_t size)
+static void _send(struct user_t* user, const char* buffer, size_t size)
 {
-  int rs;
+  ssize_t rs;
 
   /* ignore on invalid socket */
-  if (sock == -1)
+  if (user->sock == -1 || user->closing)
     return;
 
-  /* send data */
-  while (size > 0) {
-    if ((rs = send(sock, buffer, (int)size, 0)) == -1) {
-      if (errno != EINTR && errno != ECONNRESET) {
-        ESP_LOGW(TAG, "send() failed: %s", strerror(errno));
-        return;
+  /* collect the connect burst, send what came before if it does not fit */
+  if (burst.user == user) {
+    if (burst.len + size <= sizeof(burst.data)) {
+      memcpy(burst.data + burst.len, buffer, size);
+      burst.len += size;
+      return;
+    }
+    burst.user = NULL;
+    _send(user, burst.data, burst.len);
+  }
+
+  /* send directly while nothing is queued, otherwise append to keep the order */
+  while (user->outq.head == NULL && size > 0) {
+    if ((rs = tp->send(tp->ctx, user->sock, buffer, size, 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
       }
-      else {
-        return;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
       }
-    }
-    else if (rs == 0) {
-      ESP_LOGE(TAG, "send() unexpectedly returned 0");
+      if (errno != ECONNRESET && errno != EPIPE) {
+        ESP_LOGW(TAG, "send() failed: %s", strerror(errno));
+      }
+      _close_later(user);
       return;
     }
 
@@ -146,121 +645,810 @@ static void _send(int sock, const char* buffer, size_t size)
     buffer += rs;
     size -= rs;
   }
+
+  if (size == 0) {
+    return;
+  }
+
+  if (user->outq.bytes + size > (size_t)config.output_queue_limit) {
+    ESP_LOGW(TAG, "Output queue overflow");
+    _close_later(user);
+    return;
+  }
+  if (telnet_outq_append(&user->outq, buffer, size) == -1) {
+    ESP_LOGE(TAG, "Out of memory for output");
+    _close_later(user);
+    return;
+  }
+  pfd[user->pfd_index].events |= POLLOUT;
 }
 
 /**
- * Handles the input line from a user.
- *
- * @param user The user object.
- * @param line The input line from the user.
+ * @brief Sends the output collected since _cork().
  */
-static void _handle(struct user_t* user, const char* line)
+static void _uncork(void)
 {
-  return;
+  struct user_t* user = burst.user;
+
+  burst.user = NULL;
+  if (user != NULL && burst.len != 0) {
+    _send(user, burst.data, burst.len);
+  }
 }
 
-/* process input line */
 /**
- * @brief Sets the user online status.
+ * @brief Sends a vector of buffers to a session.
  *
- * This function is called when the user goes online.
- * It updates the online status of the user and performs any necessary actions.
+ * While nothing is queued the whole vector goes out in one writev(), whatever the socket does not
+ * take is handed to _send() and queued in order.
  *
- * @param line The command line received.
- * @param overflow The overflow size.
- * @param ud User data.
+ * @param user The user to send to.
+ * @param iov The buffers to send.
+ * @param iovcnt The number of buffers.
  */
-static void _online(const char* line, size_t overflow, void* ud)
+static void _sendv(struct user_t* user, const struct iovec* iov, int iovcnt)
 {
-  struct user_t* user = (struct user_t*)ud;
+  ssize_t rs = 0;
   int i;
 
-  (void)overflow;
+  /* ignore on invalid socket */
+  if (user->sock == -1 || user->closing)
+    return;
 
-  /* if the user has no name, this is his "login" */
-  if (user->name == 0) {
-    /* must not be empty, must be at least 32 chars */
-    if (strlen(line) == 0 || strlen(line) > 32) {
-      telnet_printf(user->telnet, "Invalid name. Enter name: ");
-      return;
+  if (user->outq.head == NULL && tp->writev != NULL && burst.user != user) {
+    while ((rs = tp->writev(tp->ctx, user->sock, iov, iovcnt)) == -1 && errno == EINTR) {
     }
-
-    /* must not already exist */
-    for (i = 0; i != CONFIG_TELNET_SERVER_MAX_CONNECTIONS; ++i) {
-      if (users[i].name != 0 && strcmp(users[i].name, line) == 0) {
-        telnet_printf(user->telnet, "Name already in use. Enter name: ");
+    if (rs == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (errno != ECONNRESET && errno != EPIPE) {
+          ESP_LOGW(TAG, "writev() failed: %s", strerror(errno));
+        }
+        _close_later(user);
         return;
       }
+      rs = 0;
     }
-
-    /* keep name */
-    user->name = strdup(line);
-    telnet_printf(user->telnet, "Welcome, %s!\n", line);
-    return;
   }
 
-  _handle(user, line);
-
-  /* execute a command, need to send to the system */
-  // _message(user->name, line);
+  /* skip what was written, send or queue the rest */
+  for (i = 0; i < iovcnt; ++i) {
+    if ((size_t)rs >= iov[i].iov_len) {
+      rs -= iov[i].iov_len;
+      continue;
+    }
+    _send(user, (const char*)iov[i].iov_base + rs, iov[i].iov_len - rs);
+    rs = 0;
+  }
 }
 
 /**
- * @brief Handles the input from a user.
- *
- * This function is responsible for processing the input received from a user and performing the necessary actions based on the
- * input.
+ * @brief Sends pre-encoded text to a session with one append, see replies.
  *
- * @param user Pointer to the user structure.
- * @param buffer Pointer to the input buffer.
- * @param size Size of the input buffer.
+ * @param user The user to send to.
+ * @param text The encoded text, nothing is sent if it is empty.
  */
-static void _input(struct user_t* user, const char* buffer, size_t size)
+static void _reply(struct user_t* user, telnet_text_t text)
 {
-  unsigned int i;
-  for (i = 0; user->sock != -1 && i != size; ++i) {
-    linebuffer_push(user->linebuf, sizeof(user->linebuf), &user->linepos, (char)buffer[i], _online, user);
+  if (text.len != 0) {
+    telnet_send_encoded(user->telnet, text.data, text.len);
   }
 }
 
 /**
- * @brief Event handler function for the telnet server.
+ * @brief Sends published buffers of a session as long as its socket keeps up.
  *
- * This function is called when a telnet event occurs. It handles the event
- * and performs the necessary actions based on the event type.
+ * Buffers stay in the subscriber queue while output is queued, so slow subscribers are subject
+ * to the drop policy of the channel instead of the output queue limit.
  *
- * @param telnet The telnet server instance.
- * @param ev The telnet event.
- * @param user_data User-defined data passed to the event handler.
+ * @param user The subscriber.
  */
-static void _event_handler(telnet_t* telnet, telnet_event_t* ev, void* user_data)
+static void _pump(struct user_t* user)
 {
-  struct user_t* user = (struct user_t*)user_data;
+  struct telnet_buf* buf;
 
-  switch (ev->type) {
+  while (user->outq.head == NULL && !user->closing && (buf = telnet_subq_pop(&user->subq)) != NULL) {
+    telnet_send_text(user->telnet, buf->data, buf->len);
+    telnet_buf_unref(buf);
+  }
+}
+
+/**
+ * @brief Delivers a published buffer to every member of a channel.
+ *
+ * Walks the membership bitset word by word, so the cost follows the number of members.
+ *
+ * @param ch The channel.
+ * @param buf Buffer from the send queue, released once all subscribers are done with it.
+ */
+static void _publish(struct channel* ch, struct telnet_buf* buf)
+{
+  struct user_t* user;
+  uint32_t bits;
+  int w;
+
+  buf->refs = 1;
+  for (w = 0; ch->count > 0 && w != member_words; ++w) {
+    for (bits = ch->members[w]; bits != 0; bits &= bits - 1) {
+      user = _slot(w * 32 + __builtin_ctz(bits));
+      if (user->closing) {
+        continue;
+      }
+
+      if (!telnet_subq_push(&user->subq, buf)) {
+        if (ch->policy == TELNET_DROP_NEWEST) {
+          continue;
+        }
+        if (ch->policy == TELNET_DROP_CLOSE) {
+          ESP_LOGW(TAG, "Subscriber too slow");
+          _close_later(user);
+          continue;
+        }
+        telnet_buf_unref(telnet_subq_pop(&user->subq));
+        telnet_subq_push(&user->subq, buf);
+      }
+      _pump(user);
+    }
+  }
+  telnet_buf_unref(buf);
+}
+
+/**
+ * @brief Removes a session from all channels and drops its pending buffers.
+ *
+ * @param user The user to remove.
+ */
+static void _leave_all(struct user_t* user)
+{
+  uint32_t index = user->id & SESSION_INDEX_MASK;
+  int i;
+
+  for (i = 0; i != nchannels; ++i) {
+    if (channels[i].count > 0 && telnet_bitset_test(channels[i].members, index)) {
+      telnet_bitset_clear(channels[i].members, index);
+      channels[i].count--;
+    }
+  }
+  telnet_subq_destroy(&user->subq);
+}
+
+/**
+ * @brief Releases the memory of a command, in static mode the slot becomes free again.
+ */
+static void _job_free(struct telnet_cmd* job)
+{
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  atomic_store(&job->refs, 0);
+#else
+  free(job);
+#endif
+}
+
+/**
+ * @brief Drops one reference of a command and frees it with the last one.
+ */
+static void _job_release(struct telnet_cmd* job)
+{
+  if (atomic_fetch_sub(&job->refs, 1) == 1) {
+    _job_free(job);
+  }
+}
+
+/**
+ * @brief Asks the asynchronous command of a session to stop, see telnet_cmd_cancelled().
+ *
+ * @param user The user whose command to cancel.
+ */
+static void _cancel(struct user_t* user)
+{
+  if (user->job != NULL) {
+    atomic_store(&user->job->cancelled, true);
+    _job_release(user->job);
+    user->job = NULL;
+  }
+  if (user->stream != NULL) {
+    if (user->stream->release != NULL) {
+      user->stream->release(user->stream->state);
+    }
+#if !CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+    free(user->stream);
+#endif
+    user->stream = NULL;
+  }
+}
+
+/**
+ * @brief Pulls chunks from the streaming command of a session while its output queue is below
+ * the low-water mark.
+ *
+ * Pulls at most `read_budget` bytes per call; POLLOUT stays requested while the stream lasts, so
+ * the loop comes back for more as soon as the socket is writable.
+ *
+ * @param user The user whose command produces output.
+ */
+static void _pull(struct user_t* user)
+{
+  static char chunk[STREAM_CHUNK];
+  size_t budget = config.read_budget > 0 ? (size_t)config.read_budget : sizeof(chunk);
+  size_t n;
+
+  while (user->stream != NULL && !user->closing && user->outq.bytes < (size_t)config.output_low_water && budget > 0) {
+    if ((n = user->stream->next(user->stream->state, chunk, sizeof(chunk))) == 0) {
+      _cancel(user);
+      break;
+    }
+    telnet_send_text(user->telnet, chunk, n);
+    budget -= n < budget ? n : budget;
+  }
+}
+
+/**
+ * @brief Closes a session and releases its resources.
+ *
+ * Must not be called from within the session's own telnet event handler, see `closing`.
+ *
+ * @param user The user to disconnect.
+ */
+static void _disconnect(struct user_t* user)
+{
+  if (user->cold->name != 0 && config.on_session != NULL) {
+    config.on_session(user->id, TELNET_SESSION_CLOSED, user->cold->name, config.session_arg);
+  }
+  if (config.handler != NULL) {
+    config.handler->close(user->cold->handler_ctx);
+  }
+  telnet_timer_cancel(&wheel, &user->timer);
+  _cancel(user);
+  _leave_all(user);
+  _pfd_remove(user);
+  tp->close(tp->ctx, user->sock);
+  user->sock = -1;
+  user->closing = false;
+  telnet_outq_clear(&user->outq);
+#if !CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  free(user->cold);
+#endif
+  user->cold = NULL;
+  telnet_free(user->telnet);
+  user->telnet = NULL;
+  user->next = free_users;
+  free_users = user;
+}
+
+/**
+ * @brief Returns non-zero if deadline `a` is before deadline `b`.
+ */
+static inline bool _before(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+
+/**
+ * @brief Sends IAC DO TIMING-MARK, noting the time if no measurement is outstanding.
+ *
+ * Replies arrive in order, so the first one answers the oldest request; see _rtt_sample().
+ *
+ * @param user The user to measure.
+ */
+static void _measure_rtt(struct user_t* user)
+{
+  if (!user->cold->rtt_pending) {
+    user->cold->rtt_sent = tp->now(tp->ctx);
+    user->cold->rtt_pending = true;
+  }
+  telnet_timing_mark(user->telnet);
+}
+
+/**
+ * @brief Takes the answer to a TIMING-MARK request as a round trip sample.
+ *
+ * Smooths like TCP (RFC 6298) in fixed point: `srtt8` is eight times the smoothed round trip time,
+ * `rttvar4` four times its mean deviation.
+ *
+ * @param user The user that answered.
+ */
+static void _rtt_sample(struct user_t* user)
+{
+  struct user_cold* cold = user->cold;
+  int32_t err;
+
+  if (!cold->rtt_pending) {
+    return;
+  }
+  cold->rtt_pending = false;
+  cold->rtt_last = tp->now(tp->ctx) - cold->rtt_sent;
+  if (cold->rtt_samples++ == 0) {
+    cold->srtt8 = cold->rtt_last << 3;
+    cold->rttvar4 = cold->rtt_last << 1;
+  }
+  else {
+    err = (int32_t)cold->rtt_last - (int32_t)(cold->srtt8 >> 3);
+    cold->srtt8 += err;
+    if (err < 0) {
+      err = -err;
+    }
+    cold->rttvar4 += err - (int32_t)(cold->rttvar4 >> 2);
+  }
+}
+
+/**
+ * @brief Schedules the session timer at the earliest of its login, idle, keepalive and round trip deadlines.
+ *
+ * @param user The user to schedule the timer for.
+ */
+static void _schedule(struct user_t* user)
+{
+  uint32_t deadline = 0;
+  bool armed = false;
+
+  if (user->cold->name == 0 && config.login_timeout_ms > 0) {
+    deadline = user->cold->connected_at + config.login_timeout_ms;
+    armed = true;
+  }
+
+  if (config.idle_timeout_ms > 0) {
+    uint32_t idle = user->last_rx + config.idle_timeout_ms;
+    if (!armed || _before(idle, deadline)) {
+      deadline = idle;
+      armed = true;
+    }
+  }
+
+  if ((config.keepalive == TELNET_KEEPALIVE_NOP || config.keepalive == TELNET_KEEPALIVE_TIMING_MARK) &&
+      config.keepalive_interval_ms > 0) {
+    uint32_t probe = (user->probes == 0 ? user->last_rx : user->cold->probe_sent) + config.keepalive_interval_ms;
+    if (!armed || _before(probe, deadline)) {
+      deadline = probe;
+      armed = true;
+    }
+  }
+
+  /* one measurement at a time, the next interval starts once the client answered */
+  if (config.rtt_interval_ms > 0 && !user->cold->rtt_pending) {
+    uint32_t rtt = user->cold->rtt_sent + config.rtt_interval_ms;
+    if (!armed || _before(rtt, deadline)) {
+      deadline = rtt;
+      armed = true;
+    }
+  }
+
+  if (armed) {
+    telnet_timer_schedule(&wheel, &user->timer, deadline);
+  }
+  else {
+    telnet_timer_cancel(&wheel, &user->timer);
+  }
+}
+
+/**
+ * @brief Handles an expired session timer.
+ *
+ * Disconnects sessions that did not log in or stayed idle for too long, sends keepalive probes
+ * to quiet sessions and reclaims the slot once TIMING-MARK probes stay unanswered. Starts the
+ * periodic round trip measurement.
+ *
+ * @param timer The expired timer, embedded in a `struct user_t`.
+ * @param ud Unused.
+ */
+static void _timer_expired(struct telnet_timer* timer, void* ud)
+{
+  struct user_t* user = (struct user_t*)((char*)timer - offsetof(struct user_t, timer));
+  uint32_t now = tp->now(tp->ctx);
+  uint32_t quiet = now - user->last_rx;
+  uint32_t since_probe = user->probes == 0 ? quiet : now - user->cold->probe_sent;
+
+  (void)ud;
+
+  if (user->sock == -1) {
+    return;
+  }
+
+  if (user->closing) {
+    _disconnect(user);
+    return;
+  }
+
+  if (user->cold->name == 0 && config.login_timeout_ms > 0 && now - user->cold->connected_at >= (uint32_t)config.login_timeout_ms) {
+    ESP_LOGW(TAG, "Login timeout");
+    _reply(user, replies[REPLY_LOGIN_TIMEOUT]);
+    _disconnect(user);
+    return;
+  }
+
+  if (config.idle_timeout_ms > 0 && quiet >= (uint32_t)config.idle_timeout_ms) {
+    ESP_LOGW(TAG, "Idle timeout");
+    _reply(user, replies[REPLY_IDLE_TIMEOUT]);
+    _disconnect(user);
+    return;
+  }
+
+  /* each probe waits an interval after the previous one */
+  if (config.keepalive_interval_ms > 0 && since_probe >= (uint32_t)config.keepalive_interval_ms) {
+    if (config.keepalive == TELNET_KEEPALIVE_TIMING_MARK) {
+      /* every reply counts as input and resets `probes` */
+      if (user->probes >= config.keepalive_count) {
+        ESP_LOGW(TAG, "Keepalive timeout");
+        _disconnect(user);
+        return;
+      }
+      _measure_rtt(user);
+      user->probes++;
+      user->cold->probe_sent = now;
+    }
+    else if (config.keepalive == TELNET_KEEPALIVE_NOP) {
+      /* no reply expected, a dead peer makes the TCP stack fail the connection; nothing to count */
+      telnet_iac(user->telnet, TELNET_NOP);
+      user->probes = 1;
+      user->cold->probe_sent = now;
+    }
+  }
+
+  if (config.rtt_interval_ms > 0 && !user->cold->rtt_pending && now - user->cold->rtt_sent >= (uint32_t)config.rtt_interval_ms) {
+    _measure_rtt(user);
+  }
+
+  _schedule(user);
+}
+
+/**
+ * Handles the input line from a user.
+ *
+ * @param user The user object.
+ * @param line The input line from the user.
+ */
+static void _handle(struct user_t* user, const char* line)
+{
+  const telnet_command_t* command;
+  struct telnet_cmd* job;
+  telnet_channel_id_t ch;
+  size_t len;
+
+  /* channel membership */
+  if (strncmp(line, "/join ", 6) == 0 || strncmp(line, "/leave ", 7) == 0) {
+    bool join = line[1] == 'j';
+    const char* name = line + (join ? 6 : 7);
+
+    for (ch = 0; ch != nchannels && strcmp(channels[ch].name, name) != 0; ++ch) {
+    }
+    if (ch == nchannels) {
+      _reply(user, replies[REPLY_NO_CHANNEL]);
+    }
+    else if ((join ? telnet_server_subscribe(user->id, ch) : telnet_server_unsubscribe(user->id, ch)) != ESP_OK) {
+      _reply(user, replies[REPLY_NO_MEMORY]);
+    }
+    else {
+      telnet_printf(user->telnet, join ? "Joined %s.\n" : "Left %s.\n", name);
+    }
+    return;
+  }
+
+  if (config.commands == NULL) {
+    return;
+  }
+
+  /* one asynchronous or streaming command per session at a time */
+  if (user->stream != NULL) {
+    _reply(user, replies[REPLY_STILL_RUNNING]);
+    return;
+  }
+  if (user->job != NULL) {
+    if (!atomic_load(&user->job->done)) {
+      _reply(user, replies[REPLY_STILL_RUNNING]);
+      return;
+    }
+    _job_release(user->job);
+    user->job = NULL;
+  }
+
+  len = strcspn(line, " ");
+  for (command = config.commands; command->name != NULL; ++command) {
+    if (strlen(command->name) == len && strncmp(command->name, line, len) == 0) {
+      break;
+    }
+  }
+  if (command->name == NULL) {
+    _reply(user, replies[REPLY_UNKNOWN_COMMAND]);
+    return;
+  }
+
+  line += len + (line[len] == ' ');
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  /* a worker may still hold the command of an earlier session in this slot */
+  job = (struct telnet_cmd*)static_jobs[user->id & SESSION_INDEX_MASK];
+  if (atomic_load(&job->refs) != 0) {
+    _reply(user, replies[REPLY_BUSY]);
+    return;
+  }
+#else
+  if ((job = (struct telnet_cmd*)malloc(sizeof(struct telnet_cmd) + strlen(line) + 1)) == NULL) {
+    _reply(user, replies[REPLY_NO_MEMORY]);
+    return;
+  }
+#endif
+  job->command = command;
+  job->session = user->id;
+  job->user = NULL;
+  atomic_init(&job->cancelled, false);
+  atomic_init(&job->done, false);
+  atomic_init(&job->refs, 2);
+  strcpy(job->args, line);
+
+  /* without workers asynchronous commands run on the server task as well */
+  if (!command->async || jobs == NULL) {
+    job->user = user;
+    command->fn(job, job->args, command->arg);
+    _job_free(job);
+    return;
+  }
+
+  if (xQueueSend(jobs, &job, 0) != pdTRUE) {
+    _reply(user, replies[REPLY_BUSY]);
+    _job_free(job);
+    return;
+  }
+  user->job = job;
+}
+
+/**
+ * @brief Names a session, which makes it receive broadcasts and reports it to `on_session`.
+ *
+ * @param user The user to name.
+ * @param name Requested name.
+ * @return `ESP_OK`, `ESP_ERR_INVALID_ARG` for an invalid name or `ESP_ERR_INVALID_STATE` if the
+ *         name is in use or the session already has one.
+ */
+static esp_err_t _login(struct user_t* user, const char* name)
+{
+  const char* p;
+  nfds_t k;
+
+  /* must not be empty, must be at most 32 chars */
+  if (strlen(name) == 0 || strlen(name) > 32) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  /* no control characters, names are sent without NVT translation */
+  for (p = name; *p != 0; ++p) {
+    if ((unsigned char)*p < 0x20 || *p == 0x7f) {
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+
+  /* must not already exist */
+  for (k = PFD_SESSIONS; k < npfd; ++k) {
+    if (pfd_user[k]->cold->name != 0 && strcmp(pfd_user[k]->cold->name, name) == 0) {
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+
+  /* keep name */
+  strcpy(user->cold->namebuf, name);
+  user->cold->name = user->cold->namebuf;
+  if (config.on_session != NULL) {
+    config.on_session(user->id, TELNET_SESSION_LOGIN, name, config.session_arg);
+  }
+  return ESP_OK;
+}
+
+/* process input line */
+/**
+ * @brief Sets the user online status.
+ *
+ * This function is called when the user goes online.
+ * It updates the online status of the user and performs any necessary actions.
+ *
+ * @param line The command line received.
+ * @param overflow The overflow size.
+ * @param ud User data.
+ */
+static void _online(const char* line, size_t overflow, void* ud)
+{
+  struct user_t* user = (struct user_t*)ud;
+
+  (void)overflow;
+
+  /* an application handler takes over all input */
+  if (config.handler != NULL) {
+    config.handler->line(user->cold->handler_ctx, line);
+    return;
+  }
+
+  /* if the user has no name, this is his "login" */
+  if (user->cold->name == 0) {
+    switch (_login(user, line)) {
+    case ESP_OK: {
+      /* _login() rejects control characters, the greeting goes out without formatting or NVT translation */
+      struct iovec iov[3] = {{(void*)"Welcome, ", 9}, {(void*)line, strlen(line)}, {(void*)"!\r\n", 3}};
+      telnet_sendv(user->telnet, iov, 3);
+      _reply(user, config.motd);
+      break;
+    }
+    case ESP_ERR_INVALID_STATE: _reply(user, replies[REPLY_NAME_IN_USE]); break;
+    default: _reply(user, replies[REPLY_INVALID_NAME]); break;
+    }
+    return;
+  }
+
+  _handle(user, line);
+
+  /* execute a command, need to send to the system */
+  // _message(user->cold->name, line);
+}
+
+/**
+ * @brief Edits the line buffer of a character mode session and echoes the input.
+ *
+ * The echo of everything received at once is sent together, before a completed line is handled
+ * so replies follow it. Printable keystrokes go straight into the line buffer; CR or LF ends the
+ * line (a LF or NUL after CR is dropped) and backspace or DEL erases the last character.
+ *
+ * @param user The user that typed.
+ * @param buffer The received input.
+ * @param size The size of the input.
+ */
+static void _input_echo(struct user_t* user, const char* buffer, size_t size)
+{
+  struct user_cold* cold = user->cold;
+  char echo[ECHO_CHUNK];
+  size_t n = 0;
+  size_t i;
+  unsigned char ch;
+
+  for (i = 0; user->sock != -1 && i != size; ++i) {
+    ch = (unsigned char)buffer[i];
+
+    /* the common keystroke */
+    if (ch >= 0x20 && ch != 0x7f && cold->linepos < (int)sizeof(cold->linebuf) - 1) {
+      cold->linebuf[cold->linepos++] = (char)ch;
+      cold->eol = false;
+      echo[n++] = (char)ch;
+    }
+    else if (ch == '\r' || (ch == '\n' && !cold->eol)) {
+      memcpy(echo + n, "\r\n", 2);
+      telnet_send(user->telnet, echo, n + 2);
+      n = 0;
+      cold->linebuf[cold->linepos] = 0;
+      cold->linepos = 0;
+      cold->eol = ch == '\r';
+      _online(cold->linebuf, 0, user);
+      continue;
+    }
+    else if ((ch == 0x08 || ch == 0x7f) && cold->linepos > 0) {
+      cold->linepos--;
+      cold->eol = false;
+      memcpy(echo + n, "\b \b", 3);
+      n += 3;
+    }
+    else {
+      /* LF or NUL after CR, other control characters, or a full line */
+      cold->eol = false;
+    }
+
+    /* keep room for the longest echo */
+    if (n > sizeof(echo) - 3) {
+      telnet_send(user->telnet, echo, n);
+      n = 0;
+    }
+  }
+  if (n != 0 && user->sock != -1) {
+    telnet_send(user->telnet, echo, n);
+  }
+}
+
+/**
+ * @brief Follows the LINEMODE mode a client switched to.
+ *
+ * A client that edits lines also echoes them, so the server gives up ECHO and reads whole lines.
+ * Once the client stops editing the server offers ECHO again and goes back to character mode.
+ *
+ * @param user The user whose client changed mode.
+ * @param mode The acknowledged mode mask, 0 if LINEMODE was refused or turned off.
+ */
+static void _linemode(struct user_t* user, unsigned char mode)
+{
+  bool edit = (mode & TELNET_LINEMODE_EDIT) != 0;
+
+  if (edit == user->cold->linemode) {
+    return;
+  }
+  user->cold->linemode = edit;
+  if (edit) {
+    user->echo = false;
+    telnet_negotiate(user->telnet, TELNET_WONT, TELNET_TELOPT_ECHO);
+  }
+  else {
+    telnet_negotiate(user->telnet, TELNET_WILL, TELNET_TELOPT_ECHO);
+  }
+}
+
+/**
+ * @brief Handles the input from a user.
+ *
+ * This function is responsible for processing the input received from a user and performing the necessary actions based on the
+ * input.
+ *
+ * @param user Pointer to the user structure.
+ * @param buffer Pointer to the input buffer.
+ * @param size Size of the input buffer.
+ */
+static void _input(struct user_t* user, const char* buffer, size_t size)
+{
+  unsigned int i;
+
+  if (user->echo) {
+    _input_echo(user, buffer, size);
+    return;
+  }
+  for (i = 0; user->sock != -1 && i != size; ++i) {
+    linebuffer_push(user->cold->linebuf, sizeof(user->cold->linebuf), &user->cold->linepos, (char)buffer[i], _online, user);
+  }
+}
+
+/**
+ * @brief Event handler function for the telnet server.
+ *
+ * This function is called when a telnet event occurs. It handles the event
+ * and performs the necessary actions based on the event type.
+ *
+ * @param telnet The telnet server instance.
+ * @param ev The telnet event.
+ * @param user_data User-defined data passed to the event handler.
+ */
+static void _event_handler(telnet_t* telnet, telnet_event_t* ev, void* user_data)
+{
+  struct user_t* user = (struct user_t*)user_data;
+  char msg[96];
+
+  switch (ev->type) {
   /* data received */
   case TELNET_EV_DATA:
     _input(user, ev->data.buffer, ev->data.size);
-    // telnet_negotiate(telnet, TELNET_WONT, TELNET_TELOPT_ECHO);
-    // telnet_negotiate(telnet, TELNET_WILL, TELNET_TELOPT_ECHO);
     break;
   /* data must be sent */
-  case TELNET_EV_SEND: _send(user->sock, ev->data.buffer, ev->data.size); break;
-  /* enable compress2 if accepted by client */
+  case TELNET_EV_SEND: _send(user, ev->data.buffer, ev->data.size); break;
+  case TELNET_EV_SENDV: _sendv(user, ev->sendv.iov, ev->sendv.iovcnt); break;
+  /* Ctrl-C cancels a running command, LINEMODE clients may trap it as ABORT too */
+  case TELNET_EV_IAC:
+    if (ev->iac.cmd == TELNET_IP || ev->iac.cmd == TELNET_BREAK || ev->iac.cmd == TELNET_ABORT) {
+      _cancel(user);
+    }
+    break;
+  /* answer to a TIMING-MARK request, either way; ask a LINEMODE client to edit lines */
+  case TELNET_EV_WILL:
+    if (ev->neg.telopt == TELNET_TELOPT_TM)
+      _rtt_sample(user);
+    else if (ev->neg.telopt == TELNET_TELOPT_LINEMODE)
+      telnet_linemode_mode(telnet, TELNET_LINEMODE_EDIT | TELNET_LINEMODE_TRAPSIG);
+    break;
+  case TELNET_EV_WONT:
+    if (ev->neg.telopt == TELNET_TELOPT_TM)
+      _rtt_sample(user);
+    else if (ev->neg.telopt == TELNET_TELOPT_LINEMODE)
+      _linemode(user, 0);
+    break;
+  /* the client confirmed the mode it switched to, proposals of its own are not answered */
+  case TELNET_EV_LINEMODE:
+    if (ev->linemode.cmd == TELNET_LINEMODE_MODE && (ev->linemode.mode & TELNET_LINEMODE_MODE_ACK))
+      _linemode(user, ev->linemode.mode);
+    break;
+  /* enable compress2 if accepted by client, echo once the client stopped echoing itself */
   case TELNET_EV_DO:
     if (ev->neg.telopt == TELNET_TELOPT_COMPRESS2)
       telnet_begin_compress2(telnet);
+    else if (ev->neg.telopt == TELNET_TELOPT_ECHO)
+      user->echo = true;
+    break;
+  case TELNET_EV_DONT:
+    if (ev->neg.telopt == TELNET_TELOPT_ECHO)
+      user->echo = false;
     break;
   /* error */
   case TELNET_EV_ERROR:
-    close(user->sock);
-    user->sock = -1;
-    if (user->name != 0) {
-      _message(user->name, "** HAS HAD AN ERROR **");
-      free(user->name);
-      user->name = 0;
-    }
-    telnet_free(user->telnet);
+    telnet_format_error(ev, msg, sizeof(msg));
+    ESP_LOGW(TAG, "Telnet error: %s", msg);
+    _close_later(user);
+    if (user->cold->name != 0) {
+      _message(user->cold->name, "** HAS HAD AN ERROR **");
+    }
     break;
   default:
     /* ignore */
@@ -269,154 +1457,964 @@ static void _event_handler(telnet_t* telnet, telnet_event_t* ev, void* user_data
 }
 
 /**
- * @brief Task function for handling Telnet connections.
+ * @brief Enables TCP keepalive on a client socket using the configured interval and probe count.
+ *
+ * @param sock The client socket.
+ */
+static void _set_tcp_keepalive(int sock)
+{
+  int val = 1;
+
+  tp->setsockopt(tp->ctx, sock, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+  val = config.keepalive_interval_ms / 1000 > 0 ? config.keepalive_interval_ms / 1000 : 1;
+  tp->setsockopt(tp->ctx, sock, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val));
+  tp->setsockopt(tp->ctx, sock, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
+  val = config.keepalive_count;
+  tp->setsockopt(tp->ctx, sock, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val));
+#endif
+}
+
+/**
+ * @brief Disables Nagle's algorithm on a client socket, so echoed keystrokes are sent at once.
+ *
+ * @param sock The client socket.
+ */
+static void _set_tcp_nodelay(int sock)
+{
+#if defined(TCP_NODELAY)
+  int val = 1;
+
+  tp->setsockopt(tp->ctx, sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+#endif
+}
+
+/**
+ * @brief Offers every option of the telopt table the server is willing to use.
+ *
+ * Sends WILL for options the server agrees to perform and DO for options it wants the client to
+ * perform, so no round trip waits for the client to ask. COMPRESS2 is only offered with WILL, and
+ * only if compression is available. Character mode adds WILL ECHO and WILL SGA, and DO LINEMODE
+ * if enabled.
+ *
+ * @param user The new session.
+ */
+static void _offer(struct user_t* user)
+{
+  const telnet_telopt_t* opt;
+
+  for (opt = config.telnet_opts; opt != NULL && opt->telopt != -1; ++opt) {
+    if (opt->telopt == TELNET_TELOPT_COMPRESS2) {
+      if (compress2) {
+        telnet_negotiate(user->telnet, TELNET_WILL, TELNET_TELOPT_COMPRESS2);
+      }
+      continue;
+    }
+    if (opt->us == TELNET_WILL) {
+      telnet_negotiate(user->telnet, TELNET_WILL, (unsigned char)opt->telopt);
+    }
+    if (opt->him == TELNET_DO) {
+      telnet_negotiate(user->telnet, TELNET_DO, (unsigned char)opt->telopt);
+    }
+  }
+
+  /* the client switches to character at a time once it may leave echo and go-ahead to us */
+  if (config.character_mode) {
+    telnet_negotiate(user->telnet, TELNET_WILL, TELNET_TELOPT_ECHO);
+    telnet_negotiate(user->telnet, TELNET_WILL, TELNET_TELOPT_SGA);
+    if (config.linemode) {
+      telnet_negotiate(user->telnet, TELNET_DO, TELNET_TELOPT_LINEMODE);
+    }
+  }
+}
+
+/**
+ * @brief Sets up a session for an accepted client socket.
+ *
+ * Rejects the client with a pre-encoded message if all `max_connections` sessions are taken. The rejection is sent
+ * without blocking: if it does not fit into the socket buffer it is simply dropped.
+ *
+ * @param client_sock The accepted socket.
+ */
+static void _open_session(int client_sock)
+{
+  struct user_t* user;
+
+  if (free_users == NULL && !_grow()) {
+    ESP_LOGV(TAG, "  rejected (too many users)");
+    tp->send(tp->ctx, client_sock, replies[REPLY_TOO_MANY_USERS].data, replies[REPLY_TOO_MANY_USERS].len, MSG_DONTWAIT);
+    tp->close(tp->ctx, client_sock);
+    return;
+  }
+
+  /* reads are drained until EAGAIN, writes are queued when the socket is full */
+  if (tp->fcntl(tp->ctx, client_sock, F_SETFL, tp->fcntl(tp->ctx, client_sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
+    ESP_LOGE(TAG, "fcntl() failed: %s", strerror(errno));
+    tp->close(tp->ctx, client_sock);
+    return;
+  }
+
+  /* let the TCP stack detect dead peers */
+  if (config.keepalive == TELNET_KEEPALIVE_TCP) {
+    _set_tcp_keepalive(client_sock);
+  }
+
+  /* every echo is a segment of its own, waiting for the previous ACK would add a round trip */
+  if (config.character_mode) {
+    _set_tcp_nodelay(client_sock);
+  }
+
+  /* line buffer and login state are only allocated for live sessions */
+  user = free_users;
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  user->cold = &static_cold[user->id & SESSION_INDEX_MASK];
+#else
+  if ((user->cold = (struct user_cold*)malloc(sizeof(struct user_cold))) == NULL) {
+    ESP_LOGE(TAG, "Out of memory for session");
+    tp->close(tp->ctx, client_sock);
+    return;
+  }
+#endif
+  free_users = user->next;
+
+  /* new generation, ids of earlier sessions in this slot no longer match */
+  user->id += 1u << SESSION_INDEX_BITS;
+  if ((user->id >> SESSION_INDEX_BITS) == 0) {
+    user->id += 1u << SESSION_INDEX_BITS;
+  }
+
+  /* init, welcome; in the poll set first so queued output can request POLLOUT */
+  user->next = NULL;
+  user->sock = client_sock;
+  user->cold->name = 0;
+  user->cold->linepos = 0;
+  user->cold->eol = false;
+  user->cold->linemode = false;
+  user->echo = false;
+  user->cold->connected_at = user->last_rx = tp->now(tp->ctx);
+  user->cold->rtt_sent = user->cold->connected_at;
+  user->cold->rtt_pending = false;
+  user->cold->srtt8 = user->cold->rttvar4 = user->cold->rtt_last = user->cold->rtt_samples = 0;
+  user->probes = 0;
+  _pfd_add(user);
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  user->telnet = telnet_init_static(&static_telnet[user->id & SESSION_INDEX_MASK], config.telnet_opts, _event_handler, TRACKER_FLAGS, user);
+#else
+  user->telnet = telnet_init(config.telnet_opts, _event_handler, TRACKER_FLAGS, user);
+#endif
+  /* warnings are never read, skip them before they are built */
+  telnet_mask_warnings(user->telnet, TELNET_WARN_ALL);
+
+  /* all offers and the first prompt leave in one segment, replies are handled as they arrive */
+  _cork(user);
+  _offer(user);
+  if (config.rtt_interval_ms > 0) {
+    _measure_rtt(user);
+  }
+  if (config.handler != NULL) {
+    user->cold->handler_ctx = config.handler->open(user->id, config.handler->arg);
+  }
+  else {
+    _reply(user, replies[REPLY_ENTER_NAME]);
+  }
+  _uncork();
+  _schedule(user);
+}
+
+/**
+ * @brief Feeds everything a ready session has received into its telnet tracker.
+ *
+ * Reads until the socket reports EAGAIN or `read_budget` bytes were consumed, so a bulk paste is
+ * processed in one wakeup while a flooding client cannot starve the others: whatever is left keeps
+ * the socket readable for the next iteration. Disconnects the session on EOF or a socket error.
+ *
+ * @param user The user to read from.
+ */
+static void _read(struct user_t* user)
+{
+  static char buffer[512];
+  size_t budget = config.read_budget > 0 ? (size_t)config.read_budget : sizeof(buffer);
+  ssize_t rs;
+
+  while (budget > 0 && user->sock != -1 && !user->closing) {
+    if ((rs = tp->recv(tp->ctx, user->sock, buffer, budget < sizeof(buffer) ? budget : sizeof(buffer), 0)) > 0) {
+      user->last_rx = tp->now(tp->ctx);
+      user->probes = 0;
+      telnet_recv_inplace(user->telnet, buffer, rs);
+      budget -= rs;
+    }
+    else if (rs == 0) {
+      ESP_LOGW(TAG, "Closed connection");
+      _disconnect(user);
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    }
+    else if (errno != EINTR) {
+      ESP_LOGW(TAG, "recv(client) failed: %s", strerror(errno));
+      _disconnect(user);
+    }
+  }
+}
+
+/**
+ * @brief Sends the buffers other tasks queued with telnet_server_send() and telnet_server_broadcast().
+ *
+ * Takes at most one queue length per call, so producers cannot keep the loop from polling.
+ */
+static void _drain_sendq(void)
+{
+  struct telnet_buf* buf;
+  struct user_t* user;
+  uint32_t session;
+  uint32_t n = sendq.mask + 1;
+  nfds_t k;
+
+  while (n-- > 0 && (buf = telnet_mpsc_pop(&sendq, &session)) != NULL) {
+    /* ids without a generation address channels, see telnet_server_publish() */
+    if (session != TELNET_SESSION_INVALID && (session >> SESSION_INDEX_BITS) == 0) {
+      _publish(&channels[session - 1], buf);
+      continue;
+    }
+
+    if (session == TELNET_SESSION_INVALID) {
+      for (k = PFD_SESSIONS; k < npfd; ++k) {
+        if (pfd_user[k]->cold->name != 0) {
+          telnet_send_text(pfd_user[k]->telnet, buf->data, buf->len);
+        }
+      }
+    }
+    else if ((user = _session(session)) != NULL) {
+      telnet_send_text(user->telnet, buf->data, buf->len);
+    }
+    telnet_buf_free(buf);
+  }
+}
+
+/**
+ * @brief Accepts connections until the (non-blocking) listening socket reports EAGAIN.
+ *
+ * Draining the whole accept queue per wakeup absorbs reconnect storms in one loop iteration.
+ */
+static void _accept_all(void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int client_sock;
+
+  while (true) {
+    addrlen = sizeof(addr);
+    if ((client_sock = tp->accept(tp->ctx, listen_sock, (struct sockaddr*)&addr, &addrlen)) == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        /* e.g. out of descriptors; retried on the next wakeup */
+        ESP_LOGE(TAG, "accept() failed: %s", strerror(errno));
+      }
+      return;
+    }
+
+    ESP_LOGV(TAG, "Connection received");
+    _open_session(client_sock);
+  }
+}
+
+/**
+ * @brief Worker task running asynchronous commands until it receives a NULL command.
+ */
+static void _worker(void* arg)
+{
+  struct telnet_cmd* job;
+
+  (void)arg;
+
+  while (xQueueReceive(jobs, &job, portMAX_DELAY) == pdTRUE && job != NULL) {
+    if (!atomic_load(&job->cancelled)) {
+      job->command->fn(job, job->args, job->command->arg);
+    }
+    atomic_store(&job->done, true);
+    _job_release(job);
+  }
+
+  xSemaphoreGive(workers_done);
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Creates the worker pool if the command table has asynchronous commands.
+ */
+static void _start_workers(void)
+{
+  const telnet_command_t* command;
+  UBaseType_t priority = config.task_priority > tskIDLE_PRIORITY + 1 ? config.task_priority - 1 : tskIDLE_PRIORITY + 1;
+
+  for (command = config.commands; command != NULL && command->name != NULL && !command->async; ++command) {
+  }
+  if (command == NULL || command->name == NULL || config.workers <= 0) {
+    return;
+  }
+
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  jobs = xQueueCreateStatic(WORKER_QUEUE_LEN, sizeof(struct telnet_cmd*), static_jobs_storage, &static_jobs_queue);
+  workers_done = xSemaphoreCreateCountingStatic(config.workers, 0, &static_workers_done);
+#else
+  jobs = xQueueCreate(WORKER_QUEUE_LEN, sizeof(struct telnet_cmd*));
+  workers_done = jobs != NULL ? xSemaphoreCreateCounting(config.workers, 0) : NULL;
+#endif
+  if (jobs == NULL || workers_done == NULL) {
+    ESP_LOGW(TAG, "No worker pool, asynchronous commands run on the server task");
+    if (jobs != NULL) {
+      vQueueDelete(jobs);
+      jobs = NULL;
+    }
+    return;
+  }
+
+  /* below the server task, so commands never delay I/O */
+  for (nworkers = 0; nworkers != config.workers; ++nworkers) {
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+    if (xTaskCreateStatic(_worker, "telnet_worker", config.worker_stack_size, NULL, priority,
+                          static_worker_stacks[nworkers], &static_worker_tasks[nworkers]) == NULL) {
+#else
+    if (xTaskCreate(_worker, "telnet_worker", config.worker_stack_size, NULL, priority, NULL) != pdPASS) {
+#endif
+      ESP_LOGW(TAG, "Created only %d of %d workers", nworkers, config.workers);
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Stops the worker pool after the running commands returned.
+ */
+static void _stop_workers(void)
+{
+  struct telnet_cmd* none = NULL;
+  int i;
+
+  if (jobs == NULL) {
+    return;
+  }
+
+  for (i = 0; i != nworkers; ++i) {
+    xQueueSend(jobs, &none, portMAX_DELAY);
+  }
+  for (i = 0; i != nworkers; ++i) {
+    xSemaphoreTake(workers_done, portMAX_DELAY);
+  }
+  vQueueDelete(jobs);
+  vSemaphoreDelete(workers_done);
+  jobs = NULL;
+  workers_done = NULL;
+  nworkers = 0;
+}
+
+/**
+ * @brief Returns whether the telopt table agrees to COMPRESS2.
+ */
+static bool _offers_compress2(void)
+{
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  /* static trackers cannot compress */
+  return false;
+#else
+  const telnet_telopt_t* opt;
+
+  for (opt = config.telnet_opts; opt != NULL && opt->telopt != -1; ++opt) {
+    if (opt->telopt == TELNET_TELOPT_COMPRESS2 && opt->us == TELNET_WILL) {
+      return true;
+    }
+  }
+  return false;
+#endif
+}
+
+/**
+ * @brief Sets up the queue of buffers sent by other tasks.
  *
- * This function is responsible for handling Telnet connections. It is executed as a separate task.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int _sendq_init(void)
+{
+  int size = config.send_queue_size > 0 ? config.send_queue_size : 1;
+
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  static bool pool_ready;
+
+  /* buffers outlive the server, the pool is set up once */
+  if (!pool_ready) {
+    telnet_buf_pool_init(&static_pool, static_buffers[0], static_buffer_links, CONFIG_TELNET_SERVER_BUFFER_POOL);
+    pool_ready = true;
+  }
+  telnet_mpsc_init_static(&sendq, static_cells, size);
+  return 0;
+#else
+  return telnet_mpsc_init(&sendq, size);
+#endif
+}
+
+/**
+ * @brief Starts the Telnet server without creating a task.
  *
- * @param arg Pointer to the task argument (not used in this function).
+ * Creates the listening socket and allocates the first chunk of the session table. The caller then drives the
+ * server by calling telnet_server_poll() from a single task.
+ *
+ * @param cfg Pointer to the configuration structure.
+ * @return `ESP_OK` on success, or an error code if the listening socket could not be created.
  */
-void telnet_task(void* arg)
+esp_err_t telnet_server_start(const telnet_server_config_t* cfg)
 {
-  static char buffer[512];
   static struct sockaddr_in addr;
-  static telnet_server_config_t config;
+  int rs;
 
-  // save the configuration
-  memcpy(&config, arg, sizeof(telnet_server_config_t));
+  if (cfg == NULL || cfg->max_connections <= 0 || (uint32_t)cfg->max_connections > SESSION_INDEX_MASK) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  /* unanswered probes are counted in a byte, at least one is sent before giving up */
+  if (cfg->keepalive == TELNET_KEEPALIVE_TIMING_MARK && (cfg->keepalive_count < 1 || cfg->keepalive_count > UINT8_MAX)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  /* static storage is sized by Kconfig */
+  if (cfg->max_connections > STATIC_SESSIONS || cfg->channel_queue_len > CONFIG_TELNET_SERVER_CHANNEL_QUEUE_LEN ||
+      cfg->send_queue_size > CONFIG_TELNET_SERVER_SEND_QUEUE_SIZE || cfg->workers > CONFIG_TELNET_SERVER_WORKERS ||
+      cfg->worker_stack_size > CONFIG_TELNET_SERVER_WORKER_STACK_SIZE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+#endif
 
-  int listen_sock;
-  int client_sock;
-  int rs;
-  int i;
-  socklen_t addrlen;
-  struct pollfd pfd[config.max_connections + 1];
+  // save the configuration
+  memcpy(&config, cfg, sizeof(telnet_server_config_t));
+  tp = config.transport != NULL ? config.transport : &telnet_transport_lwip;
+  compress2 = _offers_compress2();
 
   /* initialize data structures */
-  memset(&pfd, 0, sizeof(pfd));
-  memset(users, 0, sizeof(users));
-  for (i = 0; i != config.max_connections; ++i) {
-    users[i].sock = -1;
-  }
+  telnet_wheel_init(&wheel, tp->now(tp->ctx));
 
   /* create listening socket */
-  if ((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+  if ((listen_sock = tp->socket(tp->ctx, AF_INET, SOCK_STREAM, 0)) == -1) {
     ESP_LOGE(TAG, "socket() failed: %s", strerror(errno));
-    return;
+    return ESP_FAIL;
   }
 
   /* reuse address option */
   rs = 1;
-  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&rs, sizeof(rs));
+  tp->setsockopt(tp->ctx, listen_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&rs, sizeof(rs));
 
   /* bind to listening addr/port */
   memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = INADDR_ANY;
   addr.sin_port = htons(config.port);
-  if (bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+  if (tp->bind(tp->ctx, listen_sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
     ESP_LOGE(TAG, "bind() failed: %s", strerror(errno));
-    close(listen_sock);
-    return;
+    tp->close(tp->ctx, listen_sock);
+    listen_sock = -1;
+    return ESP_FAIL;
+  }
+
+  /* never block in accept(), the loop drains the queue until EAGAIN */
+  if (tp->fcntl(tp->ctx, listen_sock, F_SETFL, tp->fcntl(tp->ctx, listen_sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
+    ESP_LOGE(TAG, "fcntl() failed: %s", strerror(errno));
+    tp->close(tp->ctx, listen_sock);
+    listen_sock = -1;
+    return ESP_FAIL;
   }
 
   /* listen for clients */
-  if (listen(listen_sock, 3) == -1) {
+  if (tp->listen(tp->ctx, listen_sock, config.backlog > 0 ? config.backlog : 1) == -1) {
     ESP_LOGE(TAG, "listen() failed: %s", strerror(errno));
-    close(listen_sock);
-    return;
+    tp->close(tp->ctx, listen_sock);
+    listen_sock = -1;
+    return ESP_FAIL;
+  }
+
+  /* first chunk of sessions, more are added as clients connect */
+  if (!_grow() || _sendq_init() == -1) {
+    ESP_LOGE(TAG, "Out of memory for sessions");
+    tp->close(tp->ctx, listen_sock);
+    listen_sock = -1;
+    _release();
+    return ESP_ERR_NO_MEM;
   }
 
+  /* listening descriptor */
+  pfd[0].fd = listen_sock;
+  pfd[0].events = POLLIN;
+  pfd[0].revents = 0;
+
+  /* wakeup descriptor, without it queued buffers wait for the next poll() timeout */
+  atomic_store(&wakeup_pending, false);
+  wakeup_fd = tp->wakeup_open != NULL ? tp->wakeup_open(tp->ctx) : -1;
+  if (wakeup_fd == -1) {
+    ESP_LOGW(TAG, "No wakeup descriptor, cross-task sends are delayed until the next poll timeout");
+  }
+  pfd[1].fd = wakeup_fd;
+  pfd[1].events = wakeup_fd != -1 ? POLLIN : 0;
+  pfd[1].revents = 0;
+  npfd = PFD_SESSIONS;
+
+  _start_workers();
+
   ESP_LOGI(TAG, "Telnet server listening on port %d", config.port);
+  return ESP_OK;
+}
 
-  /* initialize listening descriptors */
-  pfd[config.max_connections].fd = listen_sock;
-  pfd[config.max_connections].events = POLLIN;
+/**
+ * @brief Runs one iteration of the server loop.
+ *
+ * Waits up to `timeout_ms` for socket events, flushes queued output of writable clients, feeds
+ * received data of ready clients into their telnet state trackers and accepts new connections.
+ *
+ * @param timeout_ms Poll timeout in milliseconds.
+ * @return `ESP_OK` to continue, or `ESP_FAIL` on a fatal socket error.
+ */
+esp_err_t telnet_server_poll(int timeout_ms)
+{
+  struct user_t* user;
+  nfds_t k;
+  int ready;
+  int rs;
 
-  /* loop for ever */
-  while (true) {
-    /* prepare for poll */
-    for (i = 0; i != config.max_connections; ++i) {
-      if (users[i].sock != -1) {
-        pfd[i].fd = users[i].sock;
-        pfd[i].events = POLLIN;
+  if (listen_sock == -1) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  /* do not sleep past the next session timer */
+  rs = telnet_wheel_timeout(&wheel, tp->now(tp->ctx));
+  if (rs >= 0 && (timeout_ms < 0 || rs < timeout_ms)) {
+    timeout_ms = rs;
+  }
+
+  /* poll */
+  ready = tp->poll(tp->ctx, pfd, npfd, timeout_ms);
+  if (ready == -1 && errno != EINTR) {
+    ESP_LOGE(TAG, "poll() failed: %s", strerror(errno));
+    return ESP_FAIL;
+  }
+
+  /* expire session timers; disconnects move ready entries along with their revents */
+  telnet_wheel_advance(&wheel, tp->now(tp->ctx), _timer_expired, NULL);
+
+  /* output from other tasks; clear the flag first so later producers notify again */
+  if (ready > 0 && pfd[1].revents != 0) {
+    --ready;
+    atomic_store(&wakeup_pending, false);
+    tp->wakeup_drain(tp->ctx, wakeup_fd);
+  }
+  _drain_sendq();
+
+  if (ready <= 0) {
+    return ESP_OK;
+  }
+
+  /* read from ready clients; walking backwards keeps swap-removal safe */
+  for (k = npfd - 1; k >= PFD_SESSIONS && ready > 0; --k) {
+    if (pfd[k].revents == 0) {
+      continue;
+    }
+    --ready;
+
+    user = pfd_user[k];
+    if (pfd[k].revents & POLLOUT) {
+      if (telnet_outq_flush(&user->outq, _write, user) == -1) {
+        ESP_LOGW(TAG, "send() failed: %s", strerror(errno));
+        _disconnect(user);
+        continue;
       }
-      else {
-        pfd[i].fd = -1;
-        pfd[i].events = 0;
+      _pull(user);
+      if (user->outq.head == NULL) {
+        if (user->stream == NULL) {
+          pfd[k].events &= ~POLLOUT;
+        }
+        _pump(user);
       }
     }
 
-    /* poll */
-    rs = poll(pfd, config.max_connections + 1, AWAIT_TIMEOUT);
-    if (rs == -1 && errno != EINTR) {
-      ESP_LOGE(TAG, "poll() failed: %s", strerror(errno));
-      close(listen_sock);
-      return;
+    if (pfd[k].revents & (POLLIN | POLLERR | POLLHUP)) {
+      _read(user);
+      if (user->sock == -1) {
+        continue;
+      }
     }
 
-    /* new connection */
-    if (pfd[config.max_connections].revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI | POLLERR | POLLHUP)) {
-      /* acept the sock */
-      ESP_LOGW(TAG, "New connection");
-      addrlen = sizeof(addr);
-      if ((client_sock = accept(listen_sock, (struct sockaddr*)&addr, &addrlen)) == -1) {
-        ESP_LOGE(TAG, "accept() failed: %s", strerror(errno));
-        return;
-      }
+    /* reap sessions that failed while processing */
+    if (user->closing) {
+      _disconnect(user);
+    }
+  }
 
-      ESP_LOGV(TAG, "Connection received");
+  /* new connections: drain the accept queue */
+  if (pfd[0].revents & (POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI | POLLERR | POLLHUP)) {
+    _accept_all();
+  }
 
-      /* find a free user */
-      for (i = 0; i != config.max_connections; ++i) {
-        if (users[i].sock == -1) {
-          break;
-        }
-      }
+  return ESP_OK;
+}
 
-      if (i == config.max_connections) {
-        ESP_LOGV(TAG, "  rejected (too many users)");
-        _send(client_sock, "Too many users.\n", 16);
-        close(client_sock);
-      }
+/**
+ * @brief Stops the Telnet server started with telnet_server_start().
+ *
+ * Closes all client connections and the listening socket and releases the session table.
+ */
+void telnet_server_stop(void)
+{
+  /* cancels running commands, workers finish them before the send queue goes away */
+  while (npfd > PFD_SESSIONS) {
+    _disconnect(pfd_user[npfd - 1]);
+  }
+  _stop_workers();
+
+  if (listen_sock != -1) {
+    tp->close(tp->ctx, listen_sock);
+    listen_sock = -1;
+  }
+  _release();
+}
+
+/**
+ * @brief Queues a buffer from telnet_server_alloc() for the server task, see telnet_server_send().
+ *
+ * @param abort Stops waiting for room once set, may be NULL.
+ */
+static esp_err_t _enqueue(telnet_session_id_t session, char* buffer, size_t size, int timeout_ms, atomic_bool* abort)
+{
+  struct telnet_buf* buf;
+  TickType_t start = xTaskGetTickCount();
+
+  if (buffer == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
 
-      /* init, welcome */
-      users[i].sock = client_sock;
-      users[i].telnet = telnet_init(config.telnet_opts, _event_handler, 0, &users[i]);
-      telnet_negotiate(users[i].telnet, TELNET_WILL, TELNET_TELOPT_COMPRESS2);
-      telnet_printf(users[i].telnet, "Enter name: ");
+  buf = (struct telnet_buf*)(buffer - offsetof(struct telnet_buf, data));
+  if (size > buf->size) {
+    telnet_buf_free(buf);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (sendq.cells == NULL) {
+    telnet_buf_free(buf);
+    return ESP_ERR_INVALID_STATE;
+  }
 
-      // telnet_negotiate(users[i].telnet, TELNET_WILL, TELNET_TELOPT_ECHO);
+  buf->off = 0;
+  buf->len = size;
+  while (!telnet_mpsc_push(&sendq, session, buf)) {
+    if (timeout_ms == 0 || (timeout_ms > 0 && (xTaskGetTickCount() - start) * portTICK_PERIOD_MS >= (TickType_t)timeout_ms)) {
+      telnet_buf_free(buf);
+      return ESP_ERR_TIMEOUT;
     }
+    if (abort != NULL && atomic_load(abort)) {
+      telnet_buf_free(buf);
+      return ESP_FAIL;
+    }
+    /* the queue is lock-free, so wait for the server task to make room */
+    vTaskDelay(1);
+  }
 
-    /* read from client */
-    for (i = 0; i != config.max_connections; ++i) {
-      /* skip users that aren't actually connected */
-      if (users[i].sock == -1) {
-        continue;
-      }
+  /* only the first producer after the loop drained the descriptor has to wake it up */
+  if (wakeup_fd != -1 && !atomic_exchange(&wakeup_pending, true)) {
+    tp->wakeup_notify(tp->ctx, wakeup_fd);
+  }
+  return ESP_OK;
+}
 
-      if (pfd[i].revents & (POLLIN | POLLERR | POLLHUP)) {
-        if ((rs = recv(users[i].sock, buffer, sizeof(buffer), 0)) > 0) {
-          telnet_recv(users[i].telnet, buffer, rs);
-        }
-        else if (rs == 0) {
-          ESP_LOGW(TAG, "Closed connection");
-          close(users[i].sock);
-          users[i].sock = -1;
-          if (users[i].name != 0) {
-            // _message(users[i].name, "** HAS DISCONNECTED **");
-            free(users[i].name);
-            users[i].name = 0;
-          }
-          telnet_free(users[i].telnet);
-        }
-        else if (errno != EINTR) {
-          ESP_LOGE(TAG, "recv(client) failed: %s", strerror(errno));
-          return;
-        }
-      }
+char* telnet_server_alloc(size_t size)
+{
+  struct telnet_buf* buf = telnet_buf_alloc(size);
+
+  return buf != NULL ? buf->data : NULL;
+}
+
+void telnet_server_free(char* buffer)
+{
+  if (buffer != NULL) {
+    telnet_buf_free((struct telnet_buf*)(buffer - offsetof(struct telnet_buf, data)));
+  }
+}
+
+esp_err_t telnet_server_send(telnet_session_id_t session, char* buffer, size_t size, int timeout_ms)
+{
+  if (session == TELNET_SESSION_INVALID) {
+    telnet_server_free(buffer);
+    return ESP_ERR_INVALID_ARG;
+  }
+  return _enqueue(session, buffer, size, timeout_ms, NULL);
+}
+
+esp_err_t telnet_server_broadcast(char* buffer, size_t size, int timeout_ms)
+{
+  return _enqueue(TELNET_SESSION_INVALID, buffer, size, timeout_ms, NULL);
+}
+
+telnet_channel_id_t telnet_server_channel(const char* name, telnet_drop_policy_t policy)
+{
+  struct channel* ch;
+  telnet_channel_id_t i;
+
+  if (name == NULL || strlen(name) >= CHANNEL_NAME_LEN) {
+    return TELNET_CHANNEL_INVALID;
+  }
+  for (i = 0; i != nchannels; ++i) {
+    if (strcmp(channels[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (nchannels == CONFIG_TELNET_SERVER_MAX_CHANNELS) {
+    return TELNET_CHANNEL_INVALID;
+  }
+
+  ch = &channels[nchannels];
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  ch->members = static_members[nchannels];
+  memset(ch->members, 0, sizeof(static_members[nchannels]));
+#else
+  if (member_words > 0 && (ch->members = (uint32_t*)calloc(member_words, sizeof(*ch->members))) == NULL) {
+    return TELNET_CHANNEL_INVALID;
+  }
+#endif
+  strcpy(ch->name, name);
+  ch->policy = policy;
+  ch->count = 0;
+  return nchannels++;
+}
+
+esp_err_t telnet_server_subscribe(telnet_session_id_t session, telnet_channel_id_t channel)
+{
+  struct user_t* user;
+  struct telnet_buf** ring = NULL;
+  uint32_t index = session & SESSION_INDEX_MASK;
+
+  if (channel < 0 || channel >= nchannels) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if ((user = _session(session)) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  ring = static_rings[index];
+#endif
+  if (user->subq.ring == NULL &&
+      telnet_subq_init(&user->subq, ring, config.channel_queue_len > 0 ? config.channel_queue_len : 1) == -1) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (!telnet_bitset_test(channels[channel].members, index)) {
+    telnet_bitset_set(channels[channel].members, index);
+    channels[channel].count++;
+  }
+  return ESP_OK;
+}
+
+esp_err_t telnet_server_unsubscribe(telnet_session_id_t session, telnet_channel_id_t channel)
+{
+  uint32_t index = session & SESSION_INDEX_MASK;
+
+  if (channel < 0 || channel >= nchannels) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (_session(session) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (telnet_bitset_test(channels[channel].members, index)) {
+    telnet_bitset_clear(channels[channel].members, index);
+    channels[channel].count--;
+  }
+  return ESP_OK;
+}
+
+esp_err_t telnet_server_publish(telnet_channel_id_t channel, char* buffer, size_t size, int timeout_ms)
+{
+  if (channel < 0 || channel >= nchannels) {
+    telnet_server_free(buffer);
+    return ESP_ERR_INVALID_ARG;
+  }
+  return _enqueue((telnet_session_id_t)channel + 1, buffer, size, timeout_ms, NULL);
+}
+
+int telnet_cmd_printf(telnet_cmd_t* cmd, const char* fmt, ...)
+{
+  va_list va;
+  char* buffer;
+  int len;
+
+  /* synchronous commands run on the server task and print straight into the tracker */
+  if (cmd->user != NULL) {
+    va_start(va, fmt);
+    len = telnet_vprintf(cmd->user->telnet, fmt, va);
+    va_end(va);
+    return len;
+  }
+
+  va_start(va, fmt);
+  len = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+  if (len < 0 || atomic_load(&cmd->cancelled) || (buffer = telnet_server_alloc(len + 1)) == NULL) {
+    return -1;
+  }
+
+  va_start(va, fmt);
+  vsnprintf(buffer, len + 1, fmt, va);
+  va_end(va);
+  return _enqueue(cmd->session, buffer, len, -1, &cmd->cancelled) == ESP_OK ? len : -1;
+}
+
+esp_err_t telnet_cmd_stream(telnet_cmd_t* cmd, telnet_stream_fn_t next, void (*release)(void* state), void* state)
+{
+  struct user_t* user = cmd->user;
+
+  if (next == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (user == NULL || user->stream != NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  user->stream = &static_streams[user->id & SESSION_INDEX_MASK];
+#else
+  if ((user->stream = (struct telnet_stream*)malloc(sizeof(struct telnet_stream))) == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+#endif
+
+  user->stream->next = next;
+  user->stream->release = release;
+  user->stream->state = state;
+
+  /* the first chunk is pulled once the socket reports it is writable */
+  pfd[user->pfd_index].events |= POLLOUT;
+  return ESP_OK;
+}
+
+esp_err_t telnet_server_write(telnet_session_id_t session, const char* text, size_t size)
+{
+  struct user_t* user;
+
+  if ((user = _session(session)) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  telnet_send_text(user->telnet, text, size);
+  return ESP_OK;
+}
+
+esp_err_t telnet_server_write_text(telnet_session_id_t session, telnet_text_t text)
+{
+  struct user_t* user;
+
+  if ((user = _session(session)) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  _reply(user, text);
+  return ESP_OK;
+}
+
+size_t telnet_text_encode(char* buffer, size_t size, const char* text)
+{
+  const char* p;
+  size_t len = 0;
+
+  /* CR LF for LF, CR NUL for CR and IAC IAC, as telnet_send_text() */
+  for (p = text; *p != 0; ++p) {
+    len += *p == '\n' || *p == '\r' || *p == (char)TELNET_IAC ? 2 : 1;
+  }
+  if (len > size) {
+    return len;
+  }
+  for (p = text; *p != 0; ++p) {
+    if (*p == '\n') {
+      *buffer++ = '\r';
+    }
+    else if (*p == (char)TELNET_IAC) {
+      *buffer++ = *p;
+    }
+    *buffer++ = *p;
+    if (*p == '\r') {
+      *buffer++ = 0;
+    }
+  }
+  return len;
+}
+
+esp_err_t telnet_server_session_stats(telnet_session_id_t session, telnet_session_stats_t* stats)
+{
+  struct user_t* user;
+
+  if ((user = _session(session)) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  stats->rtt_ms = user->cold->srtt8 >> 3;
+  stats->rtt_var_ms = user->cold->rttvar4 >> 2;
+  stats->rtt_last_ms = user->cold->rtt_last;
+  stats->rtt_samples = user->cold->rtt_samples;
+  stats->queued = user->outq.bytes;
+  return ESP_OK;
+}
+
+esp_err_t telnet_server_measure_rtt(telnet_session_id_t session)
+{
+  struct user_t* user;
+
+  if ((user = _session(session)) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (!user->cold->rtt_pending) {
+    _measure_rtt(user);
+    _schedule(user);
+  }
+  return ESP_OK;
+}
+
+esp_err_t telnet_server_login(telnet_session_id_t session, const char* name)
+{
+  struct user_t* user;
+  esp_err_t err;
+
+  if ((user = _session(session)) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (user->cold->name != 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if ((err = _login(user, name)) == ESP_OK) {
+    _schedule(user);
+  }
+  return err;
+}
+
+esp_err_t telnet_server_close(telnet_session_id_t session)
+{
+  struct user_t* user;
+
+  if ((user = _session(session)) == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  _close_later(user);
+  return ESP_OK;
+}
+
+bool telnet_cmd_cancelled(const telnet_cmd_t* cmd)
+{
+  return atomic_load(&cmd->cancelled);
+}
+
+telnet_session_id_t telnet_cmd_session(const telnet_cmd_t* cmd)
+{
+  return cmd->session;
+}
+
+/**
+ * @brief Task function for handling Telnet connections.
+ *
+ * This function is responsible for handling Telnet connections. It is executed as a separate task.
+ *
+ * @param arg Pointer to the server configuration.
+ */
+void telnet_task(void* arg)
+{
+  if (telnet_server_start((const telnet_server_config_t*)arg) == ESP_OK) {
+    /* loop for ever */
+    while (telnet_server_poll(AWAIT_TIMEOUT) == ESP_OK) {
     }
+    telnet_server_stop();
   }
+
+  vTaskDelete(NULL);
 }
 
 static TaskHandle_t xHandle = NULL;
@@ -435,7 +2433,16 @@ esp_err_t telnet_server_create(telnet_server_config_t* config)
     return ESP_ERR_INVALID_ARG;
   }
 
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  if (config->stack_size > CONFIG_TELNET_SERVER_STACK_SIZE) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xHandle = xTaskCreateStatic(telnet_task, "telnet_task", config->stack_size, config, config->task_priority,
+                              static_server_stack, &static_server_task);
+  BaseType_t xReturned = xHandle != NULL ? pdPASS : pdFAIL;
+#else
   BaseType_t xReturned = xTaskCreate(telnet_task, "telnet_task", config->stack_size, config, config->task_priority, &xHandle);
+#endif
   if (xReturned == pdPASS) {
     ESP_LOGV(TAG, "Telnet task created successfully.");
     return ESP_OK;
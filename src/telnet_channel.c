@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "telnet_channel.h"
+
+int telnet_subq_init(struct telnet_subq* q, struct telnet_buf** ring, uint16_t size)
+{
+  q->owned = ring == NULL;
+  if (q->owned && (ring = (struct telnet_buf**)malloc(size * sizeof(*ring))) == NULL) {
+    return -1;
+  }
+  q->ring = ring;
+  q->head = 0;
+  q->len = 0;
+  q->size = size;
+  return 0;
+}
+
+void telnet_subq_destroy(struct telnet_subq* q)
+{
+  struct telnet_buf* buf;
+
+  if (q->ring == NULL) {
+    return;
+  }
+  while ((buf = telnet_subq_pop(q)) != NULL) {
+    telnet_buf_unref(buf);
+  }
+  if (q->owned) {
+    free(q->ring);
+  }
+  q->ring = NULL;
+  q->size = 0;
+}
+
+bool telnet_subq_push(struct telnet_subq* q, struct telnet_buf* buf)
+{
+  if (q->len == q->size) {
+    return false;
+  }
+  q->ring[(q->head + q->len++) % q->size] = buf;
+  buf->refs++;
+  return true;
+}
+
+struct telnet_buf* telnet_subq_pop(struct telnet_subq* q)
+{
+  struct telnet_buf* buf;
+
+  if (q->len == 0) {
+    return NULL;
+  }
+  buf = q->ring[q->head];
+  q->head = (q->head + 1) % q->size;
+  q->len--;
+  return buf;
+}
+
+void telnet_buf_unref(struct telnet_buf* buf)
+{
+  if (--buf->refs == 0) {
+    telnet_buf_free(buf);
+  }
+}
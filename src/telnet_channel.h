@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <telnet_outq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Bounded FIFO of published buffers waiting for one subscriber.
+ *
+ * Buffers are shared between all subscribers of a channel and counted in `telnet_buf::refs`.
+ */
+struct telnet_subq {
+  struct telnet_buf** ring;
+  uint16_t head;
+  uint16_t len;
+  uint16_t size;
+  bool owned; /*!< `ring` was allocated by telnet_subq_init() */
+};
+
+/**
+ * @brief Sets bit `index` of a bitset.
+ */
+static inline void telnet_bitset_set(uint32_t* bits, uint32_t index)
+{
+  bits[index / 32] |= 1u << (index % 32);
+}
+
+/**
+ * @brief Clears bit `index` of a bitset.
+ */
+static inline void telnet_bitset_clear(uint32_t* bits, uint32_t index)
+{
+  bits[index / 32] &= ~(1u << (index % 32));
+}
+
+/**
+ * @brief Returns bit `index` of a bitset.
+ */
+static inline bool telnet_bitset_test(const uint32_t* bits, uint32_t index)
+{
+  return (bits[index / 32] >> (index % 32)) & 1u;
+}
+
+/**
+ * @brief Sets up room for `size` buffers in `ring`, or allocates it if `ring` is NULL.
+ *
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int telnet_subq_init(struct telnet_subq* q, struct telnet_buf** ring, uint16_t size);
+
+/**
+ * @brief Drops all queued buffers and releases the queue.
+ */
+void telnet_subq_destroy(struct telnet_subq* q);
+
+/**
+ * @brief Appends a buffer and takes a reference, the caller handles a full queue.
+ *
+ * @return `false` if the queue is full.
+ */
+bool telnet_subq_push(struct telnet_subq* q, struct telnet_buf* buf);
+
+/**
+ * @brief Takes the oldest buffer, the caller owns the reference.
+ *
+ * @return The buffer, or NULL if the queue is empty.
+ */
+struct telnet_buf* telnet_subq_pop(struct telnet_subq* q);
+
+/**
+ * @brief Drops one reference of a shared buffer and frees it with the last one.
+ */
+void telnet_buf_unref(struct telnet_buf* buf);
+
+#ifdef __cplusplus
+}
+#endif
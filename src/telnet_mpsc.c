@@ -0,0 +1,109 @@
+#include <stdlib.h>
+
+#include "telnet_mpsc.h"
+
+/**
+ * @brief Resets a queue of `n` cells, `n` being a power of two.
+ */
+static void _reset(struct telnet_mpsc* q, struct telnet_mpsc_cell* cells, uint32_t n)
+{
+  uint32_t i;
+
+  q->cells = cells;
+  for (i = 0; i != n; ++i) {
+    atomic_init(&q->cells[i].seq, i);
+  }
+  q->mask = n - 1;
+  atomic_init(&q->head, 0);
+  q->tail = 0;
+}
+
+int telnet_mpsc_init(struct telnet_mpsc* q, uint32_t size)
+{
+  struct telnet_mpsc_cell* cells;
+  uint32_t n = 1;
+
+  while (n < size) {
+    n <<= 1;
+  }
+  if ((cells = (struct telnet_mpsc_cell*)calloc(n, sizeof(*cells))) == NULL) {
+    return -1;
+  }
+  _reset(q, cells, n);
+  q->owned = true;
+  return 0;
+}
+
+void telnet_mpsc_init_static(struct telnet_mpsc* q, struct telnet_mpsc_cell* cells, uint32_t size)
+{
+  uint32_t n = 1;
+
+  while (n * 2 <= size) {
+    n <<= 1;
+  }
+  _reset(q, cells, n);
+  q->owned = false;
+}
+
+void telnet_mpsc_destroy(struct telnet_mpsc* q)
+{
+  struct telnet_buf* buf;
+  uint32_t session;
+
+  if (q->cells == NULL) {
+    return;
+  }
+  while ((buf = telnet_mpsc_pop(q, &session)) != NULL) {
+    telnet_buf_free(buf);
+  }
+  if (q->owned) {
+    free(q->cells);
+  }
+  q->cells = NULL;
+}
+
+bool telnet_mpsc_push(struct telnet_mpsc* q, uint32_t session, struct telnet_buf* buf)
+{
+  struct telnet_mpsc_cell* cell;
+  uint32_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  int32_t diff;
+
+  while (true) {
+    cell = &q->cells[pos & q->mask];
+    diff = (int32_t)(atomic_load_explicit(&cell->seq, memory_order_acquire) - pos);
+    if (diff == 0) {
+      /* cell is free for this position, try to claim it */
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if (diff < 0) {
+      /* the consumer has not freed the cell of the previous lap yet */
+      return false;
+    }
+    else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+
+  cell->session = session;
+  cell->buf = buf;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+struct telnet_buf* telnet_mpsc_pop(struct telnet_mpsc* q, uint32_t* session)
+{
+  struct telnet_mpsc_cell* cell = &q->cells[q->tail & q->mask];
+  struct telnet_buf* buf;
+
+  if ((int32_t)(atomic_load_explicit(&cell->seq, memory_order_acquire) - (q->tail + 1)) < 0) {
+    return NULL;
+  }
+
+  buf = cell->buf;
+  *session = cell->session;
+  atomic_store_explicit(&cell->seq, q->tail + q->mask + 1, memory_order_release);
+  q->tail++;
+  return buf;
+}
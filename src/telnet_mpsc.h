@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <telnet_outq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Queue entry, `seq` tells producers and the consumer whose turn it is.
+ */
+struct telnet_mpsc_cell {
+  _Atomic uint32_t seq;
+  uint32_t session;
+  struct telnet_buf* buf;
+};
+
+/**
+ * @brief Bounded lock-free multi-producer single-consumer queue of output buffers.
+ *
+ * Producers claim a cell with a compare-and-swap on `head`, the consumer owns `tail`. Buffers
+ * are moved through the queue, never copied.
+ */
+struct telnet_mpsc {
+  struct telnet_mpsc_cell* cells;
+  uint32_t mask;
+  _Atomic uint32_t head;
+  uint32_t tail;
+  bool owned; /*!< `cells` were allocated by telnet_mpsc_init() */
+};
+
+/**
+ * @brief Allocates a queue holding at least `size` entries (rounded up to a power of two).
+ *
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int telnet_mpsc_init(struct telnet_mpsc* q, uint32_t size);
+
+/**
+ * @brief Sets up a queue in `size` caller-provided cells, of which a power of two is used.
+ */
+void telnet_mpsc_init_static(struct telnet_mpsc* q, struct telnet_mpsc_cell* cells, uint32_t size);
+
+/**
+ * @brief Releases the queue and every buffer still in it.
+ */
+void telnet_mpsc_destroy(struct telnet_mpsc* q);
+
+/**
+ * @brief Appends a buffer, safe to call from any number of tasks.
+ *
+ * @return `false` if the queue is full, the buffer stays owned by the caller.
+ */
+bool telnet_mpsc_push(struct telnet_mpsc* q, uint32_t session, struct telnet_buf* buf);
+
+/**
+ * @brief Takes the oldest buffer, must only be called by the consumer.
+ *
+ * @return The buffer, or NULL if the queue is empty.
+ */
+struct telnet_buf* telnet_mpsc_pop(struct telnet_mpsc* q, uint32_t* session);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telnet_outq.h"
+
+/**
+ * @brief Pool buffers are taken from, NULL to use the heap.
+ */
+static struct telnet_buf_pool* pool;
+
+void telnet_buf_pool_init(struct telnet_buf_pool* p, char* slots, _Atomic uint32_t* next, uint32_t count)
+{
+  uint32_t i;
+
+  pool = NULL;
+  if (p == NULL) {
+    return;
+  }
+
+  /* links are slot numbers + 1, 0 ends the stack */
+  p->slots = slots;
+  p->next = next;
+  p->count = count;
+  for (i = 0; i != count; ++i) {
+    atomic_init(&next[i], i + 1 < count ? i + 2 : 0);
+  }
+  atomic_init(&p->head, count > 0 ? 1 : 0);
+  pool = p;
+}
+
+/**
+ * @brief Pops a free buffer off the pool.
+ */
+static struct telnet_buf* _pool_pop(void)
+{
+  uint32_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+  uint32_t slot;
+
+  do {
+    if ((slot = head & 0xffff) == 0) {
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(
+    &pool->head, &head, ((head & 0xffff0000) + 0x10000) | atomic_load_explicit(&pool->next[slot - 1], memory_order_relaxed),
+    memory_order_acquire, memory_order_acquire));
+
+  return (struct telnet_buf*)(pool->slots + (slot - 1) * TELNET_BUF_POOL_SLOT);
+}
+
+/**
+ * @brief Pushes a buffer back onto the pool.
+ */
+static void _pool_push(struct telnet_buf* buf)
+{
+  uint32_t slot = ((char*)buf - pool->slots) / TELNET_BUF_POOL_SLOT + 1;
+  uint32_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+
+  do {
+    atomic_store_explicit(&pool->next[slot - 1], head & 0xffff, memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, ((head & 0xffff0000) + 0x10000) | slot,
+                                                  memory_order_release, memory_order_relaxed));
+}
+
+struct telnet_buf* telnet_buf_alloc(size_t size)
+{
+  struct telnet_buf* buf;
+
+  if (pool != NULL) {
+    buf = size <= TELNET_OUTQ_CHUNK ? _pool_pop() : NULL;
+    size = TELNET_OUTQ_CHUNK;
+  }
+  else {
+    buf = (struct telnet_buf*)malloc(sizeof(struct telnet_buf) + size);
+  }
+
+  if (buf != NULL) {
+    buf->next = NULL;
+    buf->refs = 0;
+    buf->off = 0;
+    buf->len = 0;
+    buf->size = size;
+  }
+  return buf;
+}
+
+void telnet_buf_free(struct telnet_buf* buf)
+{
+  if (pool != NULL) {
+    _pool_push(buf);
+  }
+  else {
+    free(buf);
+  }
+}
+
+int telnet_outq_append(struct telnet_outq* q, const char* buffer, size_t size)
+{
+  struct telnet_buf* buf;
+  size_t n;
+
+  /* fill what is left of the tail buffer */
+  if (q->tail != NULL && q->tail->len < q->tail->size) {
+    n = q->tail->size - q->tail->len < size ? q->tail->size - q->tail->len : size;
+    memcpy(q->tail->data + q->tail->len, buffer, n);
+    q->tail->len += n;
+    q->bytes += n;
+    buffer += n;
+    size -= n;
+  }
+
+  while (size > 0) {
+    n = pool != NULL || size < TELNET_OUTQ_CHUNK ? TELNET_OUTQ_CHUNK : size;
+    if ((buf = telnet_buf_alloc(n)) == NULL) {
+      return -1;
+    }
+    n = size < buf->size ? size : buf->size;
+    memcpy(buf->data, buffer, n);
+    buf->len = n;
+    telnet_outq_push(q, buf);
+    buffer += n;
+    size -= n;
+  }
+  return 0;
+}
+
+void telnet_outq_push(struct telnet_outq* q, struct telnet_buf* buf)
+{
+  buf->next = NULL;
+  if (q->tail != NULL) {
+    q->tail->next = buf;
+  }
+  else {
+    q->head = buf;
+  }
+  q->tail = buf;
+  q->bytes += buf->len - buf->off;
+}
+
+int telnet_outq_flush(struct telnet_outq* q, telnet_outq_write_t write, void* ctx)
+{
+  struct telnet_buf* buf;
+  ssize_t rs;
+
+  while ((buf = q->head) != NULL) {
+    if (buf->off != buf->len) {
+      if ((rs = write(ctx, buf->data + buf->off, buf->len - buf->off)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          return 0;
+        }
+        return -1;
+      }
+      buf->off += rs;
+      q->bytes -= rs;
+      if (buf->off != buf->len) {
+        return 0;
+      }
+    }
+
+    q->head = buf->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    telnet_buf_free(buf);
+  }
+  return 0;
+}
+
+void telnet_outq_clear(struct telnet_outq* q)
+{
+  struct telnet_buf* buf;
+
+  while ((buf = q->head) != NULL) {
+    q->head = buf->next;
+    telnet_buf_free(buf);
+  }
+  q->tail = NULL;
+  q->bytes = 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Minimum capacity of a buffer allocated by telnet_outq_append().
+ */
+#define TELNET_OUTQ_CHUNK 512
+
+/**
+ * @brief Heap buffer that can be queued for output without copying.
+ *
+ * `data[off..len)` is pending, `size` is the capacity of `data`. `refs` counts the subscriber
+ * queues sharing a published buffer, see telnet_channel.h.
+ */
+struct telnet_buf {
+  struct telnet_buf* next;
+  uint32_t refs;
+  size_t off;
+  size_t len;
+  size_t size;
+  char data[];
+};
+
+/**
+ * @brief FIFO of output buffers waiting for the socket to become writable.
+ */
+struct telnet_outq {
+  struct telnet_buf* head;
+  struct telnet_buf* tail;
+  size_t bytes;
+};
+
+/**
+ * @brief Bytes per buffer of a telnet_buf_pool, enough for TELNET_OUTQ_CHUNK bytes of data.
+ */
+#define TELNET_BUF_POOL_SLOT (sizeof(struct telnet_buf) + TELNET_OUTQ_CHUNK)
+
+/**
+ * @brief Fixed set of buffers that replaces malloc(), see telnet_buf_pool_init().
+ *
+ * Free buffers form a lock-free stack, so any task can allocate and release them. `head` holds
+ * a generation counter above the slot number to make the compare-and-swap immune to ABA.
+ */
+struct telnet_buf_pool {
+  char* slots;
+  _Atomic uint32_t* next;
+  uint32_t count;
+  _Atomic uint32_t head;
+};
+
+/**
+ * @brief Writes up to `size` bytes, returns the number written or -1 with errno set.
+ */
+typedef ssize_t (*telnet_outq_write_t)(void* ctx, const char* buffer, size_t size);
+
+/**
+ * @brief Takes all buffers from `pool` instead of the heap, or from the heap again if NULL.
+ *
+ * `slots` holds `count` buffers of TELNET_BUF_POOL_SLOT bytes, `next` holds `count` links, at
+ * most 65535. Must not be called while buffers are in use.
+ */
+void telnet_buf_pool_init(struct telnet_buf_pool* pool, char* slots, _Atomic uint32_t* next, uint32_t count);
+
+/**
+ * @brief Allocates a buffer with room for `size` bytes, at most TELNET_OUTQ_CHUNK from a pool.
+ */
+struct telnet_buf* telnet_buf_alloc(size_t size);
+
+/**
+ * @brief Releases a buffer from telnet_buf_alloc().
+ */
+void telnet_buf_free(struct telnet_buf* buf);
+
+/**
+ * @brief Copies data to the end of the queue, filling the tail buffer first.
+ *
+ * Data that does not fit a pooled buffer is spread over several.
+ *
+ * @return 0 on success, -1 if a buffer could not be allocated.
+ */
+int telnet_outq_append(struct telnet_outq* q, const char* buffer, size_t size);
+
+/**
+ * @brief Moves a filled buffer to the end of the queue, the queue takes ownership.
+ */
+void telnet_outq_push(struct telnet_outq* q, struct telnet_buf* buf);
+
+/**
+ * @brief Writes queued data until the queue is empty or `write` would block.
+ *
+ * @return 0 when the queue was flushed or the writer would block, -1 on a write error.
+ */
+int telnet_outq_flush(struct telnet_outq* q, telnet_outq_write_t write, void* ctx);
+
+/**
+ * @brief Releases all queued buffers.
+ */
+void telnet_outq_clear(struct telnet_outq* q);
+
+#ifdef __cplusplus
+}
+#endif
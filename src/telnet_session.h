@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libtelnet.h>
+#include <telnet_channel.h>
+#include <telnet_outq.h>
+#include <telnet_wheel.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Session state only needed while processing input or logging in.
+ *
+ * Allocated on connect and released on disconnect, so unused sessions do not carry a line buffer.
+ */
+struct user_cold {
+  char* name; /*!< points to `namebuf` once logged in */
+  char namebuf[33];
+  void* handler_ctx;
+  uint32_t connected_at;
+  /* time of the last keepalive probe, valid while `probes` is non-zero */
+  uint32_t probe_sent;
+  /* sent time of the outstanding TIMING-MARK, valid while `rtt_pending` */
+  uint32_t rtt_sent;
+  bool rtt_pending;
+  /* smoothed round trip time times 8 and its deviation times 4, as TCP keeps them */
+  uint32_t srtt8;
+  uint32_t rttvar4;
+  uint32_t rtt_last;
+  uint32_t rtt_samples;
+  int linepos;
+  /* character mode: the last byte ended a line with CR, a following LF or NUL is dropped */
+  bool eol;
+  /* the client acknowledged LINEMODE EDIT, it edits and echoes lines itself */
+  bool linemode;
+  char linebuf[255];
+};
+
+/**
+ * @brief Session state touched by the server loop, packed into the session table.
+ *
+ * Loops over all sessions only read these fields; everything else lives in `cold`.
+ */
+struct user_t {
+  /* generation << 16 | slot index, see telnet_session_id_t */
+  uint32_t id;
+  int sock;
+  /* index of the socket in the server's poll set */
+  int pfd_index;
+  /* set when the session failed inside a telnet callback, reaped by the loop */
+  bool closing;
+  /* the client agreed to DO ECHO, input is echoed and edited by the server */
+  bool echo;
+  /* keepalive probes sent since the last input, NOP probes are not counted past 1 */
+  uint8_t probes;
+  uint32_t last_rx;
+  telnet_t* telnet;
+  struct telnet_timer timer;
+  /* output the socket did not take yet */
+  struct telnet_outq outq;
+  /* published buffers waiting for `outq` to drain, allocated on the first subscription */
+  struct telnet_subq subq;
+  /* asynchronous command started by the session, shared with a worker */
+  struct telnet_cmd* job;
+  /* output generator of a streaming command, pulled on POLLOUT */
+  struct telnet_stream* stream;
+  /* next unused session while in the server's free list */
+  struct user_t* next;
+  struct user_cold* cold;
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,130 @@
+#include "telnet_wheel.h"
+
+#define WHEEL_MASK (TELNET_WHEEL_SLOTS - 1)
+
+static void _link(struct telnet_timer** head, struct telnet_timer* timer)
+{
+  timer->next = *head;
+  if (timer->next != NULL) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = head;
+  *head = timer;
+}
+
+static void _unlink(struct telnet_timer* timer)
+{
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+void telnet_wheel_init(struct telnet_wheel* wheel, uint32_t now)
+{
+  int i;
+
+  for (i = 0; i != TELNET_WHEEL_SLOTS; ++i) {
+    wheel->slots[i] = NULL;
+  }
+  wheel->tick = 0;
+  wheel->now = now;
+  wheel->count = 0;
+}
+
+void telnet_timer_schedule(struct telnet_wheel* wheel, struct telnet_timer* timer, uint32_t expires)
+{
+  /* relative to the current tick and rounded up, timers never fire early */
+  int32_t delta = (int32_t)(expires - wheel->now);
+  uint32_t tick = wheel->tick + (delta > 0 ? ((uint32_t)delta + TELNET_WHEEL_TICK_MS - 1) / TELNET_WHEEL_TICK_MS : 0);
+
+  if (telnet_timer_pending(timer)) {
+    _unlink(timer);
+    wheel->count--;
+  }
+
+  /* the current tick has already been processed */
+  if ((int32_t)(tick - wheel->tick) <= 0) {
+    tick = wheel->tick + 1;
+  }
+
+  timer->expires = tick;
+  _link(&wheel->slots[tick & WHEEL_MASK], timer);
+  wheel->count++;
+}
+
+void telnet_timer_cancel(struct telnet_wheel* wheel, struct telnet_timer* timer)
+{
+  if (telnet_timer_pending(timer)) {
+    _unlink(timer);
+    wheel->count--;
+  }
+}
+
+void telnet_wheel_advance(struct telnet_wheel* wheel, uint32_t now, telnet_timer_cb_t cb, void* ud)
+{
+  /* the clock wraps, only the elapsed time counts; the remainder is kept for the next call */
+  int32_t elapsed = (int32_t)(now - wheel->now);
+  uint32_t ticks;
+  uint32_t now_tick;
+  struct telnet_timer* head;
+  struct telnet_timer* timer;
+  uint32_t slot;
+
+  if (elapsed < TELNET_WHEEL_TICK_MS) {
+    return;
+  }
+  ticks = (uint32_t)elapsed / TELNET_WHEEL_TICK_MS;
+  now_tick = wheel->tick + ticks;
+  wheel->tick = now_tick;
+  wheel->now += ticks * TELNET_WHEEL_TICK_MS;
+
+  /* after a long stall one pass over all slots covers every elapsed tick */
+  if (ticks > TELNET_WHEEL_SLOTS) {
+    ticks = TELNET_WHEEL_SLOTS;
+  }
+
+  for (; ticks != 0; --ticks) {
+    slot = (now_tick - ticks + 1) & WHEEL_MASK;
+    if (wheel->slots[slot] == NULL) {
+      continue;
+    }
+
+    /* detach the slot, callbacks may schedule into it again */
+    head = wheel->slots[slot];
+    wheel->slots[slot] = NULL;
+    head->pprev = &head;
+
+    while ((timer = head) != NULL) {
+      _unlink(timer);
+      if ((int32_t)(timer->expires - now_tick) <= 0) {
+        wheel->count--;
+        cb(timer, ud);
+      }
+      else {
+        /* a later round, keep it in its slot */
+        _link(&wheel->slots[slot], timer);
+      }
+    }
+  }
+}
+
+int telnet_wheel_timeout(const struct telnet_wheel* wheel, uint32_t now)
+{
+  uint32_t d;
+
+  if (wheel->count == 0) {
+    return -1;
+  }
+
+  for (d = 1; d <= TELNET_WHEEL_SLOTS; ++d) {
+    if (wheel->slots[(wheel->tick + d) & WHEEL_MASK] != NULL) {
+      uint32_t due = wheel->now + d * TELNET_WHEEL_TICK_MS;
+      return (int32_t)(due - now) > 0 ? (int)(due - now) : 0;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of slots of the timer wheel, must be a power of two.
+ */
+#define TELNET_WHEEL_SLOTS 64
+
+/**
+ * @brief Timer wheel tick in milliseconds.
+ */
+#define TELNET_WHEEL_TICK_MS 100
+
+/**
+ * @brief Timer embedded in the object it belongs to.
+ *
+ * Timers are kept in intrusive doubly linked lists, so scheduling and cancelling is O(1).
+ * A zero-initialized timer is idle.
+ */
+struct telnet_timer {
+  struct telnet_timer* next;
+  struct telnet_timer** pprev;
+  uint32_t expires;
+};
+
+/**
+ * @brief Hashed timer wheel.
+ *
+ * Timers are hashed into `TELNET_WHEEL_SLOTS` slots by their expiry tick. Advancing the wheel
+ * only visits the slots of elapsed ticks, timers of later rounds that share a slot are skipped
+ * and stay where they are.
+ */
+struct telnet_wheel {
+  struct telnet_timer* slots[TELNET_WHEEL_SLOTS];
+  /* ticks since telnet_wheel_init(), independent of the wrapping millisecond clock */
+  uint32_t tick;
+  /* time at which `tick` started */
+  uint32_t now;
+  size_t count;
+};
+
+typedef void (*telnet_timer_cb_t)(struct telnet_timer* timer, void* ud);
+
+/**
+ * @brief Resets the wheel, `now` becomes its current time.
+ */
+void telnet_wheel_init(struct telnet_wheel* wheel, uint32_t now);
+
+/**
+ * @brief (Re)schedules a timer to expire at `expires` milliseconds.
+ */
+void telnet_timer_schedule(struct telnet_wheel* wheel, struct telnet_timer* timer, uint32_t expires);
+
+/**
+ * @brief Cancels a timer, does nothing if it is not scheduled.
+ */
+void telnet_timer_cancel(struct telnet_wheel* wheel, struct telnet_timer* timer);
+
+/**
+ * @brief Returns non-zero if the timer is scheduled.
+ */
+static inline int telnet_timer_pending(const struct telnet_timer* timer)
+{
+  return timer->pprev != NULL;
+}
+
+/**
+ * @brief Fires all timers that expired up to `now`.
+ *
+ * Expired timers are unscheduled before `cb` is invoked, so the callback may reschedule them.
+ */
+void telnet_wheel_advance(struct telnet_wheel* wheel, uint32_t now, telnet_timer_cb_t cb, void* ud);
+
+/**
+ * @brief Returns the number of milliseconds until the next non-empty slot is due, or -1 if
+ * no timer is scheduled. Intended to be used as (an upper bound of) the poll() timeout.
+ */
+int telnet_wheel_timeout(const struct telnet_wheel* wheel, uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
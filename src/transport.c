@@ -0,0 +1,126 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <lwip/sockets.h>
+#include <telnet/transport.h>
+
+static int _socket(void* ctx, int domain, int type, int protocol)
+{
+  return socket(domain, type, protocol);
+}
+
+static int _setsockopt(void* ctx, int fd, int level, int optname, const void* optval, socklen_t optlen)
+{
+  return setsockopt(fd, level, optname, optval, optlen);
+}
+
+static int _bind(void* ctx, int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+  return bind(fd, addr, addrlen);
+}
+
+static int _listen(void* ctx, int fd, int backlog)
+{
+  return listen(fd, backlog);
+}
+
+static int _accept(void* ctx, int fd, struct sockaddr* addr, socklen_t* addrlen)
+{
+  return accept(fd, addr, addrlen);
+}
+
+static ssize_t _recv(void* ctx, int fd, void* buffer, size_t size, int flags)
+{
+  return recv(fd, buffer, size, flags);
+}
+
+static ssize_t _send(void* ctx, int fd, const void* buffer, size_t size, int flags)
+{
+  return send(fd, buffer, size, flags);
+}
+
+static ssize_t _writev(void* ctx, int fd, const struct iovec* iov, int iovcnt)
+{
+  return writev(fd, iov, iovcnt);
+}
+
+static int _poll(void* ctx, struct pollfd* fds, nfds_t nfds, int timeout)
+{
+  return poll(fds, nfds, timeout);
+}
+
+static int _close(void* ctx, int fd)
+{
+  return close(fd);
+}
+
+static int _fcntl(void* ctx, int fd, int cmd, int val)
+{
+  return fcntl(fd, cmd, val);
+}
+
+/* a UDP socket connected to itself over loopback; lwIP sockets can be used from any task */
+static int _wakeup_open(void* ctx)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int fd, err;
+
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || getsockname(fd, (struct sockaddr*)&addr, &addrlen) == -1 ||
+      connect(fd, (struct sockaddr*)&addr, addrlen) == -1 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+static int _wakeup_notify(void* ctx, int fd)
+{
+  char byte = 0;
+
+  return send(fd, &byte, 1, MSG_DONTWAIT) == -1 ? -1 : 0;
+}
+
+static void _wakeup_drain(void* ctx, int fd)
+{
+  char buffer[16];
+
+  while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+  }
+}
+
+static uint32_t _now(void* ctx)
+{
+  return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
+}
+
+const telnet_transport_t telnet_transport_lwip = {
+  .socket = _socket,
+  .setsockopt = _setsockopt,
+  .bind = _bind,
+  .listen = _listen,
+  .accept = _accept,
+  .recv = _recv,
+  .send = _send,
+  .writev = _writev,
+  .poll = _poll,
+  .close = _close,
+  .fcntl = _fcntl,
+  .wakeup_open = _wakeup_open,
+  .wakeup_notify = _wakeup_notify,
+  .wakeup_drain = _wakeup_drain,
+  .now = _now,
+  .ctx = NULL,
+};
@@ -0,0 +1,674 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <telnet/transport_mem.h>
+
+/**
+ * @brief First descriptor number handed out, keeps 0..2 free like a real process.
+ */
+#define MEM_FD_BASE 3
+
+enum mem_fd_type {
+  MEM_FD_FREE = 0,
+  MEM_FD_SOCKET,
+  MEM_FD_LISTEN,
+  MEM_FD_STREAM,
+  MEM_FD_WAKEUP,
+};
+
+/**
+ * @brief Byte ring used as the receive buffer of a connection end.
+ */
+struct mem_ring {
+  char* data;
+  size_t head;
+  size_t len;
+  size_t size;
+};
+
+struct mem_fd {
+  enum mem_fd_type type;
+  bool client;
+  bool peer_closed;
+  /* file status flags, only kept for F_GETFL; the memory transport never blocks */
+  int fl;
+  /* other end of a stream, -1 once closed */
+  int peer;
+  /* bound port of a socket or listening socket */
+  uint16_t port;
+  /* listening socket: accept queue of server ends, linked through `next` */
+  int backlog;
+  int pending;
+  int head;
+  int tail;
+  int next;
+  /* wakeup descriptor: set by wakeup_notify(), the only call other tasks may make */
+  atomic_bool notified;
+  struct mem_ring rx;
+};
+
+struct mem_transport {
+  /* must stay first, the public handle is a pointer to it */
+  telnet_transport_t vt;
+  struct mem_fd* fds;
+  int max_fds;
+  size_t buffer_size;
+  int flags;
+  uint32_t now;
+  /* script replay */
+  const telnet_mem_step_t* script;
+  size_t script_len;
+  size_t script_pos;
+  int* clients;
+  uint32_t max_clients;
+  telnet_mem_stats_t stats;
+};
+
+static struct mem_fd* _fd(struct mem_transport* mt, int fd)
+{
+  if (fd < MEM_FD_BASE || fd >= MEM_FD_BASE + mt->max_fds || mt->fds[fd - MEM_FD_BASE].type == MEM_FD_FREE) {
+    return NULL;
+  }
+  return &mt->fds[fd - MEM_FD_BASE];
+}
+
+static int _alloc_fd(struct mem_transport* mt, enum mem_fd_type type)
+{
+  int i;
+
+  for (i = 0; i != mt->max_fds; ++i) {
+    if (mt->fds[i].type == MEM_FD_FREE) {
+      memset(&mt->fds[i], 0, sizeof(mt->fds[i]));
+      mt->fds[i].type = type;
+      mt->fds[i].peer = -1;
+      mt->fds[i].head = -1;
+      mt->fds[i].tail = -1;
+      mt->fds[i].next = -1;
+      return i + MEM_FD_BASE;
+    }
+  }
+
+  errno = EMFILE;
+  return -1;
+}
+
+static void _free_fd(struct mem_transport* mt, int fd)
+{
+  struct mem_fd* f = &mt->fds[fd - MEM_FD_BASE];
+  free(f->rx.data);
+  memset(f, 0, sizeof(*f));
+}
+
+/**
+ * @brief Copies up to `size` bytes into a ring, returns the number of bytes stored.
+ */
+static size_t _ring_put(struct mem_ring* r, const char* buffer, size_t size)
+{
+  size_t n, tail, chunk;
+
+  n = r->size - r->len < size ? r->size - r->len : size;
+  tail = (r->head + r->len) % r->size;
+  chunk = r->size - tail < n ? r->size - tail : n;
+  memcpy(r->data + tail, buffer, chunk);
+  memcpy(r->data, buffer + chunk, n - chunk);
+  r->len += n;
+  return n;
+}
+
+/**
+ * @brief Moves up to `size` bytes out of a ring, returns the number of bytes taken.
+ */
+static size_t _ring_get(struct mem_ring* r, char* buffer, size_t size)
+{
+  size_t n, chunk;
+
+  n = r->len < size ? r->len : size;
+  chunk = r->size - r->head < n ? r->size - r->head : n;
+  memcpy(buffer, r->data + r->head, chunk);
+  memcpy(buffer + chunk, r->data, n - chunk);
+  r->head = (r->head + n) % r->size;
+  r->len -= n;
+  return n;
+}
+
+/**
+ * @brief Closes one end of a stream and tells the other end about it.
+ */
+static void _close_stream(struct mem_transport* mt, int fd)
+{
+  struct mem_fd* f = &mt->fds[fd - MEM_FD_BASE];
+  struct mem_fd* peer = f->peer != -1 ? &mt->fds[f->peer - MEM_FD_BASE] : NULL;
+
+  if (peer != NULL) {
+    peer->peer = -1;
+    peer->peer_closed = true;
+  }
+  _free_fd(mt, fd);
+}
+
+static int _socket(void* ctx, int domain, int type, int protocol)
+{
+  return _alloc_fd((struct mem_transport*)ctx, MEM_FD_SOCKET);
+}
+
+static int _setsockopt(void* ctx, int fd, int level, int optname, const void* optval, socklen_t optlen)
+{
+  if (_fd((struct mem_transport*)ctx, fd) == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  return 0;
+}
+
+static int _bind(void* ctx, int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+  struct mem_transport* mt = (struct mem_transport*)ctx;
+  struct mem_fd* f = _fd(mt, fd);
+  uint16_t port = ntohs(((const struct sockaddr_in*)addr)->sin_port);
+  int i;
+
+  if (f == NULL || f->type != MEM_FD_SOCKET) {
+    errno = EBADF;
+    return -1;
+  }
+
+  for (i = 0; i != mt->max_fds; ++i) {
+    if (mt->fds[i].type == MEM_FD_LISTEN && mt->fds[i].port == port) {
+      errno = EADDRINUSE;
+      return -1;
+    }
+  }
+
+  f->port = port;
+  return 0;
+}
+
+static int _listen(void* ctx, int fd, int backlog)
+{
+  struct mem_fd* f = _fd((struct mem_transport*)ctx, fd);
+
+  if (f == NULL || f->type != MEM_FD_SOCKET) {
+    errno = EBADF;
+    return -1;
+  }
+
+  f->type = MEM_FD_LISTEN;
+  f->backlog = backlog > 0 ? backlog : 1;
+  return 0;
+}
+
+static int _accept(void* ctx, int fd, struct sockaddr* addr, socklen_t* addrlen)
+{
+  struct mem_transport* mt = (struct mem_transport*)ctx;
+  struct mem_fd* f = _fd(mt, fd);
+  struct sockaddr_in* in = (struct sockaddr_in*)addr;
+  int conn;
+
+  if (f == NULL || f->type != MEM_FD_LISTEN) {
+    errno = EBADF;
+    return -1;
+  }
+  if (f->head == -1) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  conn = f->head;
+  f->head = mt->fds[conn - MEM_FD_BASE].next;
+  if (f->head == -1) {
+    f->tail = -1;
+  }
+  f->pending--;
+
+  if (in != NULL && addrlen != NULL && *addrlen >= sizeof(*in)) {
+    memset(in, 0, sizeof(*in));
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in->sin_port = htons((uint16_t)mt->fds[conn - MEM_FD_BASE].peer);
+    *addrlen = sizeof(*in);
+  }
+  return conn;
+}
+
+static ssize_t _recv(void* ctx, int fd, void* buffer, size_t size, int flags)
+{
+  struct mem_fd* f = _fd((struct mem_transport*)ctx, fd);
+
+  if (f == NULL || f->type != MEM_FD_STREAM) {
+    errno = EBADF;
+    return -1;
+  }
+  if (f->rx.len > 0) {
+    return (ssize_t)_ring_get(&f->rx, (char*)buffer, size);
+  }
+  if (f->peer_closed) {
+    return 0;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+/**
+ * @brief Delivers bytes from one connection end into the receive ring of the other.
+ */
+static ssize_t _deliver(struct mem_transport* mt, int fd, const void* buffer, size_t size)
+{
+  struct mem_fd* f = _fd(mt, fd);
+  struct mem_fd* peer;
+  size_t n;
+
+  if (f == NULL || f->type != MEM_FD_STREAM) {
+    errno = EBADF;
+    return -1;
+  }
+  if (f->peer == -1) {
+    errno = f->peer_closed ? ECONNRESET : ENOTCONN;
+    return -1;
+  }
+
+  peer = &mt->fds[f->peer - MEM_FD_BASE];
+  if (peer->client && (mt->flags & TELNET_MEM_DISCARD_OUTPUT)) {
+    mt->stats.bytes_to_clients += size;
+    return (ssize_t)size;
+  }
+
+  if ((n = _ring_put(&peer->rx, (const char*)buffer, size)) == 0 && size > 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (peer->client) {
+    mt->stats.bytes_to_clients += n;
+  }
+  else {
+    mt->stats.bytes_to_server += n;
+  }
+  return (ssize_t)n;
+}
+
+static ssize_t _send(void* ctx, int fd, const void* buffer, size_t size, int flags)
+{
+  struct mem_transport* mt = (struct mem_transport*)ctx;
+
+  mt->stats.writes++;
+  return _deliver(mt, fd, buffer, size);
+}
+
+static ssize_t _writev(void* ctx, int fd, const struct iovec* iov, int iovcnt)
+{
+  struct mem_transport* mt = (struct mem_transport*)ctx;
+  ssize_t total = 0, rs;
+  int i;
+
+  mt->stats.writes++;
+  for (i = 0; i < iovcnt; ++i) {
+    if ((rs = _deliver(mt, fd, iov[i].iov_base, iov[i].iov_len)) == -1) {
+      return total > 0 ? total : -1;
+    }
+    total += rs;
+    if ((size_t)rs < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
+/**
+ * @brief Applies all scripted steps that are due at the current virtual time.
+ */
+static void _play_due(struct mem_transport* mt)
+{
+  const telnet_mem_step_t* step;
+  int fd;
+
+  while (mt->script_pos != mt->script_len && mt->script[mt->script_pos].at <= mt->now) {
+    step = &mt->script[mt->script_pos++];
+
+    if (step->client >= mt->max_clients) {
+      uint32_t max_clients = mt->max_clients ? mt->max_clients : 16;
+      int* clients;
+      uint32_t i;
+
+      while (max_clients <= step->client) {
+        max_clients *= 2;
+      }
+      if ((clients = (int*)realloc(mt->clients, max_clients * sizeof(int))) == NULL) {
+        continue;
+      }
+      for (i = mt->max_clients; i != max_clients; ++i) {
+        clients[i] = -1;
+      }
+      mt->clients = clients;
+      mt->max_clients = max_clients;
+    }
+
+    fd = mt->clients[step->client];
+    switch (step->op) {
+    case TELNET_MEM_CONNECT:
+      if (fd == -1) {
+        mt->clients[step->client] = telnet_mem_connect(&mt->vt, step->port);
+      }
+      break;
+    case TELNET_MEM_SEND:
+      if (fd != -1) {
+        _deliver(mt, fd, step->data, step->size);
+      }
+      break;
+    case TELNET_MEM_CLOSE:
+      if (fd != -1) {
+        telnet_mem_close(&mt->vt, fd);
+        mt->clients[step->client] = -1;
+      }
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Computes readiness of all descriptors, returns the number of ready entries.
+ */
+static int _scan(struct mem_transport* mt, struct pollfd* fds, nfds_t nfds)
+{
+  struct mem_fd* f;
+  nfds_t i;
+  int ready = 0;
+
+  for (i = 0; i != nfds; ++i) {
+    fds[i].revents = 0;
+    if (fds[i].fd < 0) {
+      continue;
+    }
+    if ((f = _fd(mt, fds[i].fd)) == NULL) {
+      fds[i].revents = POLLNVAL;
+    }
+    else if (f->type == MEM_FD_LISTEN) {
+      if (f->head != -1) {
+        fds[i].revents |= fds[i].events & POLLIN;
+      }
+    }
+    else if (f->type == MEM_FD_STREAM) {
+      if (f->rx.len > 0 || f->peer_closed) {
+        fds[i].revents |= fds[i].events & POLLIN;
+      }
+      if (f->peer_closed) {
+        fds[i].revents |= POLLHUP;
+      }
+      else if (f->peer != -1 && mt->fds[f->peer - MEM_FD_BASE].rx.len < mt->fds[f->peer - MEM_FD_BASE].rx.size) {
+        fds[i].revents |= fds[i].events & POLLOUT;
+      }
+    }
+    else if (f->type == MEM_FD_WAKEUP) {
+      if (atomic_load(&f->notified)) {
+        fds[i].revents |= fds[i].events & POLLIN;
+      }
+    }
+    if (fds[i].revents != 0) {
+      ++ready;
+    }
+  }
+  return ready;
+}
+
+static int _poll(void* ctx, struct pollfd* fds, nfds_t nfds, int timeout)
+{
+  struct mem_transport* mt = (struct mem_transport*)ctx;
+  uint32_t target;
+  int ready;
+
+  mt->stats.polls++;
+  _play_due(mt);
+  if ((ready = _scan(mt, fds, nfds)) != 0 || timeout == 0) {
+    return ready;
+  }
+
+  /* nothing to do: jump to the end of the timeout or to the next scripted step */
+  target = timeout < 0 ? mt->now : mt->now + (uint32_t)timeout;
+  if (mt->script_pos != mt->script_len && (timeout < 0 || mt->script[mt->script_pos].at < target)) {
+    target = mt->script[mt->script_pos].at;
+  }
+  if ((int32_t)(target - mt->now) > 0) {
+    mt->now = target;
+  }
+
+  _play_due(mt);
+  return _scan(mt, fds, nfds);
+}
+
+static int _close(void* ctx, int fd)
+{
+  struct mem_transport* mt = (struct mem_transport*)ctx;
+  struct mem_fd* f = _fd(mt, fd);
+  int conn, next;
+
+  if (f == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (f->type == MEM_FD_LISTEN) {
+    /* refuse everything still waiting in the accept queue */
+    for (conn = f->head; conn != -1; conn = next) {
+      next = mt->fds[conn - MEM_FD_BASE].next;
+      _close_stream(mt, conn);
+    }
+    _free_fd(mt, fd);
+  }
+  else if (f->type == MEM_FD_STREAM) {
+    _close_stream(mt, fd);
+  }
+  else {
+    _free_fd(mt, fd);
+  }
+  return 0;
+}
+
+static int _fcntl(void* ctx, int fd, int cmd, int val)
+{
+  struct mem_fd* f = _fd((struct mem_transport*)ctx, fd);
+
+  if (f == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  switch (cmd) {
+  case F_GETFL: return f->fl;
+  case F_SETFL: f->fl = val; return 0;
+  default: errno = EINVAL; return -1;
+  }
+}
+
+static int _wakeup_open(void* ctx)
+{
+  return _alloc_fd((struct mem_transport*)ctx, MEM_FD_WAKEUP);
+}
+
+static int _wakeup_notify(void* ctx, int fd)
+{
+  struct mem_fd* f = _fd((struct mem_transport*)ctx, fd);
+
+  if (f == NULL || f->type != MEM_FD_WAKEUP) {
+    errno = EBADF;
+    return -1;
+  }
+  atomic_store(&f->notified, true);
+  return 0;
+}
+
+static void _wakeup_drain(void* ctx, int fd)
+{
+  struct mem_fd* f = _fd((struct mem_transport*)ctx, fd);
+
+  if (f != NULL && f->type == MEM_FD_WAKEUP) {
+    atomic_store(&f->notified, false);
+  }
+}
+
+static uint32_t _now(void* ctx)
+{
+  return ((struct mem_transport*)ctx)->now;
+}
+
+telnet_transport_t* telnet_mem_transport_create(int max_fds, size_t buffer_size, int flags)
+{
+  struct mem_transport* mt;
+
+  if (max_fds <= 0 || buffer_size == 0) {
+    return NULL;
+  }
+  if ((mt = (struct mem_transport*)calloc(1, sizeof(*mt))) == NULL) {
+    return NULL;
+  }
+  if ((mt->fds = (struct mem_fd*)calloc(max_fds, sizeof(*mt->fds))) == NULL) {
+    free(mt);
+    return NULL;
+  }
+
+  mt->max_fds = max_fds;
+  mt->buffer_size = buffer_size;
+  mt->flags = flags;
+  mt->vt.socket = _socket;
+  mt->vt.setsockopt = _setsockopt;
+  mt->vt.bind = _bind;
+  mt->vt.listen = _listen;
+  mt->vt.accept = _accept;
+  mt->vt.recv = _recv;
+  mt->vt.send = _send;
+  mt->vt.writev = _writev;
+  mt->vt.poll = _poll;
+  mt->vt.close = _close;
+  mt->vt.fcntl = _fcntl;
+  mt->vt.wakeup_open = _wakeup_open;
+  mt->vt.wakeup_notify = _wakeup_notify;
+  mt->vt.wakeup_drain = _wakeup_drain;
+  mt->vt.now = _now;
+  mt->vt.ctx = mt;
+  return &mt->vt;
+}
+
+void telnet_mem_transport_destroy(telnet_transport_t* tp)
+{
+  struct mem_transport* mt = (struct mem_transport*)tp;
+  int i;
+
+  if (mt == NULL) {
+    return;
+  }
+  for (i = 0; i != mt->max_fds; ++i) {
+    free(mt->fds[i].rx.data);
+  }
+  free(mt->fds);
+  free(mt->clients);
+  free(mt);
+}
+
+int telnet_mem_connect(telnet_transport_t* tp, uint16_t port)
+{
+  struct mem_transport* mt = (struct mem_transport*)tp;
+  struct mem_fd* listener = NULL;
+  struct mem_fd* c;
+  struct mem_fd* s;
+  int i, cfd, sfd;
+
+  for (i = 0; i != mt->max_fds; ++i) {
+    if (mt->fds[i].type == MEM_FD_LISTEN && (port == 0 || mt->fds[i].port == port)) {
+      listener = &mt->fds[i];
+      break;
+    }
+  }
+  if (listener == NULL || listener->pending >= listener->backlog) {
+    mt->stats.refused++;
+    errno = ECONNREFUSED;
+    return -1;
+  }
+
+  if ((cfd = _alloc_fd(mt, MEM_FD_STREAM)) == -1) {
+    return -1;
+  }
+  if ((sfd = _alloc_fd(mt, MEM_FD_STREAM)) == -1) {
+    _free_fd(mt, cfd);
+    return -1;
+  }
+
+  c = &mt->fds[cfd - MEM_FD_BASE];
+  s = &mt->fds[sfd - MEM_FD_BASE];
+  c->rx.data = (char*)malloc(mt->buffer_size);
+  s->rx.data = (char*)malloc(mt->buffer_size);
+  if (c->rx.data == NULL || s->rx.data == NULL) {
+    _free_fd(mt, cfd);
+    _free_fd(mt, sfd);
+    errno = ENOMEM;
+    return -1;
+  }
+  c->rx.size = s->rx.size = mt->buffer_size;
+  c->client = true;
+  c->peer = sfd;
+  s->peer = cfd;
+
+  /* queue the server end for accept() */
+  if (listener->tail == -1) {
+    listener->head = sfd;
+  }
+  else {
+    mt->fds[listener->tail - MEM_FD_BASE].next = sfd;
+  }
+  listener->tail = sfd;
+  listener->pending++;
+
+  mt->stats.connects++;
+  return cfd;
+}
+
+ssize_t telnet_mem_write(telnet_transport_t* tp, int client, const void* buffer, size_t size)
+{
+  return _deliver((struct mem_transport*)tp, client, buffer, size);
+}
+
+ssize_t telnet_mem_read(telnet_transport_t* tp, int client, void* buffer, size_t size)
+{
+  return _recv(tp, client, buffer, size, 0);
+}
+
+void telnet_mem_close(telnet_transport_t* tp, int client)
+{
+  _close(tp, client);
+}
+
+void telnet_mem_play(telnet_transport_t* tp, const telnet_mem_step_t* script, size_t count)
+{
+  struct mem_transport* mt = (struct mem_transport*)tp;
+
+  mt->script = script;
+  mt->script_len = count;
+  mt->script_pos = 0;
+}
+
+int telnet_mem_pending(telnet_transport_t* tp)
+{
+  struct mem_transport* mt = (struct mem_transport*)tp;
+  return mt->script_pos != mt->script_len;
+}
+
+int telnet_mem_client(telnet_transport_t* tp, uint32_t client)
+{
+  struct mem_transport* mt = (struct mem_transport*)tp;
+  return client < mt->max_clients ? mt->clients[client] : -1;
+}
+
+uint32_t telnet_mem_now(telnet_transport_t* tp)
+{
+  return ((struct mem_transport*)tp)->now;
+}
+
+void telnet_mem_advance(telnet_transport_t* tp, uint32_t ms)
+{
+  ((struct mem_transport*)tp)->now += ms;
+}
+
+void telnet_mem_stats(telnet_transport_t* tp, telnet_mem_stats_t* stats)
+{
+  *stats = ((struct mem_transport*)tp)->stats;
+}
@@ -1,6 +1,16 @@
 #include "common.h"
 #include "unity.h"
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <telnet/server.h>
+#include <telnet/transport_mem.h>
+
 void test_setup()
 {
   printf("Test setup complete.\n");
@@ -16,3 +26,1073 @@ TEST_CASE("telnet_server_create", "[telnet_server]")
   test_setup();
   test_teardown();
 }
+
+/**
+ * @brief Reads everything the server sent to a memory transport client into a string.
+ */
+static const char* test_read_all(telnet_transport_t* tp, int client)
+{
+  static char output[1024];
+  ssize_t rs;
+  size_t len = 0;
+
+  while (len < sizeof(output) - 1 && (rs = telnet_mem_read(tp, client, output + len, sizeof(output) - 1 - len)) > 0) {
+    len += rs;
+  }
+  output[len] = 0;
+  return output;
+}
+
+TEST_CASE("telnet_server login over memory transport", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  int client;
+
+  TEST_ASSERT_NOT_NULL(tp);
+  config.transport = tp;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_NOT_EQUAL(-1, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, client), "Enter name: "));
+
+  telnet_mem_write(tp, client, "alice\r\n", 7);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, client), "Welcome, alice!"));
+
+  /* nothing to do: the virtual clock jumps over the whole timeout */
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(1000));
+  TEST_ASSERT_EQUAL(1000, telnet_mem_now(tp));
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server reclaims slots of silent sessions", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  char byte;
+  int unnamed, silent, i;
+
+  config.transport = tp;
+  config.login_timeout_ms = 2500;
+  config.keepalive = TELNET_KEEPALIVE_TIMING_MARK;
+  config.keepalive_interval_ms = 1000;
+  config.keepalive_count = 0;
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, telnet_server_start(&config));
+  config.keepalive_count = 256;
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, telnet_server_start(&config));
+  config.keepalive_count = 2;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  unnamed = telnet_mem_connect(tp, config.port);
+  silent = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, unnamed);
+  test_read_all(tp, silent);
+  telnet_mem_write(tp, silent, "bob\r\n", 5);
+
+  /* the login deadline comes first, then two unanswered probes reclaim the other slot */
+  for (i = 0; i != 100 && telnet_mem_now(tp) < 2500; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(1000));
+  }
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, unnamed), "Login timeout."));
+  TEST_ASSERT_EQUAL(0, telnet_mem_read(tp, unnamed, &byte, 1));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, silent), "\xff\xfd\x06"));
+  TEST_ASSERT_EQUAL(-1, telnet_mem_read(tp, silent, &byte, 1));
+
+  /* the virtual clock skips the waits */
+  for (i = 0; i != 100 && telnet_mem_now(tp) < 3200; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(1000));
+  }
+  TEST_ASSERT_EQUAL(0, telnet_mem_read(tp, silent, &byte, 1));
+
+  telnet_mem_close(tp, unnamed);
+  telnet_mem_close(tp, silent);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server paces NOP keepalives on quiet sessions", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  const char* out;
+  int client, i, nops = 0;
+
+  config.transport = tp;
+  config.keepalive = TELNET_KEEPALIVE_NOP;
+  config.keepalive_interval_ms = 1000;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_write(tp, client, "bob\r\n", 5);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, client);
+
+  /* one NOP per interval, also after more probes than fit in a byte */
+  for (i = 0; i != 1000 && telnet_mem_now(tp) < 300000; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(1000));
+    for (out = test_read_all(tp, client); (out = strstr(out, "\xff\xf1")) != NULL; out += 2) {
+      nops++;
+    }
+  }
+  TEST_ASSERT_EQUAL(300, nops);
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server keeps timers running across the clock wrap", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  uint32_t start;
+  char byte;
+  int before, after, i;
+
+  /* 5 s before the millisecond clock wraps */
+  telnet_mem_advance(tp, UINT32_MAX - 4999);
+  config.transport = tp;
+  config.login_timeout_ms = 30000;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  before = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, before);
+  start = telnet_mem_now(tp);
+
+  /* a session opened 10 s after the wrap */
+  for (i = 0; i != 1000 && telnet_mem_now(tp) - start < 15000; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(100));
+  }
+  TEST_ASSERT_EQUAL(-1, telnet_mem_read(tp, before, &byte, 1));
+  after = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, after);
+
+  /* neither deadline fires early, both fire on time */
+  for (i = 0; i != 1000 && telnet_mem_now(tp) - start < 29900; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(100));
+  }
+  TEST_ASSERT_EQUAL(-1, telnet_mem_read(tp, before, &byte, 1));
+  for (i = 0; i != 1000 && telnet_mem_now(tp) - start < 30200; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(100));
+  }
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, before), "Login timeout."));
+  TEST_ASSERT_EQUAL(0, telnet_mem_read(tp, before, &byte, 1));
+  TEST_ASSERT_EQUAL(-1, telnet_mem_read(tp, after, &byte, 1));
+  for (i = 0; i != 1000 && telnet_mem_now(tp) - start < 45200; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(100));
+  }
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, after), "Login timeout."));
+  TEST_ASSERT_EQUAL(0, telnet_mem_read(tp, after, &byte, 1));
+
+  telnet_mem_close(tp, before);
+  telnet_mem_close(tp, after);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server absorbs a connect storm in one iteration", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(64, 1024, 0);
+  int clients[12];
+  int i, accepted = 0, rejected = 0;
+
+  config.transport = tp;
+  config.backlog = 12;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  for (i = 0; i != 12; ++i) {
+    clients[i] = telnet_mem_connect(tp, config.port);
+    TEST_ASSERT_NOT_EQUAL(-1, clients[i]);
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+
+  for (i = 0; i != 12; ++i) {
+    const char* output = test_read_all(tp, clients[i]);
+    accepted += strstr(output, "Enter name: ") != NULL;
+    rejected += strcmp(output, "Too many users.\r\n") == 0;
+    telnet_mem_close(tp, clients[i]);
+  }
+  TEST_ASSERT_EQUAL(config.max_connections, accepted);
+  TEST_ASSERT_EQUAL(12 - config.max_connections, rejected);
+
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server drains a bulk paste in one wakeup", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 16384, 0);
+  static char paste[8192];
+  int client;
+
+  config.transport = tp;
+  config.read_budget = sizeof(paste);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, client);
+
+  /* an overlong line followed by the name, far more than one recv() buffer */
+  memset(paste, 'x', sizeof(paste));
+  memcpy(paste + sizeof(paste) - 9, "\r\ncarol\r\n", 9);
+  TEST_ASSERT_EQUAL(sizeof(paste), telnet_mem_write(tp, client, paste, sizeof(paste)));
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, client), "Welcome, carol!"));
+
+  telnet_mem_close(tp, client);
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server queues output for slow readers", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 16, 0);
+  char output[64];
+  size_t len = 0;
+  ssize_t rs;
+  int client, i;
+
+  config.transport = tp;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_write(tp, client, "dave\r\n", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+
+  /* the client ring holds 16 bytes, the rest is flushed as the client makes room */
+  for (i = 0; i != 16 && len < sizeof(output) - 1; ++i) {
+    while ((rs = telnet_mem_read(tp, client, output + len, sizeof(output) - 1 - len)) > 0) {
+      len += rs;
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  }
+  output[len] = 0;
+  TEST_ASSERT_NOT_NULL(strstr(output, "Enter name: "));
+  TEST_ASSERT_NOT_NULL(strstr(output, "Welcome, dave!\r\n"));
+
+  telnet_mem_close(tp, client);
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+#if !CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+TEST_CASE("telnet_server sizes the session table from the runtime config", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(128, 256, 0);
+  int clients[3 * CONFIG_TELNET_SERVER_MAX_CONNECTIONS + 1];
+  int n = sizeof(clients) / sizeof(clients[0]);
+  int i, accepted = 0;
+
+  config.transport = tp;
+  config.max_connections = n - 1;
+  config.backlog = n;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  /* well above the Kconfig limit, the table grows in chunks */
+  for (i = 0; i != n; ++i) {
+    clients[i] = telnet_mem_connect(tp, config.port);
+    TEST_ASSERT_NOT_EQUAL(-1, clients[i]);
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+
+  for (i = 0; i != n; ++i) {
+    accepted += strstr(test_read_all(tp, clients[i]), "Enter name: ") != NULL;
+  }
+  TEST_ASSERT_EQUAL(n - 1, accepted);
+
+  /* freed sessions are reused */
+  telnet_mem_close(tp, clients[0]);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  clients[0] = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, clients[0]), "Enter name: "));
+
+  for (i = 0; i != n; ++i) {
+    telnet_mem_close(tp, clients[i]);
+  }
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+#endif
+
+static int test_warnings;
+static char test_data[64];
+
+static void test_static_events(telnet_t* telnet, telnet_event_t* ev, void* ud)
+{
+  if (ev->type == TELNET_EV_WARNING) {
+    test_warnings++;
+  }
+  else if (ev->type == TELNET_EV_DATA && ev->data.size < sizeof(test_data)) {
+    /* the last data event is enough */
+    memcpy(test_data, ev->data.buffer, ev->data.size);
+    test_data[ev->data.size] = 0;
+  }
+}
+
+TEST_CASE("telnet static tracker stays within its storage", "[telnet_server]")
+{
+  static telnet_static_t storage;
+  static char sb[TELNET_STATIC_BUFFER + 16];
+  telnet_t* telnet = telnet_init_static(&storage, default_telopts, test_static_events, 0, NULL);
+
+  /* a subnegotiation longer than the buffer is dropped with a warning instead of growing it */
+  memset(sb, 'x', sizeof(sb));
+  memcpy(sb, "\xff\xfa\x18", 3);
+  memcpy(sb + sizeof(sb) - 2, "\xff\xf0", 2);
+  test_warnings = 0;
+  test_data[0] = 0;
+  telnet_recv(telnet, sb, sizeof(sb));
+  telnet_recv(telnet, "hi", 2);
+  TEST_ASSERT_EQUAL(1, test_warnings);
+  TEST_ASSERT_EQUAL_STRING("hi", test_data);
+  telnet_free(telnet);
+}
+
+static void test_error_events(telnet_t* telnet, telnet_event_t* ev, void* ud)
+{
+  if (ev->type == TELNET_EV_WARNING) {
+    test_warnings++;
+    telnet_format_error(ev, test_data, sizeof(test_data));
+  }
+}
+
+TEST_CASE("telnet formats warnings on demand and skips masked ones", "[telnet_server]")
+{
+  telnet_t* telnet = telnet_init(default_telopts, test_error_events, 0, NULL);
+
+  test_warnings = 0;
+  telnet_recv(telnet, "\xff\xfa\x05x\xffx", 6);
+  TEST_ASSERT_EQUAL(1, test_warnings);
+  TEST_ASSERT_EQUAL_STRING("unexpected byte after IAC inside SB: 120", test_data);
+
+  /* masked codes never reach the handler, other codes still do */
+  telnet_mask_warnings(telnet, TELNET_WARN(TELNET_EPROTOCOL));
+  telnet_recv(telnet, "\xff\xfa\x05x\xffx", 6);
+  TEST_ASSERT_EQUAL(1, test_warnings);
+  telnet_mask_warnings(telnet, TELNET_WARN(TELNET_EOVERFLOW));
+  telnet_recv(telnet, "\xff\xfa\x27\x07\xff\xf0", 6);
+  TEST_ASSERT_EQUAL(2, test_warnings);
+  TEST_ASSERT_EQUAL_STRING("telopt 39 subneg has invalid command", test_data);
+  telnet_free(telnet);
+}
+
+static char test_log[2][512];
+static size_t test_log_len[2];
+
+/**
+ * @brief Appends every event type, and the payload of DATA, IAC and SUBNEGOTIATION events, to a log.
+ */
+static void test_log_events(telnet_t* telnet, telnet_event_t* ev, void* ud)
+{
+  int d = (int)(intptr_t)ud;
+  const char* payload = NULL;
+  size_t size = 0;
+  char cmd;
+
+  if (ev->type == TELNET_EV_DATA) {
+    payload = ev->data.buffer;
+    size = ev->data.size;
+  }
+  else if (ev->type == TELNET_EV_IAC) {
+    cmd = (char)ev->iac.cmd;
+    payload = &cmd;
+    size = 1;
+  }
+  else if (ev->type == TELNET_EV_SUBNEGOTIATION) {
+    payload = ev->sub.buffer;
+    size = ev->sub.size;
+  }
+  if (test_log_len[d] + 1 + size > sizeof(test_log[d])) {
+    return;
+  }
+  test_log[d][test_log_len[d]++] = (char)ev->type;
+  if (size > 0) {
+    memcpy(test_log[d] + test_log_len[d], payload, size);
+    test_log_len[d] += size;
+  }
+}
+
+TEST_CASE("telnet DFA decoder matches the switch decoder", "[telnet_server]")
+{
+  static const char stream[] = "ls\r\n\r\0x\ry\xff\xff\xff\xf1\xff\xfa\x18\x00vt\xff\xff\xff\xf0"
+                               "\xff\xfa\x18" "ab\xff\xf6" "after\r";
+  size_t i;
+  int d;
+
+  /* whole buffer and byte by byte must produce the same events */
+  for (d = 0; d != 2; ++d) {
+    telnet_t* whole = telnet_init(default_telopts, test_log_events, TELNET_FLAG_NVT_EOL | (d ? TELNET_FLAG_DFA : 0),
+                                  (void*)(intptr_t)d);
+
+    test_log_len[d] = 0;
+    telnet_recv(whole, stream, sizeof(stream) - 1);
+    telnet_free(whole);
+  }
+  TEST_ASSERT_EQUAL(test_log_len[0], test_log_len[1]);
+  TEST_ASSERT_EQUAL_MEMORY(test_log[0], test_log[1], test_log_len[0]);
+
+  for (d = 0; d != 2; ++d) {
+    telnet_t* bytes = telnet_init(default_telopts, test_log_events, TELNET_FLAG_NVT_EOL | (d ? TELNET_FLAG_DFA : 0),
+                                  (void*)(intptr_t)d);
+
+    test_log_len[d] = 0;
+    for (i = 0; i != sizeof(stream) - 1; ++i) {
+      telnet_recv(bytes, stream + i, 1);
+    }
+    telnet_free(bytes);
+  }
+  TEST_ASSERT_EQUAL(test_log_len[0], test_log_len[1]);
+  TEST_ASSERT_EQUAL_MEMORY(test_log[0], test_log[1], test_log_len[0]);
+}
+
+TEST_CASE("telnet translates NVT EOL in place", "[telnet_server]")
+{
+  char stream[] = "ls\r\nab\xff\xff" "c\r\0" "d\r\n\xff\xf1" "e\r";
+  telnet_t* telnet = telnet_init(default_telopts, test_log_events, TELNET_FLAG_NVT_EOL, (void*)(intptr_t)0);
+
+  /* one DATA event per span between commands, the CR at the end waits for the next byte */
+  test_log_len[0] = 0;
+  telnet_recv_inplace(telnet, stream, sizeof(stream) - 1);
+  TEST_ASSERT_EQUAL(15, test_log_len[0]);
+  TEST_ASSERT_EQUAL_MEMORY("\x00ls\nab\xff" "c\rd\n\x02\xf1\x00" "e", test_log[0], 15);
+
+  test_log_len[0] = 0;
+  telnet_recv_inplace(telnet, stream, 0);
+  telnet_recv(telnet, "\n", 1);
+  TEST_ASSERT_EQUAL(2, test_log_len[0]);
+  TEST_ASSERT_EQUAL_MEMORY("\x00\n", test_log[0], 2);
+  telnet_free(telnet);
+}
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+
+static char test_inflated[16384];
+static size_t test_inflated_len;
+static int test_data_events;
+
+static void test_inflate_events(telnet_t* telnet, telnet_event_t* ev, void* ud)
+{
+  if (ev->type == TELNET_EV_DATA && test_inflated_len + ev->data.size <= sizeof(test_inflated)) {
+    memcpy(test_inflated + test_inflated_len, ev->data.buffer, ev->data.size);
+    test_inflated_len += ev->data.size;
+    test_data_events++;
+  }
+}
+
+TEST_CASE("telnet inflates COMPRESS2 input inline", "[telnet_server]")
+{
+  static const telnet_telopt_t telopts[] = {{TELNET_TELOPT_COMPRESS2, TELNET_WONT, TELNET_DO}, {-1, 0, 0}};
+  static char plain[12000];
+  static unsigned char stream[16384];
+  z_stream z;
+  size_t len, i;
+  telnet_t* telnet;
+
+  /* "head" IAC SB COMPRESS2 IAC SE, a deflate stream, then plain "tail" again */
+  for (i = 0; i != sizeof(plain); ++i) {
+    plain[i] = (char)('a' + i % 26);
+  }
+  memcpy(stream, "head\xff\xfa\x56\xff\xf0", 9);
+  memset(&z, 0, sizeof(z));
+  TEST_ASSERT_EQUAL(Z_OK, deflateInit(&z, Z_DEFAULT_COMPRESSION));
+  z.next_in = (unsigned char*)plain;
+  z.avail_in = sizeof(plain);
+  z.next_out = stream + 9;
+  z.avail_out = sizeof(stream) - 9 - 4;
+  TEST_ASSERT_EQUAL(Z_STREAM_END, deflate(&z, Z_FINISH));
+  len = sizeof(stream) - 4 - z.avail_out;
+  deflateEnd(&z);
+  memcpy(stream + len, "tail", 4);
+  len += 4;
+
+  /* everything in one call: the decoder switches modes in place */
+  telnet = telnet_init(telopts, test_inflate_events, 0, NULL);
+  test_inflated_len = 0;
+  test_data_events = 0;
+  telnet_recv(telnet, (const char*)stream, len);
+  telnet_free(telnet);
+
+  TEST_ASSERT_EQUAL(4 + sizeof(plain) + 4, test_inflated_len);
+  TEST_ASSERT_EQUAL_MEMORY("head", test_inflated, 4);
+  TEST_ASSERT_EQUAL_MEMORY(plain, test_inflated + 4, sizeof(plain));
+  TEST_ASSERT_EQUAL_MEMORY("tail", test_inflated + 4 + sizeof(plain), 4);
+  TEST_ASSERT_EQUAL(2 + (sizeof(plain) + TELNET_INFLATE_BUFFER - 1) / TELNET_INFLATE_BUFFER, test_data_events);
+}
+#endif
+
+TEST_CASE("telnet_server frames the greeting in one writev", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  telnet_mem_stats_t before, after;
+  int client;
+
+  config.transport = tp;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, client);
+
+  /* text, name with an escaped IAC and CRLF leave in a single call */
+  telnet_mem_stats(tp, &before);
+  telnet_mem_write(tp, client, "a\xff\xff\r\n", 5);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_stats(tp, &after);
+  TEST_ASSERT_EQUAL(1, after.writes - before.writes);
+  TEST_ASSERT_EQUAL_STRING("Welcome, a\xff\xff!\r\n", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server sends all offers and the prompt in one segment", "[telnet_server]")
+{
+  static const char expected[] = "\xff\xfb\x56\xff\xfb\x5d\xff\xfd\x5d\xff\xfb\x46\xff\xfb\x27\xff\xfb\x18"
+                                 "Enter name: ";
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  telnet_mem_stats_t before, after;
+  int client;
+
+  config.transport = tp;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+  telnet_mem_stats(tp, &before);
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_stats(tp, &after);
+  TEST_ASSERT_EQUAL(1, after.writes - before.writes);
+#if CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  /* no COMPRESS2 without compression */
+  TEST_ASSERT_EQUAL_STRING(expected + 3, test_read_all(tp, client));
+#else
+  TEST_ASSERT_EQUAL_STRING(expected, test_read_all(tp, client));
+#endif
+
+  /* answers to the offers are absorbed without another round trip, the login goes on */
+  telnet_mem_write(tp, client, "\xff\xfd\x5d\xff\xfc\x5d\xff\xfe\x46" "bob\r\n", 14);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("Welcome, bob!\r\n", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server echoes keystrokes in character mode", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  telnet_mem_stats_t before, after;
+  int client;
+
+  config.transport = tp;
+  config.character_mode = 1;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, client), "\xff\xfb\x01\xff\xfb\x03" "Enter name: "));
+
+  /* before DO ECHO the client echoes itself */
+  telnet_mem_write(tp, client, "x", 1);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("", test_read_all(tp, client));
+
+  /* everything received at once is echoed in one write, before the reply to the line */
+  telnet_mem_write(tp, client, "\xff\xfd\x01\xff\xfd\x03", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_stats(tp, &before);
+  telnet_mem_write(tp, client, "\x7f\x7f" "bx\x7fo", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_stats(tp, &after);
+  TEST_ASSERT_EQUAL(1, after.writes - before.writes);
+  TEST_ASSERT_EQUAL_STRING("\b \bbx\b \bo", test_read_all(tp, client));
+
+  telnet_mem_write(tp, client, "b\r\0", 3);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("b\r\nWelcome, bob!\r\n", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server lets LINEMODE clients edit lines", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  telnet_mem_stats_t before, after;
+  int client;
+
+  config.transport = tp;
+  config.character_mode = 1;
+  config.linemode = 1;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, client), "\xff\xfb\x01\xff\xfb\x03\xff\xfd\x22" "Enter name: "));
+
+  /* accepted: the server asks for EDIT and TRAPSIG */
+  telnet_mem_write(tp, client, "\xff\xfd\x01\xff\xfd\x03\xff\xfb\x22", 9);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_MEMORY("\xff\xfa\x22\x01\x03\xff\xf0", test_read_all(tp, client), 7);
+
+  /* the acknowledged mode hands echo back to the client */
+  telnet_mem_write(tp, client, "\xff\xfa\x22\x01\x07\xff\xf0", 7);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("\xff\xfc\x01", test_read_all(tp, client));
+  telnet_mem_write(tp, client, "\xff\xfe\x01", 3);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+
+  /* a whole line arrives at once and is answered without echo */
+  telnet_mem_stats(tp, &before);
+  telnet_mem_write(tp, client, "bob\r\n", 5);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_stats(tp, &after);
+  TEST_ASSERT_EQUAL(1, after.writes - before.writes);
+  TEST_ASSERT_EQUAL_STRING("Welcome, bob!\r\n", test_read_all(tp, client));
+
+  /* leaving LINEMODE returns to server echo */
+  telnet_mem_write(tp, client, "\xff\xfc\x22", 3);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("\xff\xfe\x22\xff\xfb\x01", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server sends pre-encoded replies and the MOTD", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  telnet_mem_stats_t before, after;
+  static char motd[32];
+  int client;
+
+  /* encoded once, a buffer that is too small is left alone */
+  TEST_ASSERT_EQUAL(11, telnet_text_encode(motd, 4, "hi\n\xff\r!\n"));
+  TEST_ASSERT_EQUAL(0, motd[0]);
+  config.motd.data = motd;
+  config.motd.len = telnet_text_encode(motd, sizeof(motd), "hi\n\xff\r!\n");
+  TEST_ASSERT_EQUAL_MEMORY("hi\r\n\xff\xff\r\0!\r\n", motd, 11);
+
+  config.transport = tp;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, client);
+
+  /* the prompt after an invalid name is a single write */
+  telnet_mem_stats(tp, &before);
+  telnet_mem_write(tp, client, "\r\n", 2);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_stats(tp, &after);
+  TEST_ASSERT_EQUAL(1, after.writes - before.writes);
+  TEST_ASSERT_EQUAL_STRING("Invalid name. Enter name: ", test_read_all(tp, client));
+
+  /* a bare CR or LF in a name would reach the wire untranslated */
+  telnet_mem_write(tp, client, "x\r\0y\nz\r\n", 8);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("Invalid name. Enter name: ", test_read_all(tp, client));
+
+  telnet_mem_write(tp, client, "bob\r\n", 5);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("Welcome, bob!\r\nhi\r\n\xff\xff\r", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+/**
+ * @brief Remembers the id of the last session that logged in.
+ */
+static void test_on_session(telnet_session_id_t session, telnet_session_event_t event, const char* name, void* arg)
+{
+  *(telnet_session_id_t*)arg = event == TELNET_SESSION_LOGIN ? session : TELNET_SESSION_INVALID;
+}
+
+/**
+ * @brief Copies a string into a buffer for telnet_server_send().
+ */
+static char* test_buffer(const char* text)
+{
+  char* buffer = telnet_server_alloc(strlen(text));
+
+  TEST_ASSERT_NOT_NULL(buffer);
+  memcpy(buffer, text, strlen(text));
+  return buffer;
+}
+
+TEST_CASE("telnet_server delivers buffers queued by other tasks", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  telnet_session_id_t session = TELNET_SESSION_INVALID;
+  telnet_session_id_t closed;
+  int client, other;
+
+  config.transport = tp;
+  config.send_queue_size = 2;
+  config.on_session = test_on_session;
+  config.session_arg = &session;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  client = telnet_mem_connect(tp, config.port);
+  other = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_write(tp, client, "erin\r\n", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_EQUAL(TELNET_SESSION_INVALID, session);
+  test_read_all(tp, client);
+  test_read_all(tp, other);
+
+  /* the producer picks drop on overflow */
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_send(session, test_buffer("temp=21\n"), 8, 0));
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_broadcast(test_buffer("alarm\n"), 6, 0));
+  TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, telnet_server_send(session, test_buffer("lost\n"), 5, 0));
+
+  /* the wakeup descriptor ends the poll before the clock moves */
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(1000));
+  TEST_ASSERT_EQUAL(0, telnet_mem_now(tp));
+  TEST_ASSERT_EQUAL_STRING("temp=21\r\nalarm\r\n", test_read_all(tp, client));
+  TEST_ASSERT_EQUAL_STRING("", test_read_all(tp, other));
+
+  /* ids of closed sessions are not reused */
+  closed = session;
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL(TELNET_SESSION_INVALID, session);
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_write(tp, client, "erin\r\n", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_EQUAL(closed, session);
+  test_read_all(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_send(closed, test_buffer("stale\n"), 6, 0));
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  telnet_mem_close(tp, other);
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server fans channel messages out to subscribers only", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 64, 0);
+  telnet_channel_id_t temp = telnet_server_channel("temp", TELNET_DROP_OLDEST);
+  static char received[256];
+  char line[8];
+  int op, other, i;
+
+  TEST_ASSERT_NOT_EQUAL(TELNET_CHANNEL_INVALID, temp);
+  TEST_ASSERT_EQUAL(temp, telnet_server_channel("temp", TELNET_DROP_OLDEST));
+  config.transport = tp;
+  config.channel_queue_len = 2;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  op = telnet_mem_connect(tp, config.port);
+  other = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_write(tp, op, "op\r\n", 4);
+  telnet_mem_write(tp, other, "other\r\n", 7);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, op);
+  test_read_all(tp, other);
+
+  telnet_mem_write(tp, op, "/join temp\r\n", 12);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("Joined temp.\r\n", test_read_all(tp, op));
+
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_publish(temp, test_buffer("t=21\n"), 5, 0));
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("t=21\r\n", test_read_all(tp, op));
+  TEST_ASSERT_EQUAL_STRING("", test_read_all(tp, other));
+
+  /* the subscriber stops reading: its socket fills up, then only the newest messages are kept;
+   * published in batches that fit the default send queue, which static allocation cannot exceed */
+  for (i = 0; i != 40; ++i) {
+    snprintf(line, sizeof(line), "m%02d\n", i);
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_publish(temp, test_buffer(line), 4, 0));
+    if (i % 20 == 19) {
+      TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+    }
+  }
+  received[0] = 0;
+  for (i = 0; i != 8; ++i) {
+    strcat(received, test_read_all(tp, op));
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  }
+  TEST_ASSERT_NOT_NULL(strstr(received, "m00\r\n"));
+  TEST_ASSERT_NULL(strstr(received, "m37\r\n"));
+  TEST_ASSERT_NOT_NULL(strstr(received, "m38\r\nm39\r\n"));
+
+  telnet_mem_write(tp, op, "/leave temp\r\n", 13);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("Left temp.\r\n", test_read_all(tp, op));
+
+  telnet_mem_close(tp, op);
+  telnet_mem_close(tp, other);
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server measures round trips with TIMING-MARK", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  telnet_session_id_t session = TELNET_SESSION_INVALID;
+  telnet_session_stats_t stats;
+  int client;
+
+  config.transport = tp;
+  config.rtt_interval_ms = 1000;
+  config.on_session = test_on_session;
+  config.session_arg = &session;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_NULL(strstr(test_read_all(tp, client), "\xff\xfd\x06"));
+  telnet_mem_write(tp, client, "bob\r\n", 5);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, client);
+
+  /* the request sent with the offers is answered 30 ms later */
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(30));
+  telnet_mem_write(tp, client, "\xff\xfb\x06", 3);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_session_stats(session, &stats));
+  TEST_ASSERT_EQUAL(1, stats.rtt_samples);
+  TEST_ASSERT_EQUAL(30, stats.rtt_ms);
+  TEST_ASSERT_EQUAL(15, stats.rtt_var_ms);
+
+  /* the next one goes out after the interval, a refusal counts as an answer */
+  while (strstr(test_read_all(tp, client), "\xff\xfd\x06") == NULL) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(1000));
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(50));
+  telnet_mem_write(tp, client, "\xff\xfc\x06", 3);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(0));
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_session_stats(session, &stats));
+  TEST_ASSERT_EQUAL(2, stats.rtt_samples);
+  TEST_ASSERT_EQUAL(50, stats.rtt_last_ms);
+  TEST_ASSERT_EQUAL(32, stats.rtt_ms);
+  TEST_ASSERT_EQUAL(16, stats.rtt_var_ms);
+
+  /* on demand */
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_measure_rtt(session));
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(0));
+  TEST_ASSERT_EQUAL_STRING("\xff\xfd\x06", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, telnet_server_session_stats(session, &stats));
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+static atomic_bool test_stopped;
+
+static void test_cmd_echo(telnet_cmd_t* cmd, const char* args, void* arg)
+{
+  telnet_cmd_printf(cmd, "%s\n", args);
+}
+
+/**
+ * @brief Runs until cancelled, like a flash dump or a Wi-Fi scan.
+ */
+static void test_cmd_dump(telnet_cmd_t* cmd, const char* args, void* arg)
+{
+  int i;
+
+  telnet_cmd_printf(cmd, "dumping\n");
+  for (i = 0; i != 2000 && !telnet_cmd_cancelled(cmd); ++i) {
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  atomic_store(&test_stopped, telnet_cmd_cancelled(cmd));
+}
+
+static int test_lines_pulled;
+
+/**
+ * @brief Generates numbered lines, one chunk per call.
+ */
+static size_t test_next_line(void* state, char* buffer, size_t size)
+{
+  int* line = (int*)state;
+
+  if (*line == 2000) {
+    return 0;
+  }
+  test_lines_pulled++;
+  return snprintf(buffer, size, "line %04d\n", (*line)++);
+}
+
+static void test_cmd_log(telnet_cmd_t* cmd, const char* args, void* arg)
+{
+  static int line;
+
+  line = 0;
+  test_lines_pulled = 0;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_cmd_stream(cmd, test_next_line, NULL, &line));
+}
+
+static const telnet_command_t test_commands[] = {
+  {"echo", test_cmd_echo, NULL, false},
+  {"dump", test_cmd_dump, NULL, true},
+  {"log", test_cmd_log, NULL, false},
+  {NULL, NULL, NULL, false},
+};
+
+/**
+ * @brief Polls the server until a client received `expected`, gives worker tasks time to run.
+ */
+static const char* test_poll_for(telnet_transport_t* tp, int client, const char* expected)
+{
+  static char received[256];
+  int i;
+
+  received[0] = 0;
+  for (i = 0; i != 500 && strstr(received, expected) == NULL; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+    strncat(received, test_read_all(tp, client), sizeof(received) - strlen(received) - 1);
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  return received;
+}
+
+TEST_CASE("telnet_server runs async commands on workers and cancels them", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  int client, i;
+
+  config.transport = tp;
+  config.commands = test_commands;
+  config.workers = 1;
+  atomic_store(&test_stopped, false);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_write(tp, client, "frank\r\n", 7);
+  TEST_ASSERT_NOT_NULL(strstr(test_poll_for(tp, client, "Welcome"), "Welcome, frank!"));
+
+  telnet_mem_write(tp, client, "echo hi\r\n", 9);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("hi\r\n", test_read_all(tp, client));
+  telnet_mem_write(tp, client, "nope\r\n", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("Unknown command.\r\n", test_read_all(tp, client));
+
+  /* the loop keeps serving the session while the command runs */
+  telnet_mem_write(tp, client, "dump\r\n", 6);
+  TEST_ASSERT_NOT_NULL(strstr(test_poll_for(tp, client, "dumping"), "dumping\r\n"));
+  telnet_mem_write(tp, client, "echo again\r\n", 12);
+  TEST_ASSERT_NOT_NULL(strstr(test_poll_for(tp, client, "running"), "Command still running"));
+
+  /* Ctrl-C */
+  telnet_mem_write(tp, client, "\xff\xf4", 2);
+  for (i = 0; i != 500 && !atomic_load(&test_stopped); ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+    vTaskDelay(pdMS_TO_TICKS(1));
+  }
+  TEST_ASSERT_TRUE(atomic_load(&test_stopped));
+
+  telnet_mem_write(tp, client, "echo done\r\n", 11);
+  TEST_ASSERT_NOT_NULL(strstr(test_poll_for(tp, client, "done"), "done\r\n"));
+
+  telnet_mem_close(tp, client);
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
+
+TEST_CASE("telnet_server pulls streamed output as the client drains it", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 256, 0);
+  char chunk[12];
+  ssize_t rs;
+  size_t total = 0, len = 0;
+  int client, i, expected = 0;
+
+  config.transport = tp;
+  config.commands = test_commands;
+  config.output_low_water = 512;
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  client = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  telnet_mem_write(tp, client, "gina\r\n", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  test_read_all(tp, client);
+
+  /* 22 KB of output, but the client does not read yet */
+  telnet_mem_write(tp, client, "log\r\n", 5);
+  for (i = 0; i != 10; ++i) {
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  }
+  TEST_ASSERT_TRUE(test_lines_pulled > 0);
+  TEST_ASSERT_TRUE(test_lines_pulled * 11 <= 256 + 512 + 11);
+
+  /* lines arrive complete and in order while the client drains them */
+  for (i = 0; i != 10000 && expected != 2000; ++i) {
+    while ((rs = telnet_mem_read(tp, client, chunk + len, 11 - len)) > 0) {
+      total += rs;
+      if ((len += rs) == 11) {
+        TEST_ASSERT_EQUAL(expected, atoi(chunk + 5));
+        expected++;
+        len = 0;
+      }
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  }
+  TEST_ASSERT_EQUAL(2000, expected);
+  TEST_ASSERT_EQUAL(2000 * 11, total);
+
+  /* the session accepts commands again */
+  telnet_mem_write(tp, client, "echo ok\r\n", 9);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_EQUAL_STRING("ok\r\n", test_read_all(tp, client));
+
+  telnet_mem_close(tp, client);
+  telnet_server_poll(10);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
@@ -0,0 +1,71 @@
+#include "common.h"
+#include "unity.h"
+
+#include <string>
+
+#include <telnet/server.hpp>
+#include <telnet/transport_mem.h>
+
+namespace {
+
+struct TestOptions : telnet::DefaultOptions {
+  static constexpr int max_sessions = 2;
+  static constexpr bool compression = false;
+};
+
+using TestServer = telnet::TelnetServer<TestOptions>;
+
+/* the table and configuration are compile-time constants */
+static_assert(TestServer::telopts.size() == 5, "COMPRESS2 is removed, the terminator is added");
+static_assert(TestServer::telopts.back().telopt == -1, "table is terminated");
+static_assert(TestServer::defaults.max_connections == 2, "sizes come from the options");
+static_assert(TestServer::defaults.motd.data == nullptr, "no MOTD by default");
+
+/* text is NVT encoded by the compiler */
+constexpr auto test_text = telnet::nvt_encode("a\nb\r\xff");
+static_assert(test_text.len == 8 && test_text.data[1] == '\r' && test_text.data[5] == 0 && test_text.data[7] == '\xff',
+              "LF, CR and IAC are encoded");
+
+std::string test_read_all(telnet_transport_t* tp, int client)
+{
+  std::string output;
+  char buffer[256];
+  ssize_t rs;
+
+  while ((rs = telnet_mem_read(tp, client, buffer, sizeof(buffer))) > 0) {
+    output.append(buffer, rs);
+  }
+  return output;
+}
+
+} // namespace
+
+TEST_CASE("TelnetServer applies compile-time options", "[telnet_server]")
+{
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  TestServer server;
+  std::string output;
+  int clients[3];
+
+  server.config().transport = tp;
+  TEST_ASSERT_EQUAL(ESP_OK, server.start());
+
+  for (int& client : clients) {
+    client = telnet_mem_connect(tp, TestOptions::port);
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, server.poll(10));
+
+  /* compression is not offered, the third client exceeds max_sessions */
+  output = test_read_all(tp, clients[0]);
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, output.find("Enter name: "));
+  TEST_ASSERT_EQUAL(std::string::npos, output.find("\xff\xfb\x56"));
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, test_read_all(tp, clients[1]).find("Enter name: "));
+  TEST_ASSERT_EQUAL_STRING("Too many users.\r\n", test_read_all(tp, clients[2]).c_str());
+
+  for (int client : clients) {
+    telnet_mem_close(tp, client);
+  }
+  server.poll(10);
+  server.stop();
+  telnet_mem_transport_destroy(tp);
+}
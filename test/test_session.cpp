@@ -0,0 +1,92 @@
+#include "common.h"
+#include "unity.h"
+
+#include <string>
+
+#include <telnet/server.h>
+#include <telnet/session.hpp>
+#include <telnet/transport_mem.h>
+
+/**
+ * @brief Reads everything the server sent to a memory transport client.
+ */
+static std::string test_read_all(telnet_transport_t* tp, int client)
+{
+  std::string output;
+  char buffer[256];
+  ssize_t rs;
+
+  while ((rs = telnet_mem_read(tp, client, buffer, sizeof(buffer))) > 0) {
+    output.append(buffer, rs);
+  }
+  return output;
+}
+
+/**
+ * @brief Setup wizard: asks for a name until a free one is given, then for a confirmation.
+ */
+static telnet::Task test_wizard(telnet::Session& session)
+{
+  std::string name;
+
+  do {
+    co_await session.write("Name? ");
+    name = co_await session.read_line();
+  } while (session.login(name) != ESP_OK);
+
+  co_await session.write("Save " + name + " (y/n)? ");
+  while (true) {
+    std::string answer = co_await session.read_line();
+    if (answer == "y") {
+      co_await session.write("Saved.\n");
+      co_return;
+    }
+    co_await session.write("Not saved, (y/n)? ");
+  }
+}
+
+TEST_CASE("telnet_server runs coroutine sessions on the server task", "[telnet_server]")
+{
+  telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+  telnet_transport_t* tp = telnet_mem_transport_create(16, 1024, 0);
+  std::string output;
+  char byte;
+  int first, second;
+
+  config.transport = tp;
+  config.handler = telnet::coroutine_handler<test_wizard>();
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_start(&config));
+
+  first = telnet_mem_connect(tp, config.port);
+  second = telnet_mem_connect(tp, config.port);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, test_read_all(tp, first).find("Name? "));
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, test_read_all(tp, second).find("Name? "));
+
+  /* each session suspends in its own frame, the second one asks again for a taken name */
+  telnet_mem_write(tp, first, "ann\r\n", 5);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, test_read_all(tp, first).find("Save ann (y/n)? "));
+  telnet_mem_write(tp, second, "ann\r\nbo\r\n", 9);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  output = test_read_all(tp, second);
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, output.find("Name? "));
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, output.find("Save bo (y/n)? "));
+
+  telnet_mem_write(tp, first, "n\r\ny\r\n", 6);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+  output = test_read_all(tp, first);
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, output.find("Not saved"));
+  TEST_ASSERT_NOT_EQUAL(std::string::npos, output.find("Saved.\r\n"));
+
+  /* returning from the coroutine closed the session */
+  TEST_ASSERT_EQUAL(0, telnet_mem_read(tp, first, &byte, 1));
+
+  /* closing a session destroys its suspended coroutine */
+  telnet_mem_close(tp, second);
+  TEST_ASSERT_EQUAL(ESP_OK, telnet_server_poll(10));
+
+  telnet_mem_close(tp, first);
+  telnet_server_stop();
+  telnet_mem_transport_destroy(tp);
+}
@@ -0,0 +1,477 @@
+/**
+ * @file telnet_dfa_bench.c
+ * @brief Validates and benchmarks the table-driven libtelnet decoder (TELNET_FLAG_DFA).
+ *
+ * Generates random Telnet input streams (text, NVT line endings, escaped IACs, commands,
+ * negotiations including BINARY, well-formed and broken subnegotiations) and feeds every
+ * stream to two trackers, one per decoder, in the same random chunks. All events, including
+ * the replies the trackers send, are serialized and compared byte for byte. The check runs
+ * for every combination of TELNET_FLAG_NVT_EOL and TELNET_FLAG_PROXY. The switch decoder also
+ * runs on copies of the chunks with telnet_recv_inplace(), which emits fewer DATA events: its
+ * log must match the reference once consecutive DATA events are merged on both sides.
+ *
+ * After validation both decoders, and telnet_recv_inplace(), are timed on a chat-like stream in
+ * TCP-sized chunks and the throughput and number of DATA events are reported. The exit status is non-zero on the first mismatch.
+ *
+ * Build on the host:
+ *
+ *   cc -O2 -Isrc -o telnet_dfa_bench tools/telnet_dfa_bench.c src/libtelnet.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libtelnet.h>
+
+/**
+ * @brief Size of a TCP segment, used as chunk size for the benchmark.
+ */
+#define BENCH_CHUNK 1460
+
+/**
+ * @brief Growable byte log of serialized events.
+ */
+struct event_log {
+  unsigned char* data;
+  size_t len;
+  size_t cap;
+  int merge;        /*!< append DATA to a directly preceding DATA record */
+  size_t last_data; /*!< offset of the size of the last record if it is DATA, else 0 */
+};
+
+static struct {
+  int iterations;
+  int stream_bytes;
+  int bench_mb;
+  uint64_t seed;
+} opts = {
+  .iterations = 200,
+  .stream_bytes = 16384,
+  .bench_mb = 64,
+  .seed = 1,
+};
+
+static const telnet_telopt_t telopts[] = {
+  {TELNET_TELOPT_BINARY, TELNET_WILL, TELNET_DO},    {TELNET_TELOPT_ECHO, TELNET_WILL, TELNET_DONT},
+  {TELNET_TELOPT_SGA, TELNET_WILL, TELNET_DO},       {TELNET_TELOPT_TTYPE, TELNET_WONT, TELNET_DO},
+  {TELNET_TELOPT_NEW_ENVIRON, TELNET_WONT, TELNET_DO}, {TELNET_TELOPT_ZMP, TELNET_WILL, TELNET_DO},
+  {TELNET_TELOPT_MSSP, TELNET_WILL, TELNET_DONT},    {-1, 0, 0},
+};
+
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)rng_state;
+}
+
+static void log_put(struct event_log* log, const void* data, size_t size)
+{
+  if (log->len + size > log->cap) {
+    size_t cap = log->cap ? log->cap : 4096;
+
+    while (cap < log->len + size) {
+      cap *= 2;
+    }
+    if ((log->data = realloc(log->data, cap)) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+    log->cap = cap;
+  }
+  memcpy(log->data + log->len, data, size);
+  log->len += size;
+}
+
+static void log_bytes(struct event_log* log, const char* data, size_t size)
+{
+  log_put(log, &size, sizeof(size));
+  log_put(log, data, size);
+}
+
+static void log_string(struct event_log* log, const char* text)
+{
+  log_bytes(log, text ? text : "", text ? strlen(text) : 0);
+}
+
+static void log_environ(struct event_log* log, const struct telnet_environ_t* values, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i != size; ++i) {
+    log_put(log, &values[i].type, 1);
+    log_string(log, values[i].var);
+    log_string(log, values[i].value);
+  }
+}
+
+/**
+ * @brief Serializes an event, the source line of warnings differs between decoders and is left out.
+ */
+static void record_event(telnet_t* telnet, telnet_event_t* ev, void* ud)
+{
+  struct event_log* log = (struct event_log*)ud;
+  unsigned char type = (unsigned char)ev->type;
+  char msg[128];
+  size_t i;
+
+  (void)telnet;
+
+  if (ev->type == TELNET_EV_DATA && log->merge) {
+    if (log->last_data != 0) {
+      size_t size;
+
+      memcpy(&size, log->data + log->last_data, sizeof(size));
+      size += ev->data.size;
+      memcpy(log->data + log->last_data, &size, sizeof(size));
+      log_put(log, ev->data.buffer, ev->data.size);
+      return;
+    }
+    log->last_data = log->len + 1;
+  }
+  else {
+    log->last_data = 0;
+  }
+
+  log_put(log, &type, 1);
+  switch (ev->type) {
+  case TELNET_EV_DATA:
+  case TELNET_EV_SEND: log_bytes(log, ev->data.buffer, ev->data.size); break;
+  case TELNET_EV_SENDV:
+    for (i = 0; i != (size_t)ev->sendv.iovcnt; ++i) {
+      log_bytes(log, ev->sendv.iov[i].iov_base, ev->sendv.iov[i].iov_len);
+    }
+    break;
+  case TELNET_EV_IAC: log_put(log, &ev->iac.cmd, 1); break;
+  case TELNET_EV_WILL:
+  case TELNET_EV_WONT:
+  case TELNET_EV_DO:
+  case TELNET_EV_DONT: log_put(log, &ev->neg.telopt, 1); break;
+  case TELNET_EV_SUBNEGOTIATION:
+    log_put(log, &ev->sub.telopt, 1);
+    log_bytes(log, ev->sub.buffer, ev->sub.size);
+    break;
+  case TELNET_EV_COMPRESS: log_put(log, &ev->compress.state, 1); break;
+  case TELNET_EV_ZMP:
+    for (i = 0; i != ev->zmp.argc; ++i) {
+      log_string(log, ev->zmp.argv[i]);
+    }
+    break;
+  case TELNET_EV_TTYPE:
+    log_put(log, &ev->ttype.cmd, 1);
+    log_string(log, ev->ttype.name);
+    break;
+  case TELNET_EV_ENVIRON:
+    log_put(log, &ev->environ.cmd, 1);
+    log_environ(log, ev->environ.values, ev->environ.size);
+    break;
+  case TELNET_EV_MSSP: log_environ(log, ev->mssp.values, ev->mssp.size); break;
+  case TELNET_EV_LINEMODE:
+    log_put(log, &ev->linemode.cmd, 1);
+    log_put(log, &ev->linemode.mode, 1);
+    log_bytes(log, ev->linemode.data, ev->linemode.size);
+    break;
+  case TELNET_EV_WARNING:
+  case TELNET_EV_ERROR:
+    telnet_format_error(ev, msg, sizeof(msg));
+    log_string(log, msg);
+    break;
+  }
+}
+
+/**
+ * @brief Counts DATA events of a benchmark run.
+ */
+static void count_event(telnet_t* telnet, telnet_event_t* ev, void* ud)
+{
+  (void)telnet;
+
+  if (ev->type == TELNET_EV_DATA) {
+    ++*(size_t*)ud;
+  }
+}
+
+static void put(unsigned char** p, const char* data, size_t size)
+{
+  memcpy(*p, data, size);
+  *p += size;
+}
+
+/**
+ * @brief Appends one random token to `p`, at most 64 bytes.
+ */
+static void generate_token(unsigned char** p)
+{
+  static const unsigned char commands[] = {TELNET_NOP, TELNET_AYT, TELNET_IP, TELNET_BREAK, TELNET_GA, TELNET_SE};
+  static const unsigned char negotiations[] = {TELNET_WILL, TELNET_WONT, TELNET_DO, TELNET_DONT};
+  static const unsigned char options[] = {TELNET_TELOPT_BINARY, TELNET_TELOPT_ECHO, TELNET_TELOPT_SGA,
+                                          TELNET_TELOPT_TTYPE,  TELNET_TELOPT_NAWS, TELNET_TELOPT_LINEMODE};
+  unsigned char token[3];
+  int i, n;
+
+  switch (rng() % 12) {
+  case 0:
+  case 1:
+  case 2:
+    /* text */
+    for (n = 1 + rng() % 40, i = 0; i != n; ++i) {
+      *(*p)++ = (unsigned char)(' ' + rng() % 95);
+    }
+    break;
+  case 3: put(p, "\r\n", 2); break;
+  case 4: put(p, "\r\0", 2); break;
+  case 5:
+    /* bare CR followed by anything, including another CR or IAC */
+    *(*p)++ = '\r';
+    *(*p)++ = (unsigned char)rng();
+    break;
+  case 6: put(p, "\xff\xff", 2); break;
+  case 7:
+    token[0] = TELNET_IAC;
+    token[1] = commands[rng() % sizeof(commands)];
+    put(p, (const char*)token, 2);
+    break;
+  case 8:
+    token[0] = TELNET_IAC;
+    token[1] = negotiations[rng() % sizeof(negotiations)];
+    token[2] = options[rng() % sizeof(options)];
+    put(p, (const char*)token, 3);
+    break;
+  case 9:
+    switch (rng() % 4) {
+    case 0: put(p, "\xff\xfa\x18\x00vt100\xff\xf0", 10); break;
+    case 1: put(p, "\xff\xfa\x27\x00\x00USER\x01" "ann\xff\xf0", 14); break;
+    case 2: put(p, "\xff\xfa\x5d" "zmp.ping\0\xff\xf0", 14); break;
+    default: put(p, "\xff\xfa\x46\x01" "NAME\x02" "esp\xff\xf0", 14); break;
+    }
+    break;
+  case 10:
+    /* subnegotiation with an escaped IAC and random payload */
+    put(p, "\xff\xfa\x1f", 3);
+    for (n = rng() % 8, i = 0; i != n; ++i) {
+      *(*p)++ = (unsigned char)rng();
+      if ((*p)[-1] == TELNET_IAC) {
+        *(*p)++ = TELNET_IAC;
+      }
+    }
+    put(p, "\xff\xff\xff\xf0", 4);
+    break;
+  default:
+    /* broken subnegotiation: IAC followed by a command other than SE */
+    put(p, "\xff\xfa\x18" "ab\xff", 6);
+    *(*p)++ = (unsigned char)(rng() % 2 ? TELNET_DO : TELNET_NOP);
+    *(*p)++ = TELNET_TELOPT_ECHO;
+    break;
+  }
+}
+
+/**
+ * @brief Fills `buffer` with a random stream, returns its length.
+ */
+static size_t generate_stream(unsigned char* buffer, size_t size)
+{
+  unsigned char* p = buffer;
+
+  while ((size_t)(p - buffer) + 64 <= size) {
+    generate_token(&p);
+  }
+  return (size_t)(p - buffer);
+}
+
+/**
+ * @brief Decodes `stream` with both decoders in the same random chunks and compares the events.
+ */
+static int validate(const unsigned char* stream, size_t size, unsigned char flags, uint64_t chunk_seed)
+{
+  struct event_log logs[4] = {{0}};
+  char chunk[64];
+  size_t pos, n;
+  int d, rs;
+
+  /* 0: switch, 1: DFA, 2: switch merged, 3: in place merged */
+  logs[2].merge = logs[3].merge = 1;
+  for (d = 0; d != 4; ++d) {
+    telnet_t* telnet = telnet_init(telopts, record_event, flags | (d == 1 ? TELNET_FLAG_DFA : 0), &logs[d]);
+
+    rng_state = chunk_seed;
+    for (pos = 0; pos != size; pos += n) {
+      n = 1 + rng() % sizeof(chunk);
+      if (n > size - pos) {
+        n = size - pos;
+      }
+      if (d == 3) {
+        memcpy(chunk, stream + pos, n);
+        telnet_recv_inplace(telnet, chunk, n);
+      }
+      else {
+        telnet_recv(telnet, (const char*)stream + pos, n);
+      }
+    }
+    telnet_free(telnet);
+  }
+
+  rs = 0;
+  for (d = 0; d != 4; d += 2) {
+    if (logs[d].len != logs[d + 1].len || memcmp(logs[d].data, logs[d + 1].data, logs[d].len) != 0) {
+      rs = -1;
+    }
+  }
+  for (d = 0; d != 4; ++d) {
+    free(logs[d].data);
+  }
+  return rs;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Decodes `stream` repeatedly until `total` bytes went through, returns MB/s.
+ *
+ * With `inplace` every chunk is copied into a receive buffer first, like a server does with recv().
+ */
+static double bench(const unsigned char* stream, size_t size, unsigned char flags, int inplace, size_t total,
+                    size_t* events)
+{
+  char chunk[BENCH_CHUNK];
+  size_t decoded = 0, pos, n;
+  telnet_t* telnet = telnet_init(telopts, count_event, flags, events);
+  uint64_t start = now_ns();
+
+  *events = 0;
+  while (decoded < total) {
+    for (pos = 0; pos != size; pos += n) {
+      n = size - pos < BENCH_CHUNK ? size - pos : BENCH_CHUNK;
+      if (inplace) {
+        memcpy(chunk, stream + pos, n);
+        telnet_recv_inplace(telnet, chunk, n);
+      }
+      else {
+        telnet_recv(telnet, (const char*)stream + pos, n);
+      }
+    }
+    decoded += size;
+  }
+  telnet_free(telnet);
+  return (double)decoded / 1e6 / ((double)(now_ns() - start) / 1e9);
+}
+
+static void usage(const char* argv0)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --iterations N       random streams per flag combination (200)\n"
+          "  --stream-bytes N     size of each random stream (16384)\n"
+          "  --bench-mb N         megabytes decoded per benchmark run (64)\n"
+          "  --seed N             random seed (1)\n",
+          argv0);
+}
+
+static int parse_options(int argc, char** argv)
+{
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (val == NULL) {
+      return -1;
+    }
+    if (strcmp(arg, "--iterations") == 0) {
+      opts.iterations = atoi(val);
+    }
+    else if (strcmp(arg, "--stream-bytes") == 0) {
+      opts.stream_bytes = atoi(val);
+    }
+    else if (strcmp(arg, "--bench-mb") == 0) {
+      opts.bench_mb = atoi(val);
+    }
+    else if (strcmp(arg, "--seed") == 0) {
+      opts.seed = strtoull(val, NULL, 0);
+    }
+    else {
+      return -1;
+    }
+    ++i;
+  }
+
+  return opts.iterations >= 0 && opts.stream_bytes >= 64 && opts.bench_mb >= 0 && opts.seed != 0 ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+  static const unsigned char flag_sets[] = {0, TELNET_FLAG_NVT_EOL, TELNET_FLAG_PROXY,
+                                            TELNET_FLAG_NVT_EOL | TELNET_FLAG_PROXY};
+  unsigned char* stream;
+  unsigned char* p;
+  uint64_t stream_seed, chunk_seed;
+  size_t size, total;
+  int f, i;
+
+  if (parse_options(argc, argv) == -1) {
+    usage(argv[0]);
+    return 2;
+  }
+  if ((stream = malloc((size_t)opts.stream_bytes)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+
+  for (f = 0; f != (int)sizeof(flag_sets); ++f) {
+    for (i = 0; i != opts.iterations; ++i) {
+      stream_seed = opts.seed + (uint64_t)i * 2654435761u;
+      chunk_seed = stream_seed ^ 0x9e3779b97f4a7c15ull;
+      rng_state = stream_seed;
+      size = generate_stream(stream, (size_t)opts.stream_bytes);
+      if (validate(stream, size, flag_sets[f], chunk_seed) == -1) {
+        printf("MISMATCH flags=0x%02x seed=%llu\n", flag_sets[f], (unsigned long long)stream_seed);
+        free(stream);
+        return 1;
+      }
+    }
+    printf("flags=0x%02x: %d streams, identical events\n", flag_sets[f], opts.iterations);
+  }
+
+  /* chat-like traffic: mostly text lines, a few commands */
+  rng_state = opts.seed;
+  for (p = stream; (size_t)(p - stream) + 64 <= (size_t)opts.stream_bytes;) {
+    if (rng() % 16 == 0) {
+      generate_token(&p);
+    }
+    else {
+      for (i = 1 + rng() % 60; i != 0; --i) {
+        *p++ = (unsigned char)(' ' + rng() % 95);
+      }
+      put(&p, "\r\n", 2);
+    }
+  }
+  size = (size_t)(p - stream);
+  total = (size_t)opts.bench_mb * 1000000u;
+  if (total > 0) {
+    size_t ref_events, dfa_events, inplace_events;
+    double ref = bench(stream, size, TELNET_FLAG_NVT_EOL, 0, total, &ref_events);
+    double dfa = bench(stream, size, TELNET_FLAG_NVT_EOL | TELNET_FLAG_DFA, 0, total, &dfa_events);
+    double inplace = bench(stream, size, TELNET_FLAG_NVT_EOL, 1, total, &inplace_events);
+
+    printf("switch: %.1f MB/s, dfa: %.1f MB/s (%.2fx)\n", ref, dfa, dfa / ref);
+    printf("in place: %.1f MB/s, %zu DATA events instead of %zu (%.1fx fewer)\n", inplace, inplace_events,
+           ref_events, (double)ref_events / (double)inplace_events);
+  }
+
+  free(stream);
+  return 0;
+}
@@ -0,0 +1,797 @@
+/**
+ * @file telnet_load.c
+ * @brief Loopback multi-client load generator for the Telnet server.
+ *
+ * Opens many concurrent client connections against a running server and drives one
+ * of several workloads through the regular libtelnet client state machine. The tool
+ * does not embed the server: start telnet_load_target.c (built for the ESP-IDF `linux`
+ * target, or on a device) first, it provides the `echo` and `bcast` commands.
+ *
+ *   login      connect, log in, disconnect, repeat (login storm)
+ *   echo       log in once, then send `echo` lines and wait for each to come back
+ *   paste      log in once, then push lines as fast as the socket accepts them
+ *   broadcast  log in once, a few senders flood `bcast` lines that every client receives
+ *   keys       log in once, then type a key or erase it and wait for the echo
+ *              (server in character mode)
+ *
+ * At the end it reports connections/sec, lines/sec, p50/p99/p999 latency of the
+ * first prompt, the login and lines and, when the server PID is given, the server
+ * CPU usage.
+ *
+ * Build on the host:
+ *
+ *   cc -O2 -Isrc -o telnet_load tools/telnet_load.c src/libtelnet.c
+ *   cc -O2 -Isrc -DHAVE_ZLIB -o telnet_load tools/telnet_load.c src/libtelnet.c -lz
+ *
+ * The second form is required for `--compress on`.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libtelnet.h>
+
+/**
+ * @brief Size of the per-client receive window used for reply matching.
+ */
+#define RX_WINDOW_SIZE 1024
+
+/**
+ * @brief Delay before a rejected or dropped client reconnects (microseconds).
+ */
+#define RECONNECT_DELAY_US 100000
+
+/**
+ * @brief Maximum number of lines a paste client writes per loop iteration.
+ */
+#define PASTE_BURST_LINES 64
+
+enum workload_t {
+  WORKLOAD_LOGIN = 0,
+  WORKLOAD_ECHO,
+  WORKLOAD_PASTE,
+  WORKLOAD_BROADCAST,
+  WORKLOAD_KEYS,
+};
+
+enum client_state_t {
+  CLIENT_IDLE = 0,
+  CLIENT_CONNECTING,
+  CLIENT_WAIT_PROMPT,
+  CLIENT_WAIT_WELCOME,
+  CLIENT_RUNNING,
+  CLIENT_WAIT_REPLY,
+};
+
+/**
+ * @brief Growable array of latency samples in microseconds.
+ */
+struct samples_t {
+  uint32_t* data;
+  size_t count;
+  size_t size;
+};
+
+struct client_t {
+  int index;
+  int sock;
+  int generation;
+  enum client_state_t state;
+  telnet_t* telnet;
+  uint64_t t_connect;
+  uint64_t t_request;
+  uint64_t t_next;
+  unsigned seq;
+  char expect[64];
+  char rx[RX_WINDOW_SIZE];
+  size_t rxlen;
+  /* pending output that did not fit into the socket buffer */
+  char* tx;
+  size_t txlen;
+  size_t txsize;
+};
+
+struct options_t {
+  const char* host;
+  int port;
+  int clients;
+  int duration;
+  enum workload_t workload;
+  int compress;
+  int line_bytes;
+  int interval_ms;
+  int senders;
+  int timeout_ms;
+  int server_pid;
+};
+
+static struct options_t opts = {
+  .host = "127.0.0.1",
+  .port = 23,
+  .clients = 100,
+  .duration = 10,
+  .workload = WORKLOAD_LOGIN,
+  .compress = 0,
+  .line_bytes = 64,
+  .interval_ms = 100,
+  .senders = 1,
+  .timeout_ms = 2000,
+  .server_pid = 0,
+};
+
+static struct {
+  uint64_t connects;
+  uint64_t logins;
+  uint64_t rejected;
+  uint64_t failures;
+  uint64_t lines_sent;
+  uint64_t lines_received;
+  uint64_t timeouts;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  struct samples_t prompt_latency;
+  struct samples_t login_latency;
+  struct samples_t line_latency;
+  struct samples_t key_latency;
+} stats;
+
+static telnet_telopt_t client_telopts[] = {
+  {TELNET_TELOPT_COMPRESS2, TELNET_WONT, TELNET_DONT},
+  {TELNET_TELOPT_ECHO, TELNET_WONT, TELNET_DO},
+  {TELNET_TELOPT_SGA, TELNET_WONT, TELNET_DO},
+  {-1, 0, 0},
+};
+
+static struct client_t* clients;
+static struct pollfd* pfd;
+static char* payload;
+
+/**
+ * @brief Returns a monotonic timestamp in microseconds.
+ */
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/**
+ * @brief Appends a latency sample.
+ */
+static void samples_push(struct samples_t* s, uint64_t value)
+{
+  if (s->count == s->size) {
+    size_t size = s->size ? s->size * 2 : 4096;
+    uint32_t* data = realloc(s->data, size * sizeof(*data));
+    if (data == NULL) {
+      return;
+    }
+    s->data = data;
+    s->size = size;
+  }
+  s->data[s->count++] = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+}
+
+static int samples_cmp(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Returns the requested percentile of a sorted sample set in microseconds.
+ */
+static uint32_t samples_percentile(const struct samples_t* s, double p)
+{
+  size_t i;
+
+  if (s->count == 0) {
+    return 0;
+  }
+  i = (size_t)(p * (double)(s->count - 1) + 0.5);
+  return s->data[i];
+}
+
+/**
+ * @brief Reads the accumulated user+system CPU time of a process in clock ticks.
+ */
+static long long process_cpu_ticks(int pid)
+{
+  char path[64];
+  char buf[1024];
+  char* p;
+  FILE* f;
+  size_t n;
+  unsigned long utime, stime;
+  int i;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((f = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = 0;
+
+  /* skip "pid (comm)" -- comm may contain spaces, so look for the last ')' */
+  if ((p = strrchr(buf, ')')) == NULL) {
+    return -1;
+  }
+  /* fields after comm start at 3 (state); utime and stime are fields 14 and 15 */
+  for (i = 0; i < 11 && p != NULL; ++i) {
+    p = strchr(p + 1, ' ');
+  }
+  if (p == NULL || sscanf(p + 1, "%*s %lu %lu", &utime, &stime) != 2) {
+    return -1;
+  }
+  return (long long)(utime + stime);
+}
+
+/**
+ * @brief Queues or writes raw bytes to a client socket without blocking.
+ */
+static void client_write(struct client_t* c, const char* buffer, size_t size)
+{
+  ssize_t rs;
+
+  if (c->sock == -1) {
+    return;
+  }
+
+  if (c->txlen == 0) {
+    rs = send(c->sock, buffer, size, MSG_NOSIGNAL);
+    if (rs > 0) {
+      stats.bytes_sent += rs;
+      buffer += rs;
+      size -= rs;
+    }
+    else if (rs == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return;
+    }
+  }
+
+  if (size == 0) {
+    return;
+  }
+
+  if (c->txlen + size > c->txsize) {
+    size_t txsize = (c->txlen + size) * 2;
+    char* tx = realloc(c->tx, txsize);
+    if (tx == NULL) {
+      return;
+    }
+    c->tx = tx;
+    c->txsize = txsize;
+  }
+  memcpy(c->tx + c->txlen, buffer, size);
+  c->txlen += size;
+}
+
+/**
+ * @brief Flushes queued output of a client.
+ */
+static void client_flush(struct client_t* c)
+{
+  ssize_t rs;
+
+  while (c->sock != -1 && c->txlen > 0) {
+    rs = send(c->sock, c->tx, c->txlen, MSG_NOSIGNAL);
+    if (rs <= 0) {
+      return;
+    }
+    stats.bytes_sent += rs;
+    memmove(c->tx, c->tx + rs, c->txlen - rs);
+    c->txlen -= rs;
+  }
+}
+
+/**
+ * @brief Returns non-zero if the receive window contains the given marker and consumes it.
+ */
+static int client_match(struct client_t* c, const char* marker)
+{
+  char* p;
+
+  c->rx[c->rxlen] = 0;
+  if ((p = strstr(c->rx, marker)) == NULL) {
+    return 0;
+  }
+  p += strlen(marker);
+  c->rxlen -= p - c->rx;
+  memmove(c->rx, p, c->rxlen);
+  return 1;
+}
+
+/**
+ * @brief Scans broadcast lines in the receive window and records their latency.
+ *
+ * Broadcast payloads carry the send timestamp so every receiver can measure
+ * the fan-out latency on its own.
+ */
+static void client_scan_broadcast(struct client_t* c)
+{
+  unsigned long long sent;
+  char* p;
+  char* eol;
+
+  c->rx[c->rxlen] = 0;
+  p = c->rx;
+  while ((eol = strchr(p, '\n')) != NULL) {
+    char* tag = strstr(p, "bcast@");
+    if (tag != NULL && tag < eol && sscanf(tag, "bcast@%llu", &sent) == 1) {
+      stats.lines_received++;
+      samples_push(&stats.line_latency, now_us() - sent);
+    }
+    p = eol + 1;
+  }
+  c->rxlen -= p - c->rx;
+  memmove(c->rx, p, c->rxlen);
+}
+
+static void client_close(struct client_t* c, uint64_t reconnect_at);
+
+/**
+ * @brief libtelnet event handler for load clients.
+ */
+static void client_event(telnet_t* telnet, telnet_event_t* ev, void* user_data)
+{
+  struct client_t* c = (struct client_t*)user_data;
+  size_t n;
+
+  (void)telnet;
+
+  switch (ev->type) {
+  case TELNET_EV_DATA:
+    /* keep only the tail of the stream, markers are short */
+    n = ev->data.size;
+    if (n > RX_WINDOW_SIZE - 1) {
+      ev->data.buffer += n - (RX_WINDOW_SIZE - 1);
+      n = RX_WINDOW_SIZE - 1;
+    }
+    if (c->rxlen + n > RX_WINDOW_SIZE - 1) {
+      size_t drop = c->rxlen + n - (RX_WINDOW_SIZE - 1);
+      memmove(c->rx, c->rx + drop, c->rxlen - drop);
+      c->rxlen -= drop;
+    }
+    memcpy(c->rx + c->rxlen, ev->data.buffer, n);
+    c->rxlen += n;
+    break;
+  case TELNET_EV_SEND: client_write(c, ev->data.buffer, ev->data.size); break;
+  case TELNET_EV_ERROR:
+    /* cannot free the tracker from inside its own callback, let recv() see EOF */
+    stats.failures++;
+    shutdown(c->sock, SHUT_RDWR);
+    break;
+  default: break;
+  }
+}
+
+/**
+ * @brief Closes a client connection and schedules its reconnect.
+ */
+static void client_close(struct client_t* c, uint64_t reconnect_at)
+{
+  if (c->sock != -1) {
+    close(c->sock);
+    c->sock = -1;
+  }
+  if (c->telnet != NULL) {
+    telnet_t* telnet = c->telnet;
+    c->telnet = NULL;
+    telnet_free(telnet);
+  }
+  c->rxlen = 0;
+  c->txlen = 0;
+  c->state = CLIENT_IDLE;
+  c->t_next = reconnect_at;
+}
+
+/**
+ * @brief Starts a non-blocking connect for an idle client.
+ */
+static void client_connect(struct client_t* c, const struct sockaddr_in* addr)
+{
+  int one = 1;
+
+  if ((c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+    stats.failures++;
+    c->t_next = now_us() + RECONNECT_DELAY_US;
+    return;
+  }
+  setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  c->t_connect = now_us();
+  c->generation++;
+  c->telnet = telnet_init(client_telopts, client_event, 0, c);
+  c->state = CLIENT_CONNECTING;
+  if (connect(c->sock, (const struct sockaddr*)addr, sizeof(*addr)) == -1 && errno != EINPROGRESS) {
+    stats.failures++;
+    client_close(c, now_us() + RECONNECT_DELAY_US);
+  }
+}
+
+/**
+ * @brief Sends the next workload line for a logged in client.
+ */
+static void client_send_line(struct client_t* c, uint64_t now)
+{
+  int i;
+
+  switch (opts.workload) {
+  case WORKLOAD_ECHO:
+    snprintf(c->expect, sizeof(c->expect), "echo-%d-%u", c->index, c->seq++);
+    telnet_printf(c->telnet, "echo %s %.*s\n", c->expect, opts.line_bytes, payload);
+    c->t_request = now;
+    c->state = CLIENT_WAIT_REPLY;
+    break;
+  case WORKLOAD_PASTE:
+    /* keep the socket buffer full, but never queue more than a few lines locally */
+    for (i = 0; i != PASTE_BURST_LINES && c->txlen < (size_t)opts.line_bytes * 4; ++i) {
+      telnet_printf(c->telnet, "%.*s\n", opts.line_bytes, payload);
+      stats.lines_sent++;
+    }
+    return;
+  case WORKLOAD_KEYS:
+    /* the line never grows: every other keystroke erases the previous one */
+    if (c->seq++ % 2 == 0) {
+      c->expect[0] = payload[c->seq / 2 % opts.line_bytes];
+      c->expect[1] = 0;
+      telnet_send(c->telnet, c->expect, 1);
+    }
+    else {
+      strcpy(c->expect, "\b \b");
+      telnet_send(c->telnet, "\x7f", 1);
+    }
+    c->t_request = now;
+    c->state = CLIENT_WAIT_REPLY;
+    return;
+  case WORKLOAD_BROADCAST:
+    if (c->index >= opts.senders) {
+      return;
+    }
+    telnet_printf(c->telnet, "bcast bcast@%llu %.*s\n", (unsigned long long)now, opts.line_bytes, payload);
+    c->t_next = now + (uint64_t)opts.interval_ms * 1000u;
+    break;
+  default: return;
+  }
+  stats.lines_sent++;
+}
+
+/**
+ * @brief Advances the client state machine after input or a timer tick.
+ */
+static void client_step(struct client_t* c, uint64_t now)
+{
+  char name[32];
+
+  switch (c->state) {
+  case CLIENT_WAIT_PROMPT:
+    if (client_match(c, "Too many users.")) {
+      stats.rejected++;
+      client_close(c, now + RECONNECT_DELAY_US);
+    }
+    else if (client_match(c, "Enter name: ")) {
+      samples_push(&stats.prompt_latency, now - c->t_connect);
+      snprintf(name, sizeof(name), "load%dg%d", c->index, c->generation);
+      telnet_printf(c->telnet, "%s\n", name);
+      c->state = CLIENT_WAIT_WELCOME;
+    }
+    break;
+  case CLIENT_WAIT_WELCOME:
+    if (client_match(c, "Welcome, ")) {
+      stats.logins++;
+      samples_push(&stats.login_latency, now - c->t_connect);
+      if (opts.workload == WORKLOAD_LOGIN) {
+        client_close(c, now);
+        break;
+      }
+      c->rxlen = 0;
+      c->state = CLIENT_RUNNING;
+      c->t_next = now;
+    }
+    else if (client_match(c, "Enter name: ")) {
+      /* name rejected, the server asks again */
+      snprintf(name, sizeof(name), "load%dg%dr", c->index, ++c->generation);
+      telnet_printf(c->telnet, "%s\n", name);
+    }
+    break;
+  case CLIENT_RUNNING:
+    if (opts.workload == WORKLOAD_BROADCAST) {
+      client_scan_broadcast(c);
+    }
+    else {
+      c->rxlen = 0;
+    }
+    if (now >= c->t_next) {
+      client_send_line(c, now);
+    }
+    break;
+  case CLIENT_WAIT_REPLY:
+    if (client_match(c, c->expect)) {
+      if (opts.workload == WORKLOAD_KEYS) {
+        samples_push(&stats.key_latency, now - c->t_request);
+      }
+      else {
+        stats.lines_received++;
+        samples_push(&stats.line_latency, now - c->t_request);
+      }
+      c->rxlen = 0;
+      c->state = CLIENT_RUNNING;
+      c->t_next = now + (uint64_t)opts.interval_ms * 1000u;
+    }
+    else if (now - c->t_request > (uint64_t)opts.timeout_ms * 1000u) {
+      stats.timeouts++;
+      c->state = CLIENT_RUNNING;
+      c->t_next = now;
+    }
+    break;
+  default: break;
+  }
+}
+
+/**
+ * @brief Prints a latency line for a sample set.
+ */
+static void report_latency(const char* label, struct samples_t* s)
+{
+  qsort(s->data, s->count, sizeof(*s->data), samples_cmp);
+  printf("%-16s n=%zu p50=%.3fms p99=%.3fms p999=%.3fms\n", label, s->count, samples_percentile(s, 0.50) / 1000.0,
+         samples_percentile(s, 0.99) / 1000.0, samples_percentile(s, 0.999) / 1000.0);
+}
+
+static void usage(const char* argv0)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --host ADDR          server address (127.0.0.1)\n"
+          "  --port N             server port (23)\n"
+          "  --clients N          concurrent clients (100)\n"
+          "  --duration S         run time in seconds (10)\n"
+          "  --workload W         login | echo | paste | broadcast | keys (login)\n"
+          "  --compress on|off    accept COMPRESS2 from the server (off)\n"
+          "  --line-bytes N       payload bytes per line (64)\n"
+          "  --interval MS        think time between lines (100)\n"
+          "  --senders N          broadcast senders (1)\n"
+          "  --timeout MS         reply timeout for echo (2000)\n"
+          "  --pid PID            server process to sample CPU usage from\n",
+          argv0);
+}
+
+static int parse_options(int argc, char** argv)
+{
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (val == NULL) {
+      return -1;
+    }
+    if (strcmp(arg, "--host") == 0) {
+      opts.host = val;
+    }
+    else if (strcmp(arg, "--port") == 0) {
+      opts.port = atoi(val);
+    }
+    else if (strcmp(arg, "--clients") == 0) {
+      opts.clients = atoi(val);
+    }
+    else if (strcmp(arg, "--duration") == 0) {
+      opts.duration = atoi(val);
+    }
+    else if (strcmp(arg, "--workload") == 0) {
+      if (strcmp(val, "login") == 0) {
+        opts.workload = WORKLOAD_LOGIN;
+      }
+      else if (strcmp(val, "echo") == 0) {
+        opts.workload = WORKLOAD_ECHO;
+      }
+      else if (strcmp(val, "paste") == 0) {
+        opts.workload = WORKLOAD_PASTE;
+      }
+      else if (strcmp(val, "broadcast") == 0) {
+        opts.workload = WORKLOAD_BROADCAST;
+      }
+      else if (strcmp(val, "keys") == 0) {
+        opts.workload = WORKLOAD_KEYS;
+      }
+      else {
+        return -1;
+      }
+    }
+    else if (strcmp(arg, "--compress") == 0) {
+      opts.compress = strcmp(val, "on") == 0;
+    }
+    else if (strcmp(arg, "--line-bytes") == 0) {
+      opts.line_bytes = atoi(val);
+    }
+    else if (strcmp(arg, "--interval") == 0) {
+      opts.interval_ms = atoi(val);
+    }
+    else if (strcmp(arg, "--senders") == 0) {
+      opts.senders = atoi(val);
+    }
+    else if (strcmp(arg, "--timeout") == 0) {
+      opts.timeout_ms = atoi(val);
+    }
+    else if (strcmp(arg, "--pid") == 0) {
+      opts.server_pid = atoi(val);
+    }
+    else {
+      return -1;
+    }
+    ++i;
+  }
+
+  return opts.clients > 0 && opts.duration > 0 && opts.line_bytes > 0 ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+  struct sockaddr_in addr;
+  uint64_t t_start, t_end, now;
+  long long cpu_start = -1, cpu_end = -1;
+  double elapsed;
+  int i, rs;
+
+  if (parse_options(argc, argv) != 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+#if !defined(HAVE_ZLIB)
+  if (opts.compress) {
+    fprintf(stderr, "--compress on requires building with -DHAVE_ZLIB\n");
+    return 2;
+  }
+#endif
+  client_telopts[0].him = opts.compress ? TELNET_DO : TELNET_DONT;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(opts.port);
+  if (inet_pton(AF_INET, opts.host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "invalid address: %s\n", opts.host);
+    return 2;
+  }
+
+  clients = calloc(opts.clients, sizeof(*clients));
+  pfd = calloc(opts.clients, sizeof(*pfd));
+  payload = malloc(opts.line_bytes);
+  if (clients == NULL || pfd == NULL || payload == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (i = 0; i != opts.line_bytes; ++i) {
+    payload[i] = 'a' + i % 26;
+  }
+
+  if (opts.server_pid > 0) {
+    cpu_start = process_cpu_ticks(opts.server_pid);
+  }
+
+  t_start = now_us();
+  t_end = t_start + (uint64_t)opts.duration * 1000000u;
+  for (i = 0; i != opts.clients; ++i) {
+    clients[i].index = i;
+    clients[i].sock = -1;
+    clients[i].t_next = t_start;
+  }
+
+  while ((now = now_us()) < t_end) {
+    /* (re)connect idle clients whose backoff expired */
+    for (i = 0; i != opts.clients; ++i) {
+      if (clients[i].state == CLIENT_IDLE && now >= clients[i].t_next) {
+        client_connect(&clients[i], &addr);
+        stats.connects++;
+      }
+      pfd[i].fd = clients[i].sock;
+      pfd[i].events = POLLIN;
+      if (clients[i].state == CLIENT_CONNECTING || clients[i].txlen > 0) {
+        pfd[i].events |= POLLOUT;
+      }
+      pfd[i].revents = 0;
+    }
+
+    rs = poll(pfd, opts.clients, 1);
+    if (rs == -1 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    now = now_us();
+    for (i = 0; i != opts.clients; ++i) {
+      struct client_t* c = &clients[i];
+      char buffer[4096];
+      ssize_t n;
+
+      if (c->sock == -1) {
+        continue;
+      }
+
+      if (c->state == CLIENT_CONNECTING && (pfd[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+          stats.failures++;
+          client_close(c, now + RECONNECT_DELAY_US);
+          continue;
+        }
+        c->state = CLIENT_WAIT_PROMPT;
+      }
+
+      if (pfd[i].revents & POLLOUT) {
+        client_flush(c);
+      }
+
+      if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        while (c->sock != -1 && (n = recv(c->sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+          stats.bytes_received += n;
+          telnet_recv(c->telnet, buffer, n);
+        }
+        if (c->sock != -1 && (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))) {
+          /* an expected close after "Too many users." is handled by the matcher */
+          client_step(c, now);
+          if (c->sock != -1) {
+            stats.failures += c->state != CLIENT_IDLE;
+            client_close(c, now + RECONNECT_DELAY_US);
+          }
+          continue;
+        }
+      }
+
+      client_step(c, now);
+    }
+  }
+
+  if (opts.server_pid > 0) {
+    cpu_end = process_cpu_ticks(opts.server_pid);
+  }
+  elapsed = (now_us() - t_start) / 1e6;
+
+  printf("workload         %s, %d clients, %.1fs, compress %s\n",
+         (const char*[]){"login", "echo", "paste", "broadcast", "keys"}[opts.workload], opts.clients, elapsed,
+         opts.compress ? "on" : "off");
+  printf("connections/sec  %.1f (%llu attempts, %llu rejected, %llu failures)\n", stats.logins / elapsed,
+         (unsigned long long)stats.connects, (unsigned long long)stats.rejected, (unsigned long long)stats.failures);
+  printf("lines/sec        sent %.1f, received %.1f, timeouts %llu\n", stats.lines_sent / elapsed,
+         stats.lines_received / elapsed, (unsigned long long)stats.timeouts);
+  printf("bytes/sec        sent %.0f, received %.0f\n", stats.bytes_sent / elapsed, stats.bytes_received / elapsed);
+  report_latency("prompt latency", &stats.prompt_latency);
+  report_latency("login latency", &stats.login_latency);
+  report_latency("line latency", &stats.line_latency);
+  report_latency("key latency", &stats.key_latency);
+  if (cpu_start >= 0 && cpu_end >= 0) {
+    printf("server cpu       %.1f%%\n", 100.0 * (cpu_end - cpu_start) / sysconf(_SC_CLK_TCK) / elapsed);
+  }
+
+  for (i = 0; i != opts.clients; ++i) {
+    client_close(&clients[i], 0);
+    free(clients[i].tx);
+  }
+  free(clients);
+  free(pfd);
+  free(payload);
+  free(stats.prompt_latency.data);
+  free(stats.login_latency.data);
+  free(stats.line_latency.data);
+  free(stats.key_latency.data);
+  return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * @file telnet_load_target.c
+ * @brief Server side of the load generator in telnet_load.c.
+ *
+ * The `app_main()` of an ESP-IDF project; built for the `linux` target it runs the server task
+ * on the host, built for a device it serves the tool over the network. Besides the built-in
+ * login it registers the commands the line workloads rely on:
+ *
+ *   echo TEXT   sends TEXT back to the sender (`echo` workload)
+ *   bcast TEXT  queues TEXT for every logged in session (`broadcast` workload)
+ *
+ * The session table grows up to TELNET_LOAD_MAX_CONNECTIONS, so hundreds of clients fit without
+ * changing `CONFIG_TELNET_SERVER_MAX_CONNECTIONS` (static allocation keeps the Kconfig size).
+ * Everything else comes from Kconfig, which is what the tool is meant to compare.
+ */
+
+#include <string.h>
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <telnet/server.h>
+
+#ifndef TELNET_LOAD_MAX_CONNECTIONS
+#define TELNET_LOAD_MAX_CONNECTIONS 512
+#endif
+
+static const char* TAG = "telnet_load";
+
+static void _echo(telnet_cmd_t* cmd, const char* args, void* arg)
+{
+  (void)arg;
+
+  telnet_cmd_printf(cmd, "%s\n", args);
+}
+
+static void _bcast(telnet_cmd_t* cmd, const char* args, void* arg)
+{
+  size_t len = strlen(args);
+  char* buffer;
+
+  (void)arg;
+
+  if ((buffer = telnet_server_alloc(len + 1)) == NULL) {
+    telnet_cmd_printf(cmd, "Out of memory.\n");
+    return;
+  }
+  memcpy(buffer, args, len);
+  buffer[len] = '\n';
+
+  /* the server task must not wait for room, a full queue drops the line */
+  if (telnet_server_broadcast(buffer, len + 1, 0) != ESP_OK) {
+    telnet_cmd_printf(cmd, "Dropped.\n");
+  }
+}
+
+static const telnet_command_t commands[] = {
+  {"echo", _echo, NULL, false},
+  {"bcast", _bcast, NULL, false},
+  {NULL, NULL, NULL, false},
+};
+
+void app_main(void)
+{
+  static telnet_server_config_t config = TELNET_SERVER_DEFAULT_CONFIG;
+
+#if !CONFIG_TELNET_SERVER_STATIC_ALLOCATION
+  config.max_connections = TELNET_LOAD_MAX_CONNECTIONS;
+#endif
+  config.commands = commands;
+  if (telnet_server_create(&config) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to start the server");
+  }
+}